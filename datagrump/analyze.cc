@@ -0,0 +1,59 @@
+/* summarizes a link log from mm-link (or the emulator's log=FILE) as
+   mm-throughput-graph does, in one pass over a block at a time, so logs
+   of any length take memory only for the histograms of delays */
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "file_descriptor.hh"
+#include "log_analyzer.hh"
+
+using namespace std;
+
+int main( int argc, char *argv[] )
+{
+   /* check the command-line arguments */
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  if ( argc > 2 ) {
+    cerr << "Usage: " << argv[ 0 ] << " [LOGFILE]   (reads stdin if no LOGFILE or -)" << endl;
+    return EXIT_FAILURE;
+  }
+
+  const string filename = argc == 2 ? argv[ 1 ] : "-";
+  FileDescriptor log( filename == "-"
+		      ? STDIN_FILENO
+		      : SystemCall( "open " + filename, open( filename.c_str(), O_RDONLY | O_CLOEXEC ) ) );
+
+  /* it will be read front to back (no harm if it's a pipe) */
+  posix_fadvise( log.fd_num(), 0, 0, POSIX_FADV_SEQUENTIAL );
+
+  LinkLogAnalyzer analyzer;
+  vector<char> block( 1 << 20 );
+  while ( true ) {
+    const size_t length = log.read( block.data(), block.size() );
+    if ( length == 0 ) {
+      break;
+    }
+    analyzer.parse( block.data(), length );
+  }
+
+  const LinkLogAnalyzer::Summary summary = analyzer.summary();
+
+  cout << fixed << setprecision( 2 );
+  cout << "Average capacity: " << summary.capacity_mbps << " Mbits/s" << endl;
+  cout << "Average throughput: " << summary.throughput_mbps << " Mbits/s ("
+       << setprecision( 1 ) << 100 * summary.utilization() << "% utilization)" << endl;
+  cout << setprecision( 0 );
+  cout << "95th percentile per-packet queueing delay: " << summary.delay_p95_ms << " ms" << endl;
+  cout << "95th percentile signal delay: " << summary.signal_delay_p95_ms << " ms" << endl;
+
+  return EXIT_SUCCESS;
+}
@@ -1,4 +1,5 @@
 #include <stdexcept>
+#include <cstring>
 
 #include "contest_message.hh"
 #include "timestamp.hh"
@@ -31,38 +32,48 @@ ContestMessage::Header::Header( const string & str )
 /* Parse incoming message from wire */
 ContestMessage::ContestMessage( const string & str )
   : header( str ),
-    payload( str.begin() + sizeof( header ), str.end() )
+    payload( str.begin() + Header::WIRE_SIZE, str.end() )
 {}
 
 /* Fill in the send_timestamp for an outgoing message */
 void ContestMessage::set_send_timestamp( void )
 {
-  header.send_timestamp = timestamp_ms();
+  header.send_timestamp = timestamp_us();
 }
 
-/* helper to put a uint64_t field (in network byte order) */
-string put_header_field( const uint64_t n )
+/* helper to put the nth uint64_t field (in network byte order) */
+void put_header_field( const size_t n, const uint64_t value, char * buffer )
 {
-  const uint64_t network_order = htobe64( n );
-  return string( reinterpret_cast<const char *>( &network_order ),
-		 sizeof( network_order ) );
+  const uint64_t network_order = htobe64( value );
+  memcpy( buffer + n * sizeof( uint64_t ), &network_order, sizeof( network_order ) );
+}
+
+/* Write wire representation of header into buffer */
+void ContestMessage::Header::serialize( char * buffer ) const
+{
+  put_header_field( 0, sequence_number, buffer );
+  put_header_field( 1, send_timestamp, buffer );
+  put_header_field( 2, ack_sequence_number, buffer );
+  put_header_field( 3, ack_send_timestamp, buffer );
+  put_header_field( 4, ack_recv_timestamp, buffer );
+  put_header_field( 5, ack_payload_length, buffer );
 }
 
 /* Make wire representation of header */
 string ContestMessage::Header::to_string( void ) const
 {
-  return put_header_field( sequence_number )
-    + put_header_field( send_timestamp )
-    + put_header_field( ack_sequence_number )
-    + put_header_field( ack_send_timestamp )
-    + put_header_field( ack_recv_timestamp )
-    + put_header_field( ack_payload_length );
+  string ret( WIRE_SIZE, 0 );
+  serialize( &ret[ 0 ] );
+  return ret;
 }
 
 /* Make wire representation of message */
 string ContestMessage::to_string( void ) const
 {
-  return header.to_string() + payload;
+  string ret( Header::WIRE_SIZE + payload.size(), 0 );
+  header.serialize( &ret[ 0 ] );
+  payload.copy( &ret[ Header::WIRE_SIZE ], payload.size() );
+  return ret;
 }
 
 /* Transform into an ack of the ContestMessage */
@@ -106,3 +117,95 @@ bool ContestMessage::is_ack( void ) const
 {
   return header.ack_sequence_number != uint64_t( -1 );
 }
+
+/* View a message in place */
+ContestMessageView::ContestMessageView( char * buffer, const size_t length )
+  : buffer_( buffer ), length_( length )
+{
+  if ( length_ < ContestMessage::Header::WIRE_SIZE ) {
+    throw runtime_error( "contest message too small to contain header" );
+  }
+}
+
+/* Write the header of a new message in place */
+ContestMessageView ContestMessageView::make( char * buffer, const uint64_t sequence_number )
+{
+  ContestMessageView message( buffer, ContestMessage::Header::WIRE_SIZE );
+  message.put( SequenceNumber, sequence_number );
+  message.put( SendTimestamp, -1 );
+  message.put( AckSequenceNumber, -1 );
+  message.put( AckSendTimestamp, -1 );
+  message.put( AckRecvTimestamp, -1 );
+  message.put( AckPayloadLength, -1 );
+  return message;
+}
+
+/* Fill in the send_timestamp for an outgoing message */
+void ContestMessageView::set_send_timestamp( void )
+{
+  set_send_timestamp( timestamp_us() );
+}
+
+/* Transform into an ack of the message, in place */
+void ContestMessageView::transform_into_ack( const uint64_t sequence_number,
+					     const uint64_t recv_timestamp )
+{
+  /* ack the old sequence number and send timestamp, and the other fields */
+  set_acked( get( SequenceNumber ), get( SendTimestamp ), recv_timestamp, payload_length() );
+
+  /* now assign a new sequence number for the outgoing ack */
+  put( SequenceNumber, sequence_number );
+
+  /* drop the payload */
+  length_ = ContestMessage::Header::WIRE_SIZE;
+}
+
+/* Fill in what this ack acknowledges */
+void ContestMessageView::set_acked( const uint64_t ack_sequence_number,
+				    const uint64_t ack_send_timestamp,
+				    const uint64_t ack_recv_timestamp,
+				    const uint64_t ack_payload_length )
+{
+  put( AckSequenceNumber, ack_sequence_number );
+  put( AckSendTimestamp, ack_send_timestamp );
+  put( AckRecvTimestamp, ack_recv_timestamp );
+  put( AckPayloadLength, ack_payload_length );
+}
+
+/* View a coalesced ack's payload */
+SelectiveAckView::SelectiveAckView( const char * buffer, const size_t length )
+  : buffer_( buffer ), range_count_( 0 ), sample_count_( 0 )
+{
+  if ( length < PREFIX_SIZE ) {
+    throw runtime_error( "ack payload too small to contain selective acks" );
+  }
+
+  const uint64_t counts = get( buffer_, 1 );
+  range_count_ = counts >> 32;
+  sample_count_ = counts & 0xffffffff;
+
+  if ( length != size( range_count_, sample_count_ ) ) {
+    throw runtime_error( "ack payload does not match its counts of selective acks" );
+  }
+}
+
+/* Write a coalesced ack's payload */
+size_t SelectiveAckView::write( char * buffer, const uint64_t cumulative_ack,
+				const Range * ranges, const uint32_t range_count,
+				const Sample * samples, const uint32_t sample_count )
+{
+  put( buffer, 0, cumulative_ack );
+  put( buffer, 1, ( uint64_t( range_count ) << 32 ) | sample_count );
+
+  size_t n = 2;
+  for ( uint32_t i = 0; i < range_count; i++ ) {
+    put( buffer, n++, ranges[ i ].first );
+    put( buffer, n++, ranges[ i ].end );
+  }
+  for ( uint32_t i = 0; i < sample_count; i++ ) {
+    put( buffer, n++, samples[ i ].sequence_number );
+    put( buffer, n++, samples[ i ].recv_timestamp );
+  }
+
+  return n * sizeof( uint64_t );
+}
@@ -3,9 +3,13 @@
 
 #include <string>
 #include <cstdint>
+#include <cstring>
+
+#include <endian.h>
 
 struct ContestMessage
 {
+  /* timestamps are in microseconds (see timestamp.hh) */
   struct Header {
     uint64_t sequence_number;
     uint64_t send_timestamp;
@@ -21,8 +25,14 @@ struct ContestMessage
     /* Parse header from wire */
     Header( const std::string & str );
 
+    /* Size of the wire representation of header */
+    static const size_t WIRE_SIZE = 6 * sizeof( uint64_t );
+
     /* Make wire representation of header */
     std::string to_string( void ) const;
+
+    /* Write wire representation of header into buffer (of WIRE_SIZE bytes) */
+    void serialize( char * buffer ) const;
   } header;
 
   std::string payload;
@@ -48,4 +58,144 @@ struct ContestMessage
   bool is_ack( void ) const;
 };
 
+/* A contest message in place in the caller's buffer (e.g. a received
+   datagram or an outgoing header): the header fields are read and written
+   there in network byte order, and the payload is whatever follows the
+   header. Nothing is copied or allocated. */
+class ContestMessageView
+{
+private:
+  char * buffer_;
+  size_t length_;
+
+  /* the header's fields, in wire order */
+  enum Field { SequenceNumber, SendTimestamp, AckSequenceNumber,
+	       AckSendTimestamp, AckRecvTimestamp, AckPayloadLength };
+
+  uint64_t get( const Field field ) const
+  {
+    uint64_t network_order;
+    memcpy( &network_order, buffer_ + field * sizeof( uint64_t ), sizeof( network_order ) );
+    return be64toh( network_order );
+  }
+
+  void put( const Field field, const uint64_t value )
+  {
+    const uint64_t network_order = htobe64( value );
+    memcpy( buffer_ + field * sizeof( uint64_t ), &network_order, sizeof( network_order ) );
+  }
+
+public:
+  /* view a message of length bytes (at least the header) in buffer */
+  ContestMessageView( char * buffer, const size_t length );
+
+  /* write the header of a new message into buffer (of at least
+     Header::WIRE_SIZE bytes); the payload is the caller's to add */
+  static ContestMessageView make( char * buffer, const uint64_t sequence_number );
+
+  uint64_t sequence_number( void ) const { return get( SequenceNumber ); }
+  uint64_t send_timestamp( void ) const { return get( SendTimestamp ); }
+  uint64_t ack_sequence_number( void ) const { return get( AckSequenceNumber ); }
+  uint64_t ack_send_timestamp( void ) const { return get( AckSendTimestamp ); }
+  uint64_t ack_recv_timestamp( void ) const { return get( AckRecvTimestamp ); }
+  uint64_t ack_payload_length( void ) const { return get( AckPayloadLength ); }
+
+  /* Fill in the send_timestamp for an outgoing datagram (now, or
+     the given time, e.g. on an emulator's virtual clock) */
+  void set_send_timestamp( void );
+  void set_send_timestamp( const uint64_t timestamp ) { put( SendTimestamp, timestamp ); }
+
+  /* Transform into an ack of the message, in place
+     (dropping the payload, so the ack is just the header) */
+  void transform_into_ack( const uint64_t sequence_number,
+			   const uint64_t recv_timestamp );
+
+  /* Fill in what this (new) ack acknowledges */
+  void set_acked( const uint64_t ack_sequence_number, const uint64_t ack_send_timestamp,
+		  const uint64_t ack_recv_timestamp, const uint64_t ack_payload_length );
+
+  /* Is this message an ack? */
+  bool is_ack( void ) const { return ack_sequence_number() != uint64_t( -1 ); }
+
+  /* the whole message on the wire */
+  char * data( void ) const { return buffer_; }
+  size_t length( void ) const { return length_; }
+
+  const char * payload( void ) const { return buffer_ + ContestMessage::Header::WIRE_SIZE; }
+  size_t payload_length( void ) const { return length_ - ContestMessage::Header::WIRE_SIZE; }
+};
+
+/* The payload of a coalesced ack, which acknowledges several datagrams at
+   once: its header acknowledges the newest one, as usual, and the payload
+   has the others' sequence numbers and receive times (so each still gives
+   an RTT sample), then SACK-style ranges of what has been received so far
+   (so a lost ack doesn't make the sender think the datagrams were lost).
+   On the wire, in network byte order:
+
+     cumulative ack (everything before it has been received)
+     range count (high 32 bits) and sample count (low 32 bits)
+     each range: first sequence number, one past the last
+     each sample: sequence number, receive timestamp */
+class SelectiveAckView
+{
+public:
+  struct Range
+  {
+    uint64_t first, end;
+  };
+
+  struct Sample
+  {
+    uint64_t sequence_number, recv_timestamp;
+  };
+
+  /* size of the fixed part (the cumulative ack and counts) */
+  static const size_t PREFIX_SIZE = 2 * sizeof( uint64_t );
+
+private:
+  const char * buffer_;
+  uint32_t range_count_, sample_count_;
+
+  static uint64_t get( const char * buffer, const size_t n )
+  {
+    uint64_t network_order;
+    memcpy( &network_order, buffer + n * sizeof( uint64_t ), sizeof( network_order ) );
+    return be64toh( network_order );
+  }
+
+  static void put( char * buffer, const size_t n, const uint64_t value )
+  {
+    const uint64_t network_order = htobe64( value );
+    memcpy( buffer + n * sizeof( uint64_t ), &network_order, sizeof( network_order ) );
+  }
+
+public:
+  /* view an ack's payload (throws if it isn't a whole one) */
+  SelectiveAckView( const char * buffer, const size_t length );
+
+  /* write a payload into buffer (of at least size() bytes), returning its length */
+  static size_t write( char * buffer, const uint64_t cumulative_ack,
+		       const Range * ranges, const uint32_t range_count,
+		       const Sample * samples, const uint32_t sample_count );
+
+  static size_t size( const uint32_t range_count, const uint32_t sample_count )
+  {
+    return PREFIX_SIZE + ( range_count * sizeof( Range ) + sample_count * sizeof( Sample ) );
+  }
+
+  uint64_t cumulative_ack( void ) const { return get( buffer_, 0 ); }
+
+  uint32_t range_count( void ) const { return range_count_; }
+  Range range( const uint32_t i ) const
+  {
+    return { get( buffer_, 2 + 2 * i ), get( buffer_, 3 + 2 * i ) };
+  }
+
+  uint32_t sample_count( void ) const { return sample_count_; }
+  Sample sample( const uint32_t i ) const
+  {
+    return { get( buffer_, 2 + 2 * range_count_ + 2 * i ), get( buffer_, 3 + 2 * range_count_ + 2 * i ) };
+  }
+};
+
 #endif /* CONTEST_MESSAGE_HH */
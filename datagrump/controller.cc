@@ -1,49 +1,34 @@
-#include <iostream>
+#include <algorithm>
+#include <stdexcept>
 
 #include "controller.hh"
-#include "timestamp.hh"
-#include <climits>
-#include <cstdint>
-#include <vector>
-#include <algorithm>
+#include "controllers.hh"
+#include "event_trace.hh"
 
 using namespace std;
 
-/* Best experimentally found retransmit timer value. */
-#define TIMEOUT 90
-
-/* Best experimentally found timeout retry counter, so
-   setting ssthresh to half of window size and window size
-   to that value +3 happens once every TIMEOUT_RETRY tries.
-   This is to avoid overreacting to consecutive delay since 
-   the primary mechanism for TCP relies on a timer going off 
-   when a packet is lost, we don't want to overcompensate. */
-#define TIMEOUT_RETRY 8
-
-/* Default constructor */
-Controller::Controller( const bool debug)
-  : debug_( debug ), 
-    rtt(0),                 /* Initialize RTT. */
-    wsz(13.0),              /* Initial window size, found experimentally. */
-    slow_start_thresh(500), /* Initial ssthresh, found experimentally. */
-    timeouts(0),            /* Timeout counter. */
-    state(SLOW_START)       /* Begin in slow start state. */
-{
-  debug_ = false;
-}
+const string Controller::DEFAULT_ALGORITHM = "aimd";
+
+const vector<string> Controller::COMMON_OPTION_NAMES = { "min_rto", "max_rto", "bw_rounds", "pacing_gain" };
+
+Controller::Controller( const Options & options )
+  : pacing_gain_( option( options, "pacing_gain", 1.25 ) ),
+    traced_window_( 0 ),
+    latest_timestamp_( 0 ),
+    rtt_( option( options, "min_rto", 10 ) * 1000, option( options, "max_rto", 60000 ) * 1000 ),
+    delivery_( option( options, "bw_rounds", 10 ) ),
+    one_way_delay_()
+{}
 
 /* Get current window size, in datagrams */
 unsigned int Controller::window_size( void )
 {
-  if (wsz < 2)
-    wsz = 2;
+  const unsigned int the_window_size = current_window();
 
-  /* Default: fixed window size of 100 outstanding datagrams */
-  unsigned int the_window_size = (unsigned int) wsz;
-
-  if ( debug_ ) {
-    cerr << "At time " << timestamp_ms()
-     << " window size is " << the_window_size << " || with rtt: " << rtt << endl;
+  /* (until the sender tells us the time, there's nothing to stamp it with) */
+  if ( the_window_size != traced_window_ and latest_timestamp_ ) {
+    EventTrace::record( TraceRecord::Type::Window, latest_timestamp_, 0, the_window_size );
+    traced_window_ = the_window_size;
   }
 
   return the_window_size;
@@ -51,98 +36,186 @@ unsigned int Controller::window_size( void )
 
 /* A datagram was sent */
 void Controller::datagram_was_sent( const uint64_t sequence_number,
-                                    /* of the sent datagram */
-                                    const uint64_t send_timestamp )
-                                    /* in milliseconds */
+				    /* of the sent datagram */
+				    const uint64_t send_timestamp )
+                                    /* in microseconds */
 {
-  if ( debug_ ) {
-    cerr << "At time " << send_timestamp
-     << " sent datagram " << sequence_number << endl;
-  }
+  latest_timestamp_ = max( latest_timestamp_, send_timestamp );
+  EventTrace::record( TraceRecord::Type::Sent, send_timestamp, sequence_number );
+
+  delivery_.sent( sequence_number, send_timestamp );
+  sent( sequence_number, send_timestamp );
 }
 
 /* An ack was received */
 void Controller::ack_received( const uint64_t sequence_number_acked,
-                               /* what sequence number was acknowledged */
-                               const uint64_t send_timestamp_acked,
-                               /* when the acknowledged datagram was sent (sender's clock) */
-                               const uint64_t recv_timestamp_acked,
-                               /* when the acknowledged datagram was received (receiver's clock)*/
-                               const uint64_t timestamp_ack_received )
+			       /* what sequence number was acknowledged */
+			       const uint64_t send_timestamp_acked,
+			       /* when the acknowledged datagram was sent (sender's clock) */
+			       const uint64_t recv_timestamp_acked,
+			       /* when the acknowledged datagram was received (receiver's clock)*/
+			       const uint64_t ack_send_timestamp,
+			       /* when the ack was sent (receiver's clock) */
+			       const uint64_t timestamp_ack_received )
                                /* when the ack was received (by sender) */
+                               /* (all in microseconds) */
 {
-  /* Default: take no action */
-
-  if ( debug_ ) {
-    cerr << "At time " << timestamp_ack_received
-     << " received ack for datagram " << sequence_number_acked
-     << " (send @ time " << send_timestamp_acked
-     << ", received @ time " << recv_timestamp_acked << " by receiver's clock)"
-     << endl;
-  }
+  latest_timestamp_ = max( latest_timestamp_, timestamp_ack_received );
+  EventTrace::record( TraceRecord::Type::Acked, timestamp_ack_received,
+		      sequence_number_acked, send_timestamp_acked );
 
-  rtt = (timestamp_ack_received - send_timestamp_acked);
-
-  if (state == SLOW_START || state == FAST_RECOVERY)
-    {
-      if (rtt >= TIMEOUT)
-        {
-          /* When timeout occurs, do timeout adjustments if several timeouts
-             have occurred and reset the counter, otherwise just increment
-             the counter to avoid overreacting to delay. */
-          if (timeouts < TIMEOUT_RETRY)
-            timeouts++;
-          else
-            {
-              timeouts = 0;
-              slow_start_thresh = wsz / 2;
-              wsz = slow_start_thresh + 3;   /* Set window to sthresh + 3 
-                                                per fast recovery. */
-            }
-        }
-      else if (wsz > slow_start_thresh)
-        {
-          /* Move to congestion avoidance state if window size has grown
-             beyond slow start. */
-          state = CONGEST_AVOID;
-          wsz += (1 / wsz);
-        }
-      else if (state == FAST_RECOVERY)
-        {
-          /* Try to recover faster by doubling growth rate. */
-          wsz += 2;
-        }
-      else
-        /* Increase window size by 1 segment per RTT for initial
-           slow start. */
-        wsz += 1;
-    }
-  else if (state == CONGEST_AVOID)
-    {
-      if (rtt >= TIMEOUT)
-        {
-          /* When timeout occurs, move to fast recovery. */
-          if (timeouts < TIMEOUT_RETRY)
-            timeouts++;
-          else
-            {
-              timeouts = 0;
-              slow_start_thresh = wsz / 2;
-              wsz = slow_start_thresh + 3;   /* Set window to sthresh + 3 
-                                                per fast recovery. */
-            }
-          state = FAST_RECOVERY;
-        }
-      else
-        /* For each RTT, increase by 1/wsz so window size grows 
-           by 1 for each fully received window. */
-        wsz += 1 / wsz;
-    }
+  rtt_.add_sample( send_timestamp_acked, timestamp_ack_received );
+  delivery_.acked( sequence_number_acked, timestamp_ack_received );
+  one_way_delay_.add_sample( send_timestamp_acked, recv_timestamp_acked,
+			     ack_send_timestamp, timestamp_ack_received );
+
+  acked( sequence_number_acked, send_timestamp_acked,
+	 recv_timestamp_acked, timestamp_ack_received );
+}
+
+/* A datagram was given up for lost */
+void Controller::datagram_was_lost( const uint64_t sequence_number,
+				    /* of the lost datagram */
+				    const uint64_t send_timestamp,
+				    /* when it was sent */
+				    const uint64_t timestamp_lost )
+                                    /* when it was found to be lost */
+{
+  latest_timestamp_ = max( latest_timestamp_, timestamp_lost );
+  EventTrace::record( TraceRecord::Type::Lost, timestamp_lost, sequence_number, send_timestamp );
+
+  lost( sequence_number, send_timestamp, timestamp_lost );
 }
 
 /* How long to wait (in milliseconds) if there are no acks
    before sending one more datagram */
 unsigned int Controller::timeout_ms( void )
 {
-  return TIMEOUT;
+  /* rounded up, so the timer never fires early */
+  return ( rtt_.rto_us() + 999 ) / 1000;
+}
+
+/* No ack arrived within that time */
+void Controller::timeout_expired( void )
+{
+  rtt_.back_off();
+
+  EventTrace::record( TraceRecord::Type::Timeout, latest_timestamp_, 0, timeout_ms() );
+
+  timed_out();
+}
+
+/* How fast to send datagrams (per second) */
+double Controller::pacing_rate( void )
+{
+  return current_pacing_rate();
+}
+
+/* by default, algorithms only care about acks */
+void Controller::sent( const uint64_t, const uint64_t )
+{}
+
+void Controller::lost( const uint64_t, const uint64_t, const uint64_t )
+{}
+
+void Controller::timed_out( void )
+{}
+
+/* by default, pace a little faster than a window per RTT, so the window
+   still limits the rate but isn't sent in one burst */
+double Controller::current_pacing_rate( void )
+{
+  if ( pacing_gain_ <= 0 or not rtt_.have_sample() or rtt_.srtt_us() == 0 ) {
+    return 0;
+  }
+
+  return pacing_gain_ * current_window() * 1000000.0 / rtt_.srtt_us();
+}
+
+/* a numeric option, or default_value if it wasn't given */
+double Controller::option( const Options & options, const string & name,
+			   const double default_value )
+{
+  const auto it = options.find( name );
+  if ( it == options.end() ) {
+    return default_value;
+  }
+
+  size_t parsed = 0;
+  double value;
+  try {
+    value = stod( it->second, &parsed );
+  } catch ( const logic_error & ) {
+    parsed = 0;
+  }
+
+  if ( parsed == 0 or parsed != it->second.size() ) {
+    throw runtime_error( "invalid value for controller option " + name + ": " + it->second );
+  }
+
+  return value;
+}
+
+/* the algorithms, by name (starting with the built-in ones) */
+map<string, Controller::Algorithm> & Controller::registry( void )
+{
+  static map<string, Algorithm> algorithms = {
+    { "aimd", { [] ( const Options & options ) {
+	  return unique_ptr<Controller>( new AIMDController( options ) ); },
+	AIMDController::OPTION_NAMES } },
+    { "copa", { [] ( const Options & options ) {
+	  return unique_ptr<Controller>( new CopaController( options ) ); },
+	CopaController::OPTION_NAMES } },
+    { "bbr", { [] ( const Options & options ) {
+	  return unique_ptr<Controller>( new BBRController( options ) ); },
+	BBRController::OPTION_NAMES } },
+    { "fixed", { [] ( const Options & options ) {
+	  return unique_ptr<Controller>( new FixedWindowController( options ) ); },
+	FixedWindowController::OPTION_NAMES } },
+  };
+
+  return algorithms;
+}
+
+/* add an algorithm (replacing any of the same name) */
+void Controller::register_algorithm( const string & name, const Factory & factory,
+				     const vector<string> & option_names )
+{
+  registry().erase( name );
+  registry().emplace( name, Algorithm { factory, option_names } );
+}
+
+/* make a controller running the named algorithm */
+unique_ptr<Controller> Controller::make( const string & name, const Options & options )
+{
+  const auto it = registry().find( name );
+  if ( it == registry().end() ) {
+    throw runtime_error( "unknown congestion-control algorithm: " + name );
+  }
+
+  /* (a misspelled option would otherwise quietly get its default) */
+  vector<string> valid = COMMON_OPTION_NAMES;
+  valid.insert( valid.end(), it->second.option_names.begin(), it->second.option_names.end() );
+
+  for ( const auto & option : options ) {
+    if ( find( valid.begin(), valid.end(), option.first ) == valid.end() ) {
+      string message = "unknown option for " + name + ": " + option.first + " (valid options:";
+      for ( const auto & option_name : valid ) {
+	message += " " + option_name;
+      }
+      throw runtime_error( message + ")" );
+    }
+  }
+
+  return it->second.factory( options );
+}
+
+/* names of the registered algorithms */
+vector<string> Controller::algorithms( void )
+{
+  vector<string> names;
+  for ( const auto & algorithm : registry() ) {
+    names.push_back( algorithm.first );
+  }
+  return names;
 }
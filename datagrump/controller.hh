@@ -2,33 +2,102 @@
 #define CONTROLLER_HH
 
 #include <cstdint>
-#include <list>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
 
-using namespace std;
-
-enum state_t { SLOW_START, CONGEST_AVOID, FAST_RECOVERY };
+#include "estimators.hh"
 
 /* Congestion controller interface */
 
+/* The sender tells the controller about each datagram it sends and each
+   ack it receives, and asks it how many datagrams may be outstanding.
+   Each algorithm subclasses Controller and registers a factory under a
+   name, so the sender can choose one (and tune it) from the command line.
+   What it is told, and each change of window, goes to the event trace
+   (see event_trace.hh) when one is being recorded. */
 class Controller
 {
+public:
+  /* tuning parameters, as name=value pairs from the command line */
+  typedef std::map<std::string, std::string> Options;
+
+  /* makes a controller of one algorithm */
+  typedef std::function<std::unique_ptr<Controller>( const Options & options )> Factory;
+
+  /* the names of the options every algorithm takes (see the constructor) */
+  static const std::vector<std::string> COMMON_OPTION_NAMES;
+
 private:
-  bool debug_; /* Enables debugging output */
+  double pacing_gain_;
+
+  /* for the event trace: the last window traced, and the latest time
+     the sender has told us about */
+  unsigned int traced_window_;
+  uint64_t latest_timestamp_;
+
+  RTTEstimator rtt_;
+  DeliveryRateEstimator delivery_;
+  OneWayDelayEstimator one_way_delay_;
+
+  /* what each algorithm implements (all times are in microseconds) */
+
+  /* current window size, in datagrams */
+  virtual unsigned int current_window( void ) = 0;
+
+  /* a datagram was sent */
+  virtual void sent( const uint64_t sequence_number,
+		     const uint64_t send_timestamp );
+
+  /* an ack was received */
+  virtual void acked( const uint64_t sequence_number_acked,
+		      const uint64_t send_timestamp_acked,
+		      const uint64_t recv_timestamp_acked,
+		      const uint64_t timestamp_ack_received ) = 0;
+
+  /* a datagram was given up for lost */
+  virtual void lost( const uint64_t sequence_number,
+		     const uint64_t send_timestamp,
+		     const uint64_t timestamp_lost );
+
+  /* no ack came within the retransmission timeout */
+  virtual void timed_out( void );
+
+  /* an algorithm: how to make one, and the names of the options it
+     takes besides the common ones */
+  struct Algorithm
+  {
+    Factory factory;
+    std::vector<std::string> option_names;
+  };
 
-  /* Add member variables here */
-  float rtt;
-  float wsz;
-  float slow_start_thresh;
-  int timeouts;
-  state_t state;
+  /* the algorithms, by name */
+  static std::map<std::string, Algorithm> & registry( void );
+
+protected:
+  /* how fast to send, in datagrams per second (0: as fast as the window
+     allows); by default pacing_gain * window / smoothed RTT */
+  virtual double current_pacing_rate( void );
+
+  /* a numeric option, or default_value if it wasn't given */
+  static double option( const Options & options, const std::string & name,
+			const double default_value );
+
+  /* what the acks so far say about the path (updated before acked() runs) */
+  const RTTEstimator & rtt( void ) const { return rtt_; }
+  const DeliveryRateEstimator & delivery( void ) const { return delivery_; }
+  const OneWayDelayEstimator & one_way_delay( void ) const { return one_way_delay_; }
 
 public:
-  /* Public interface for the congestion controller */
-  /* You can change these if you prefer, but will need to change
-     the call site as well (in sender.cc) */
+  /* options for every algorithm: min_rto=10 and max_rto=60000 (in ms),
+     bw_rounds=10 (round trips over which the bottleneck rate is the max),
+     and pacing_gain=1.25 (0 not to pace, unless the algorithm paces itself) */
+  Controller( const Options & options );
+  virtual ~Controller() {}
 
-  /* Default constructor */
-  Controller( const bool debug );
+  /* Public interface for the congestion controller */
 
   /* Get current window size, in datagrams */
   unsigned int window_size( void );
@@ -41,11 +110,44 @@ public:
   void ack_received( const uint64_t sequence_number_acked,
 		     const uint64_t send_timestamp_acked,
 		     const uint64_t recv_timestamp_acked,
+		     const uint64_t ack_send_timestamp,
 		     const uint64_t timestamp_ack_received );
 
+  /* A datagram was given up for lost (it may still be acked later) */
+  void datagram_was_lost( const uint64_t sequence_number,
+			  const uint64_t send_timestamp,
+			  const uint64_t timestamp_lost );
+
   /* How long to wait (in milliseconds) if there are no acks
-     before sending one more datagram */
+     before sending one more datagram (the RTO) */
   unsigned int timeout_ms( void );
+
+  /* No ack arrived within that time (so the timeout backs off) */
+  void timeout_expired( void );
+
+  /* How fast to send datagrams (per second), or 0 for no limit
+     other than the window */
+  double pacing_rate( void );
+
+  /* add an algorithm (replacing any of the same name), which takes the
+     named options besides the common ones */
+  static void register_algorithm( const std::string & name, const Factory & factory,
+				  const std::vector<std::string> & option_names = {} );
+
+  /* make a controller running the named algorithm; throws if there is
+     none, or if it doesn't take one of the options */
+  static std::unique_ptr<Controller> make( const std::string & name,
+					   const Options & options = Options() );
+
+  /* names of the registered algorithms */
+  static std::vector<std::string> algorithms( void );
+
+  /* the algorithm the sender uses unless told otherwise */
+  static const std::string DEFAULT_ALGORITHM;
+
+  /* forbid copying controllers or assigning them */
+  Controller( const Controller & other ) = delete;
+  Controller & operator=( const Controller & other ) = delete;
 };
 
 #endif
@@ -0,0 +1,419 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "controllers.hh"
+
+using namespace std;
+
+/* AIMD */
+
+const vector<string> AIMDController::OPTION_NAMES = { "rtt_threshold", "timeout_retry", "window", "ssthresh" };
+
+AIMDController::AIMDController( const Options & options )
+  : Controller( options ),
+    /* Best experimentally found congestion RTT threshold (this used
+       to double as the retransmit timer). */
+    rtt_threshold_( option( options, "rtt_threshold", 90 ) ),
+    /* Best experimentally found timeout retry counter, so
+       setting ssthresh to half of window size and window size
+       to that value +3 happens once every timeout_retry tries.
+       This is to avoid overreacting to consecutive delay since
+       the primary mechanism for TCP relies on a timer going off
+       when a packet is lost, we don't want to overcompensate. */
+    timeout_retry_( option( options, "timeout_retry", 8 ) ),
+    rtt( 0 ),                                             /* Initialize RTT. */
+    wsz( option( options, "window", 13.0 ) ),             /* Initial window size, found experimentally. */
+    slow_start_thresh( option( options, "ssthresh", 500 ) ), /* Initial ssthresh, found experimentally. */
+    timeouts( 0 ),                                        /* Timeout counter. */
+    state( SLOW_START ),                                  /* Begin in slow start state. */
+    next_sequence_number_( 0 ),
+    recovery_end_( 0 )
+{}
+
+unsigned int AIMDController::current_window( void )
+{
+  if (wsz < 2)
+    wsz = 2;
+
+  return (unsigned int) wsz;
+}
+
+void AIMDController::acked( const uint64_t,
+			    const uint64_t send_timestamp_acked,
+			    const uint64_t,
+			    const uint64_t timestamp_ack_received )
+{
+  /* in milliseconds, with microsecond precision */
+  rtt = (timestamp_ack_received - send_timestamp_acked) / 1000.0;
+
+  if (state == SLOW_START || state == FAST_RECOVERY)
+    {
+      if (rtt >= rtt_threshold_)
+        {
+          /* When timeout occurs, do timeout adjustments if several timeouts
+             have occurred and reset the counter, otherwise just increment
+             the counter to avoid overreacting to delay. */
+          if (timeouts < timeout_retry_)
+            timeouts++;
+          else
+            {
+              timeouts = 0;
+              slow_start_thresh = wsz / 2;
+              wsz = slow_start_thresh + 3;   /* Set window to sthresh + 3
+                                                per fast recovery. */
+            }
+        }
+      else if (wsz > slow_start_thresh)
+        {
+          /* Move to congestion avoidance state if window size has grown
+             beyond slow start. */
+          state = CONGEST_AVOID;
+          wsz += (1 / wsz);
+        }
+      else if (state == FAST_RECOVERY)
+        {
+          /* Try to recover faster by doubling growth rate. */
+          wsz += 2;
+        }
+      else
+        /* Increase window size by 1 segment per RTT for initial
+           slow start. */
+        wsz += 1;
+    }
+  else if (state == CONGEST_AVOID)
+    {
+      if (rtt >= rtt_threshold_)
+        {
+          /* When timeout occurs, move to fast recovery. */
+          if (timeouts < timeout_retry_)
+            timeouts++;
+          else
+            {
+              timeouts = 0;
+              slow_start_thresh = wsz / 2;
+              wsz = slow_start_thresh + 3;   /* Set window to sthresh + 3
+                                                per fast recovery. */
+            }
+          state = FAST_RECOVERY;
+        }
+      else
+        /* For each RTT, increase by 1/wsz so window size grows
+           by 1 for each fully received window. */
+        wsz += 1 / wsz;
+    }
+}
+
+void AIMDController::sent( const uint64_t sequence_number, const uint64_t )
+{
+  next_sequence_number_ = max( next_sequence_number_, sequence_number + 1 );
+}
+
+void AIMDController::lost( const uint64_t sequence_number, const uint64_t, const uint64_t )
+{
+  /* Halve the window once per window of losses (the ones sent
+     before the last halving were already accounted for). */
+  if (sequence_number < recovery_end_)
+    return;
+
+  recovery_end_ = next_sequence_number_;
+  timeouts = 0;
+  slow_start_thresh = wsz / 2;
+  wsz = slow_start_thresh;
+  state = CONGEST_AVOID;
+}
+
+/* Copa */
+
+const vector<string> CopaController::OPTION_NAMES = { "delta", "one_way", "window" };
+
+CopaController::CopaController( const Options & options )
+  : Controller( options ),
+    delta_( option( options, "delta", 0.5 ) ),
+    one_way_( option( options, "one_way", 0 ) ),
+    window_( option( options, "window", 10 ) ),
+    slow_start_( true ),
+    standing_rtt_( 0 ),
+    standing_queueing_( 0 ),
+    velocity_( 1 ),
+    direction_( 0 ),
+    same_direction_rtts_( 0 ),
+    window_at_rtt_start_( window_ ),
+    rtt_start_( 0 )
+{
+  if ( delta_ <= 0 ) {
+    throw runtime_error( "copa: delta must be positive" );
+  }
+}
+
+unsigned int CopaController::current_window( void )
+{
+  return window_;
+}
+
+void CopaController::acked( const uint64_t,
+			    const uint64_t send_timestamp_acked,
+			    const uint64_t,
+			    const uint64_t timestamp_ack_received )
+{
+  if ( timestamp_ack_received < send_timestamp_acked ) {
+    return;
+  }
+
+  const uint64_t now = timestamp_ack_received;
+  const uint64_t rtt = now - send_timestamp_acked;
+
+  /* the standing RTT is the least over the last half a smoothed RTT,
+     which filters out noise from ack compression */
+  const uint64_t min_rtt = Controller::rtt().min_rtt_us();
+  standing_rtt_.set_window( Controller::rtt().srtt_us() / 2 );
+  const uint64_t standing_rtt = standing_rtt_.update( now, rtt );
+
+  /* (the two are minimums over different windows, so the standing RTT
+     can be the smaller) */
+  uint64_t queueing_delay = standing_rtt > min_rtt ? standing_rtt - min_rtt : 0;
+  if ( one_way_ ) {
+    standing_queueing_.set_window( Controller::rtt().srtt_us() / 2 );
+    queueing_delay = standing_queueing_.update( now, one_way_delay().queueing_delay_us() );
+  }
+
+  /* compare the current rate, window / standing RTT, with the target
+     1 / (delta * queueing delay) (both in datagrams per microsecond);
+     an RTT too short to measure means no queue worth slowing for */
+  const bool increase = queueing_delay == 0 or standing_rtt == 0
+    or window_ / standing_rtt <= 1.0 / ( delta_ * queueing_delay );
+
+  if ( slow_start_ ) {
+    if ( increase ) {
+      window_ += 1; /* doubling each RTT */
+    } else {
+      slow_start_ = false;
+    }
+  }
+
+  if ( not slow_start_ ) {
+    const double step = velocity_ / ( delta_ * window_ );
+    window_ += increase ? step : -step;
+  }
+
+  window_ = max( window_, 2.0 );
+
+  update_velocity( now );
+}
+
+/* Copa paces at twice its rate, window / standing RTT */
+double CopaController::current_pacing_rate( void )
+{
+  if ( standing_rtt_.empty() or standing_rtt_.best() == 0 ) {
+    return Controller::current_pacing_rate();
+  }
+
+  return 2 * window_ * 1000000 / standing_rtt_.best();
+}
+
+/* once per RTT: double the velocity once the window has moved the same way
+   for three RTTs, and start over from 1 when it changes direction */
+void CopaController::update_velocity( const uint64_t now )
+{
+  if ( rtt_start_ == 0 ) {
+    rtt_start_ = now;
+    window_at_rtt_start_ = window_;
+    return;
+  }
+
+  if ( now - rtt_start_ < rtt().srtt_us() ) {
+    return;
+  }
+
+  const int direction = window_ > window_at_rtt_start_ ? 1 : -1;
+
+  if ( slow_start_ or direction != direction_ ) {
+    velocity_ = 1;
+    same_direction_rtts_ = 0;
+  } else if ( ++same_direction_rtts_ >= 3 ) {
+    /* (capped so that one ack never moves the window by more than 1 / delta) */
+    velocity_ = min( 2 * velocity_, window_ );
+  }
+
+  direction_ = direction;
+  rtt_start_ = now;
+  window_at_rtt_start_ = window_;
+}
+
+/* BBR */
+
+/* probe for more bandwidth for one min RTT, drain the queue that may
+   have caused for one, then cruise for six */
+const double BBRController::PROBE_GAINS[ 8 ] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+const vector<string> BBRController::OPTION_NAMES = { "cwnd_gain", "min_window", "window" };
+
+BBRController::BBRController( const Options & options )
+  : Controller( options ),
+    cwnd_gain_( option( options, "cwnd_gain", 2 ) ),
+    min_window_( option( options, "min_window", 4 ) ),
+    initial_window_( option( options, "window", 10 ) ),
+    mode_( Mode::Startup ),
+    gain_( STARTUP_GAIN ),
+    window_( initial_window_ ),
+    next_sequence_number_( 0 ),
+    largest_acked_( 0 ),
+    min_rtt_( 0 ),
+    min_rtt_stamp_( 0 ),
+    full_bandwidth_( 0 ),
+    full_bandwidth_rounds_( 0 ),
+    cycle_index_( 0 ),
+    cycle_start_( 0 ),
+    probe_rtt_done_( 0 ),
+    probe_rtt_from_startup_( false )
+{}
+
+/* bandwidth * min RTT, in datagrams */
+double BBRController::bdp( void ) const
+{
+  const double bandwidth = delivery().bottleneck_rate(); /* datagrams per second */
+  if ( bandwidth == 0 or min_rtt_ == 0 ) {
+    return initial_window_;
+  }
+
+  return bandwidth * min_rtt_ / 1000000;
+}
+
+unsigned int BBRController::current_window( void )
+{
+  if ( mode_ == Mode::ProbeRTT ) {
+    return min_window_;
+  }
+
+  return max( window_, double( min_window_ ) );
+}
+
+void BBRController::sent( const uint64_t sequence_number, const uint64_t )
+{
+  next_sequence_number_ = max( next_sequence_number_, sequence_number + 1 );
+}
+
+void BBRController::acked( const uint64_t sequence_number_acked,
+			   const uint64_t send_timestamp_acked,
+			   const uint64_t,
+			   const uint64_t timestamp_ack_received )
+{
+  const uint64_t now = timestamp_ack_received;
+
+  largest_acked_ = max( largest_acked_, sequence_number_acked + 1 );
+
+  /* the min RTT, replaced by any sample once it's too old to trust */
+  const bool min_rtt_expired = min_rtt_ and now - min_rtt_stamp_ > MIN_RTT_WINDOW_US;
+  if ( now >= send_timestamp_acked ) {
+    const uint64_t rtt = now - send_timestamp_acked;
+    if ( min_rtt_ == 0 or rtt <= min_rtt_ or min_rtt_expired ) {
+      min_rtt_ = max( rtt, uint64_t( 1 ) );
+      min_rtt_stamp_ = now;
+    }
+  }
+
+  update_mode( now, min_rtt_expired );
+
+  /* grow toward the target (only shrinking to it once the pipe is known to be full) */
+  const double target = gain_ * cwnd_gain_ * bdp();
+  if ( mode_ != Mode::Startup ) {
+    window_ = min( window_ + 1, target );
+  } else if ( window_ < target or delivery().delivered() < initial_window_ ) {
+    window_ += 1;
+  }
+}
+
+/* pace at gain * bandwidth (once there is a bandwidth) */
+double BBRController::current_pacing_rate( void )
+{
+  if ( delivery().bottleneck_rate() == 0 ) {
+    return Controller::current_pacing_rate();
+  }
+
+  return gain_ * delivery().bottleneck_rate();
+}
+
+void BBRController::enter_probe_bandwidth( const uint64_t now )
+{
+  mode_ = Mode::ProbeBandwidth;
+
+  /* start anywhere in the cycle except draining */
+  cycle_index_ = ( delivery().round_count() % 7 + 2 ) % 8;
+  gain_ = PROBE_GAINS[ cycle_index_ ];
+  cycle_start_ = now;
+}
+
+void BBRController::update_mode( const uint64_t now, const bool min_rtt_expired )
+{
+  switch ( mode_ ) {
+  case Mode::Startup:
+    /* the pipe is full once the bandwidth hasn't grown 25% in three rounds */
+    if ( delivery().round_start() ) {
+      if ( delivery().bottleneck_rate() >= full_bandwidth_ * 1.25 ) {
+	full_bandwidth_ = delivery().bottleneck_rate();
+	full_bandwidth_rounds_ = 0;
+      } else if ( ++full_bandwidth_rounds_ >= 3 ) {
+	mode_ = Mode::Drain;
+	gain_ = 1 / STARTUP_GAIN;
+      }
+    }
+    break;
+
+  case Mode::Drain:
+    if ( in_flight() <= bdp() ) {
+      enter_probe_bandwidth( now );
+    }
+    break;
+
+  case Mode::ProbeBandwidth:
+    /* move on after a min RTT, except that probing waits until it has
+       filled the pipe and draining stops as soon as the queue is gone */
+    {
+      const bool elapsed = now - cycle_start_ > min_rtt_;
+      bool next = elapsed;
+      if ( gain_ > 1 ) {
+	next = elapsed and in_flight() >= gain_ * bdp();
+      } else if ( gain_ < 1 ) {
+	next = elapsed or in_flight() <= bdp();
+      }
+
+      if ( next ) {
+	cycle_index_ = ( cycle_index_ + 1 ) % 8;
+	gain_ = PROBE_GAINS[ cycle_index_ ];
+	cycle_start_ = now;
+      }
+    }
+    break;
+
+  case Mode::ProbeRTT:
+    /* hold the window down for a while once it has drained, then go back */
+    if ( probe_rtt_done_ == 0 and in_flight() <= min_window_ ) {
+      probe_rtt_done_ = now + max( uint64_t( PROBE_RTT_US ), min_rtt_ );
+    } else if ( probe_rtt_done_ and now > probe_rtt_done_ ) {
+      min_rtt_stamp_ = now;
+      if ( probe_rtt_from_startup_ ) {
+	mode_ = Mode::Startup;
+	gain_ = STARTUP_GAIN;
+      } else {
+	enter_probe_bandwidth( now );
+      }
+    }
+    return;
+  }
+
+  /* every so often, drain the queue to measure the min RTT afresh */
+  if ( min_rtt_expired ) {
+    probe_rtt_from_startup_ = mode_ == Mode::Startup;
+    mode_ = Mode::ProbeRTT;
+    gain_ = 1;
+    probe_rtt_done_ = 0;
+  }
+}
+
+/* fixed window */
+
+const vector<string> FixedWindowController::OPTION_NAMES = { "window" };
+
+FixedWindowController::FixedWindowController( const Options & options )
+  : Controller( options ),
+    window_( option( options, "window", 50 ) )
+{}
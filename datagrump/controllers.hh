@@ -0,0 +1,182 @@
+#ifndef CONTROLLERS_HH
+#define CONTROLLERS_HH
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "controller.hh"
+#include "windowed_filter.hh"
+
+/* The built-in congestion-control algorithms. Each takes its tuning
+   parameters from the options (see the constructors for names and
+   defaults); times in options are in milliseconds. All of them take
+   their retransmission timeout from the Controller's RTT estimate. */
+
+/* Reno-like AIMD: slow start, then additive increase, halving the window
+   after repeated acks slower than a threshold, or once per window of
+   datagrams in which any is lost (options: rtt_threshold=90,
+   timeout_retry=8, window=13, ssthresh=500) */
+class AIMDController : public Controller
+{
+private:
+  enum state_t { SLOW_START, CONGEST_AVOID, FAST_RECOVERY };
+
+  unsigned int rtt_threshold_; /* RTT (ms) taken as a sign of congestion */
+  int timeout_retry_;          /* slow acks tolerated before backing off */
+
+  float rtt;
+  float wsz;
+  float slow_start_thresh;
+  int timeouts;
+  state_t state;
+
+  /* losses of datagrams before this one were answered already */
+  uint64_t next_sequence_number_, recovery_end_;
+
+  unsigned int current_window( void ) override;
+  void sent( const uint64_t sequence_number, const uint64_t send_timestamp ) override;
+  void acked( const uint64_t sequence_number_acked,
+	      const uint64_t send_timestamp_acked,
+	      const uint64_t recv_timestamp_acked,
+	      const uint64_t timestamp_ack_received ) override;
+  void lost( const uint64_t sequence_number,
+	     const uint64_t send_timestamp,
+	     const uint64_t timestamp_lost ) override;
+
+public:
+  AIMDController( const Options & options );
+
+  /* the options above, by name */
+  static const std::vector<std::string> OPTION_NAMES;
+};
+
+/* Delay-based, after Copa: aim for a sending rate of 1 / (delta * queueing
+   delay), where queueing delay is the recent ("standing") RTT less the
+   minimum RTT, moving the window toward it with a velocity that doubles
+   while it keeps moving the same way, and pacing at twice window / standing
+   RTT (options: delta=0.5, window=10, and one_way=0; if 1, the queueing
+   delay is measured on the forward path alone, so the ack path's queues
+   don't slow it down) */
+class CopaController : public Controller
+{
+private:
+  double delta_;
+  bool one_way_;
+
+  double window_;
+  bool slow_start_;
+
+  WindowedFilter<uint64_t, std::less<uint64_t>> standing_rtt_, standing_queueing_;
+
+  /* velocity: once per RTT, see which way the window moved */
+  double velocity_;
+  int direction_;            /* +1 up, -1 down, 0 not yet known */
+  unsigned int same_direction_rtts_;
+  double window_at_rtt_start_;
+  uint64_t rtt_start_;
+
+  unsigned int current_window( void ) override;
+  void acked( const uint64_t sequence_number_acked,
+	      const uint64_t send_timestamp_acked,
+	      const uint64_t recv_timestamp_acked,
+	      const uint64_t timestamp_ack_received ) override;
+
+  double current_pacing_rate( void ) override;
+
+  /* once per RTT: update the velocity from the window's direction */
+  void update_velocity( const uint64_t now );
+
+public:
+  CopaController( const Options & options );
+
+  /* the options above, by name */
+  static const std::vector<std::string> OPTION_NAMES;
+};
+
+/* Model-based, after BBR: estimate the bottleneck bandwidth (the maximum
+   delivery rate over the last few round trips) and the minimum RTT, and
+   keep gain * bandwidth * min RTT datagrams in flight, paced at gain *
+   bandwidth, with the gain cycling to probe for more bandwidth and drain
+   any queue
+   (options: cwnd_gain=2, min_window=4, window=10; the bandwidth is the
+   Controller's bottleneck rate, over bw_rounds) */
+class BBRController : public Controller
+{
+private:
+  enum class Mode { Startup, Drain, ProbeBandwidth, ProbeRTT };
+
+  /* the gains */
+  static constexpr double STARTUP_GAIN = 2.885; /* 2 / ln 2 */
+  static const double PROBE_GAINS[ 8 ];
+
+  /* how long the minimum RTT is trusted, and how long to probe for a new one */
+  static const uint64_t MIN_RTT_WINDOW_US = 10000000;
+  static const uint64_t PROBE_RTT_US = 200000;
+
+  double cwnd_gain_;
+  unsigned int min_window_, initial_window_;
+
+  Mode mode_;
+  double gain_;
+  double window_;
+
+  uint64_t next_sequence_number_; /* one past the newest sent */
+  uint64_t largest_acked_;        /* plus one (0 until the first ack) */
+
+  /* (kept here rather than taken from the RTT estimate, since ProbeRTT
+     decides when it expires) */
+  uint64_t min_rtt_, min_rtt_stamp_; /* and when it was last measured */
+
+  /* Startup: has the bandwidth stopped growing? */
+  double full_bandwidth_;
+  unsigned int full_bandwidth_rounds_;
+
+  /* ProbeBandwidth: where in the gain cycle, and since when */
+  unsigned int cycle_index_;
+  uint64_t cycle_start_;
+
+  /* ProbeRTT: when it ends (0 until in-flight datagrams have drained) */
+  uint64_t probe_rtt_done_;
+  bool probe_rtt_from_startup_;
+
+  /* bandwidth * min RTT, in datagrams */
+  double bdp( void ) const;
+
+  uint64_t in_flight( void ) const { return next_sequence_number_ - largest_acked_; }
+
+  void update_mode( const uint64_t now, const bool min_rtt_expired );
+  void enter_probe_bandwidth( const uint64_t now );
+
+  unsigned int current_window( void ) override;
+  void sent( const uint64_t sequence_number, const uint64_t send_timestamp ) override;
+  void acked( const uint64_t sequence_number_acked,
+	      const uint64_t send_timestamp_acked,
+	      const uint64_t recv_timestamp_acked,
+	      const uint64_t timestamp_ack_received ) override;
+  double current_pacing_rate( void ) override;
+
+public:
+  BBRController( const Options & options );
+
+  /* the options above, by name */
+  static const std::vector<std::string> OPTION_NAMES;
+};
+
+/* A fixed window, e.g. for measuring a link (options: window=50) */
+class FixedWindowController : public Controller
+{
+private:
+  unsigned int window_;
+
+  unsigned int current_window( void ) override { return window_; }
+  void acked( const uint64_t, const uint64_t, const uint64_t, const uint64_t ) override {}
+
+public:
+  FixedWindowController( const Options & options );
+
+  /* the options above, by name */
+  static const std::vector<std::string> OPTION_NAMES;
+};
+
+#endif /* CONTROLLERS_HH */
@@ -0,0 +1,113 @@
+/* runs a congestion controller over an emulated link, in virtual time
+   (see link_emulator.hh) */
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+
+#include "controller.hh"
+#include "event_trace.hh"
+#include "link_emulator.hh"
+#include "timestamp.hh"
+
+using namespace std;
+
+int main( int argc, char *argv[] )
+{
+   /* check the command-line arguments */
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  /* after the traces: cc=ALGORITHM, pacing=off|user, the path's
+     settings, log=FILE (the uplink's log, as mm-link writes it),
+     trace=FILE (the sender's events, in virtual time; see tracedump),
+     and the algorithm's options (as name=value), in any order */
+  string algorithm = Controller::DEFAULT_ALGORITHM;
+  string log_filename, trace_filename;
+  Controller::Options options;
+  LinkEmulator::Settings settings;
+  bool usage_error = argc < 3;
+
+  for ( int i = 3; i < argc and not usage_error; i++ ) {
+    const string arg( argv[ i ] );
+    const size_t equals = arg.find( '=' );
+    const string name = arg.substr( 0, equals );
+    const string value = equals == string::npos ? "" : arg.substr( equals + 1 );
+
+    if ( equals == string::npos or equals == 0 ) {
+      usage_error = true;
+    } else if ( name == "cc" ) {
+      algorithm = value;
+    } else if ( name == "log" ) {
+      log_filename = value;
+    } else if ( name == "trace" ) {
+      trace_filename = value;
+    } else if ( LinkEmulator::Settings::is_setting( name ) ) {
+      usage_error = not settings.set( name, value );
+    } else {
+      options[ name ] = value;
+    }
+  }
+
+  const vector<string> algorithms = Controller::algorithms();
+  if ( find( algorithms.begin(), algorithms.end(), algorithm ) == algorithms.end() ) {
+    usage_error = true;
+  }
+
+  if ( usage_error ) {
+    cerr << "Usage: " << argv[ 0 ] << " UPLINK_TRACE DOWNLINK_TRACE [cc=ALGORITHM] [pacing=off|user]"
+	 << " [delay=MS] [queue_packets=N] [queue_bytes=N] [duration=MS] [log=FILE]"
+	 << " [trace=FILE] [OPTION=VALUE]..." << endl;
+    cerr << "Algorithms (default " << Controller::DEFAULT_ALGORITHM << "):";
+    for ( const auto & name : algorithms ) {
+      cerr << " " << name;
+    }
+    cerr << endl;
+    return EXIT_FAILURE;
+  }
+
+  const LinkTrace uplink( argv[ 1 ] ), downlink( argv[ 2 ] );
+
+  ofstream log;
+  if ( not log_filename.empty() ) {
+    log.exceptions( ofstream::failbit | ofstream::badbit );
+    log.open( log_filename );
+    settings.uplink_log = &log;
+  }
+
+  unique_ptr<EventTrace> trace;
+  if ( not trace_filename.empty() ) {
+    /* (virtual time runs as fast as we can record it, so lose nothing) */
+    trace.reset( new EventTrace( trace_filename, true ) );
+  }
+
+  const uint64_t start = timestamp_us();
+
+  unique_ptr<Controller> controller = Controller::make( algorithm, options );
+  LinkEmulator emulator( uplink, downlink, *controller, settings );
+  const LinkEmulator::Results results = emulator.run();
+
+  const uint64_t elapsed = timestamp_us() - start;
+
+  const LinkLogAnalyzer::Summary & uplink_summary = results.uplink;
+  cout << fixed << setprecision( 2 );
+  cout << "Average capacity: " << uplink_summary.capacity_mbps << " Mbits/s" << endl;
+  cout << "Average throughput: " << uplink_summary.throughput_mbps << " Mbits/s ("
+       << setprecision( 1 ) << 100 * uplink_summary.utilization() << "% utilization)" << endl;
+  cout << setprecision( 0 );
+  cout << "95th percentile per-packet queueing delay: " << uplink_summary.delay_p95_ms << " ms" << endl;
+  cout << "95th percentile signal delay: " << uplink_summary.signal_delay_p95_ms << " ms" << endl;
+  cout << "Datagrams: " << results.datagrams_sent << " sent, "
+       << results.datagrams_delivered << " delivered, "
+       << results.datagrams_dropped << " dropped by the queue, "
+       << results.datagrams_lost << " given up for lost, "
+       << results.timeouts << " timeouts" << endl;
+
+  cerr << "Emulated " << uplink_summary.duration_s << " s in " << elapsed / 1000.0 << " ms" << endl;
+
+  return EXIT_SUCCESS;
+}
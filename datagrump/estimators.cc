@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <limits>
+
+#include "estimators.hh"
+
+using namespace std;
+
+RTTEstimator::RTTEstimator( const uint64_t min_rto_us, const uint64_t max_rto_us )
+  : min_rto_us_( min_rto_us ),
+    max_rto_us_( max_rto_us ),
+    have_sample_( false ),
+    srtt_us_( 0 ),
+    rttvar_us_( 0 ),
+    latest_rtt_us_( 0 ),
+    backoffs_( 0 ),
+    min_rtt_( MIN_RTT_WINDOW_US )
+{}
+
+/* a datagram sent at send_time was acknowledged at now */
+void RTTEstimator::add_sample( const uint64_t send_time, const uint64_t now )
+{
+  if ( now < send_time ) {
+    return;
+  }
+
+  const uint64_t rtt = now - send_time;
+
+  if ( not have_sample_ ) {
+    /* RFC 6298 2.2 */
+    srtt_us_ = rtt;
+    rttvar_us_ = rtt / 2.0;
+    have_sample_ = true;
+  } else {
+    /* RFC 6298 2.3, with alpha = 1/8 and beta = 1/4 */
+    const double error = rtt > srtt_us_ ? rtt - srtt_us_ : srtt_us_ - rtt;
+    rttvar_us_ = 0.75 * rttvar_us_ + 0.25 * error;
+    srtt_us_ = 0.875 * srtt_us_ + 0.125 * rtt;
+  }
+
+  latest_rtt_us_ = rtt;
+  min_rtt_.update( now, rtt );
+
+  /* (every datagram has its own sequence number, so unlike TCP there are
+     no ambiguous samples from retransmissions to exclude; see Karn) */
+  backoffs_ = 0;
+}
+
+/* the retransmission timer expired */
+void RTTEstimator::back_off( void )
+{
+  if ( rto_us() < max_rto_us_ ) {
+    backoffs_++;
+  }
+}
+
+/* current retransmission timeout, including any backoff */
+uint64_t RTTEstimator::rto_us( void ) const
+{
+  uint64_t rto = INITIAL_RTO_US;
+  if ( have_sample_ ) {
+    /* RFC 6298 2.3 */
+    rto = srtt_us_ + max( double( GRANULARITY_US ), 4 * rttvar_us_ );
+  }
+
+  rto = max( rto, min_rto_us_ );
+
+  for ( unsigned int i = 0; i < backoffs_ and rto < max_rto_us_; i++ ) {
+    rto *= 2;
+  }
+
+  return min( rto, max_rto_us_ );
+}
+
+DeliveryRateEstimator::DeliveryRateEstimator( const unsigned int window_rounds )
+  : history_( HISTORY ),
+    delivered_( 0 ),
+    delivered_time_( 0 ),
+    round_count_( 0 ),
+    next_round_delivered_( 0 ),
+    round_start_( false ),
+    latest_rate_( 0 ),
+    max_rate_( window_rounds )
+{}
+
+/* remember how much had been delivered when each datagram was sent */
+void DeliveryRateEstimator::sent( const uint64_t sequence_number, const uint64_t now )
+{
+  if ( delivered_time_ == 0 ) {
+    delivered_time_ = now;
+  }
+
+  history_[ sequence_number % HISTORY ] = { sequence_number, delivered_, delivered_time_ };
+}
+
+/* measure the delivery rate since the acknowledged datagram was sent */
+void DeliveryRateEstimator::acked( const uint64_t sequence_number, const uint64_t now )
+{
+  delivered_++;
+  delivered_time_ = now;
+  round_start_ = false;
+
+  const SentDatagram & datagram = history_[ sequence_number % HISTORY ];
+  if ( datagram.sequence_number != sequence_number ) {
+    return; /* too old to remember */
+  }
+
+  if ( datagram.delivered >= next_round_delivered_ ) {
+    next_round_delivered_ = delivered_;
+    round_count_++;
+    round_start_ = true;
+  }
+
+  if ( now > datagram.delivered_time ) {
+    latest_rate_ = double( delivered_ - datagram.delivered ) * 1000000
+      / ( now - datagram.delivered_time );
+    max_rate_.update( round_count_, latest_rate_ );
+  }
+}
+
+OneWayDelayEstimator::OneWayDelayEstimator()
+  : epochs_(),
+    epoch_count_( 0 ),
+    slopes_(),
+    skew_( 0 ),
+    reference_time_( 0 ),
+    floor_( numeric_limits<int64_t>::max() ),
+    latest_delay_( 0 ),
+    latest_send_time_( 0 )
+{
+  slopes_.reserve( EPOCHS * ( EPOCHS - 1 ) / 2 );
+}
+
+double OneWayDelayEstimator::corrected( const int64_t delay, const uint64_t send_time ) const
+{
+  return delay - skew_ * ( int64_t( send_time ) - int64_t( reference_time_ ) );
+}
+
+void OneWayDelayEstimator::add_sample( const uint64_t send_time, const uint64_t recv_time,
+				       const uint64_t ack_send_time, const uint64_t ack_recv_time )
+{
+  if ( ack_recv_time < send_time or ack_send_time < recv_time ) {
+    return;
+  }
+
+  const int64_t delay = int64_t( recv_time ) - int64_t( send_time );
+
+  /* NTP's on-wire calculation, leaving out the time the receiver held
+     the datagram before acking it */
+  const uint64_t hold_time = ack_send_time - recv_time;
+  const uint64_t rtt = ack_recv_time - send_time > hold_time
+    ? ack_recv_time - send_time - hold_time : 0;
+  const int64_t offset = ( delay + ( int64_t( ack_send_time ) - int64_t( ack_recv_time ) ) ) / 2;
+
+  if ( epoch_count_ == 0 or send_time >= epoch( epoch_count_ - 1 ).start + EPOCH_US ) {
+    if ( epoch_count_ == 0 ) {
+      reference_time_ = send_time;
+    } else {
+      finish_epoch();
+    }
+
+    epochs_[ epoch_count_ % EPOCHS ] = { send_time, delay, send_time, rtt, offset, send_time };
+    epoch_count_++;
+  } else {
+    Epoch & current = epochs_[ ( epoch_count_ - 1 ) % EPOCHS ];
+    if ( delay < current.min_delay ) {
+      current.min_delay = delay;
+      current.min_delay_time = send_time;
+    }
+    if ( rtt < current.min_rtt ) {
+      current.min_rtt = rtt;
+      current.offset = offset;
+      current.offset_time = send_time;
+    }
+  }
+
+  latest_delay_ = delay;
+  latest_send_time_ = send_time;
+}
+
+/* the newest epoch is over (and the oldest is about to be replaced) */
+void OneWayDelayEstimator::finish_epoch( void )
+{
+  const uint64_t first = epoch_count_ > EPOCHS - 1 ? epoch_count_ - ( EPOCHS - 1 ) : 0;
+
+  /* Theil-Sen: the median slope between the epochs' least delays */
+  if ( epoch_count_ - first >= MIN_SKEW_EPOCHS ) {
+    slopes_.clear();
+    for ( uint64_t i = first; i < epoch_count_; i++ ) {
+      for ( uint64_t j = i + 1; j < epoch_count_; j++ ) {
+	const Epoch & a = epoch( i ), & b = epoch( j );
+	if ( a.min_delay_time != b.min_delay_time ) {
+	  slopes_.push_back( double( b.min_delay - a.min_delay )
+			     / ( int64_t( b.min_delay_time ) - int64_t( a.min_delay_time ) ) );
+	}
+      }
+    }
+
+    if ( not slopes_.empty() ) {
+      nth_element( slopes_.begin(), slopes_.begin() + slopes_.size() / 2, slopes_.end() );
+      skew_ = max( -MAX_SKEW, min( slopes_[ slopes_.size() / 2 ], MAX_SKEW ) );
+    }
+  }
+
+  /* the propagation delay (plus offset), as of the reference time */
+  floor_ = numeric_limits<int64_t>::max();
+  for ( uint64_t i = first; i < epoch_count_; i++ ) {
+    floor_ = min( floor_, int64_t( corrected( epoch( i ).min_delay, epoch( i ).min_delay_time ) ) );
+  }
+}
+
+/* receiver's clock less the sender's, as of the latest sample */
+int64_t OneWayDelayEstimator::offset_us( void ) const
+{
+  if ( not have_sample() ) {
+    return 0;
+  }
+
+  /* from the fastest round trip still remembered */
+  const uint64_t first = epoch_count_ > EPOCHS ? epoch_count_ - EPOCHS : 0;
+  const Epoch * best = &epoch( first );
+  for ( uint64_t i = first + 1; i < epoch_count_; i++ ) {
+    if ( epoch( i ).min_rtt < best->min_rtt ) {
+      best = &epoch( i );
+    }
+  }
+
+  return best->offset + skew_ * ( int64_t( latest_send_time_ ) - int64_t( best->offset_time ) );
+}
+
+/* forward queueing delay of the latest datagram acknowledged */
+uint64_t OneWayDelayEstimator::queueing_delay_us( void ) const
+{
+  if ( not have_sample() ) {
+    return 0;
+  }
+
+  const Epoch & current = epoch( epoch_count_ - 1 );
+  const double least = min( double( floor_ ), corrected( current.min_delay, current.min_delay_time ) );
+  const double queueing = corrected( latest_delay_, latest_send_time_ ) - least;
+
+  return queueing > 0 ? queueing : 0;
+}
+
+/* forward delay of the latest datagram acknowledged */
+uint64_t OneWayDelayEstimator::one_way_delay_us( void ) const
+{
+  const int64_t delay = latest_delay_ - offset_us();
+  return delay > 0 ? delay : 0;
+}
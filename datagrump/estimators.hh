@@ -0,0 +1,189 @@
+#ifndef ESTIMATORS_HH
+#define ESTIMATORS_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "windowed_filter.hh"
+
+/* Estimates of the path that the Controller keeps up to date for every
+   algorithm. All times are in microseconds. */
+
+/* Smoothed RTT and retransmission timeout, per RFC 6298, with exponential
+   backoff on timeouts, plus the minimum RTT over a sliding window */
+class RTTEstimator
+{
+private:
+  /* RTO before any sample (RFC 6298 2.1) */
+  static const uint64_t INITIAL_RTO_US = 1000000;
+
+  /* timer granularity (G in RFC 6298) */
+  static const uint64_t GRANULARITY_US = 1000;
+
+  /* how long the minimum RTT is remembered */
+  static const uint64_t MIN_RTT_WINDOW_US = 10000000;
+
+  uint64_t min_rto_us_, max_rto_us_;
+
+  bool have_sample_;
+  double srtt_us_, rttvar_us_;
+  uint64_t latest_rtt_us_;
+  unsigned int backoffs_; /* consecutive timeouts since the last sample */
+
+  WindowedFilter<uint64_t, std::less<uint64_t>> min_rtt_;
+
+public:
+  RTTEstimator( const uint64_t min_rto_us, const uint64_t max_rto_us );
+
+  /* a datagram sent at send_time was acknowledged at now */
+  void add_sample( const uint64_t send_time, const uint64_t now );
+
+  /* the retransmission timer expired: double the RTO (RFC 6298 5.5) */
+  void back_off( void );
+
+  bool have_sample( void ) const { return have_sample_; }
+
+  uint64_t srtt_us( void ) const { return srtt_us_; }
+  uint64_t rttvar_us( void ) const { return rttvar_us_; }
+  uint64_t latest_rtt_us( void ) const { return latest_rtt_us_; }
+
+  /* least RTT seen in the last ten seconds (0 before any sample) */
+  uint64_t min_rtt_us( void ) const { return min_rtt_.best(); }
+
+  /* current retransmission timeout, including any backoff */
+  uint64_t rto_us( void ) const;
+};
+
+/* Delivery rate, measured per datagram as in BBR: the datagrams delivered
+   between sending one and its ack, over the time between the delivery
+   before it was sent and its ack. Also counts round trips (each ending
+   when a datagram sent after the last one ended is acked), and keeps the
+   maximum rate over the last few of them as the bottleneck bandwidth. */
+class DeliveryRateEstimator
+{
+private:
+  /* per-datagram state, kept for the last HISTORY datagrams sent */
+  static const size_t HISTORY = 1 << 16;
+  struct SentDatagram
+  {
+    uint64_t sequence_number;
+    uint64_t delivered;      /* datagrams delivered when this one was sent */
+    uint64_t delivered_time; /* when the most recent of them was delivered */
+  };
+
+  std::vector<SentDatagram> history_;
+
+  uint64_t delivered_, delivered_time_;
+  uint64_t round_count_, next_round_delivered_;
+  bool round_start_;
+
+  double latest_rate_;
+  WindowedFilter<double, std::greater<double>> max_rate_;
+
+public:
+  /* the bottleneck bandwidth is the max rate over window_rounds round trips */
+  DeliveryRateEstimator( const unsigned int window_rounds );
+
+  void sent( const uint64_t sequence_number, const uint64_t now );
+  void acked( const uint64_t sequence_number, const uint64_t now );
+
+  /* datagrams acknowledged so far */
+  uint64_t delivered( void ) const { return delivered_; }
+
+  /* round trips so far, and whether the latest ack began a new one */
+  uint64_t round_count( void ) const { return round_count_; }
+  bool round_start( void ) const { return round_start_; }
+
+  /* in datagrams per second (0 until measured) */
+  double latest_rate( void ) const { return latest_rate_; }
+  double bottleneck_rate( void ) const { return max_rate_.best(); }
+};
+
+/* The forward (sender to receiver) one-way delay. Each ack says when the
+   receiver got the datagram and when it sent the ack, by the receiver's
+   clock, which has an unknown offset from the sender's and may run at a
+   slightly different rate. The skew is the slope of the lower envelope of
+   (receive time - send time), taken from the least of it in each of the
+   last few epochs (the median of the slopes between pairs of them, so a
+   queue during one epoch doesn't throw it off). Once that is taken out,
+   whatever is above the envelope is queueing on the forward path, with no
+   noise from the ack path. The offset itself comes NTP-style from the
+   fastest recent round trip, assuming its two halves were equally long. */
+class OneWayDelayEstimator
+{
+private:
+  /* how long each epoch is (by the sender's clock), and how many are kept */
+  static const uint64_t EPOCH_US = 1000000;
+  static const unsigned int EPOCHS = 16;
+
+  /* epochs needed before the skew is measured (until then it is taken as 0) */
+  static const unsigned int MIN_SKEW_EPOCHS = 8;
+
+  /* the most any working clock drifts (as NTP assumes); more than this
+     means the path's delay changed instead */
+  static constexpr double MAX_SKEW = 500e-6;
+
+  struct Epoch
+  {
+    uint64_t start;
+
+    /* least (receive time - send time), and when it was sent */
+    int64_t min_delay;
+    uint64_t min_delay_time;
+
+    /* fastest round trip (less the receiver's hold time), the offset it
+       gives, and when it was sent */
+    uint64_t min_rtt;
+    int64_t offset;
+    uint64_t offset_time;
+  };
+
+  Epoch epochs_[ EPOCHS ];
+  uint64_t epoch_count_; /* epochs begun so far (the newest is still going) */
+
+  std::vector<double> slopes_; /* scratch space for the skew */
+
+  double skew_;
+  uint64_t reference_time_; /* the skew is measured from here */
+  int64_t floor_;           /* least skew-corrected delay in the finished epochs */
+
+  int64_t latest_delay_;
+  uint64_t latest_send_time_;
+
+  const Epoch & epoch( const uint64_t index ) const { return epochs_[ index % EPOCHS ]; }
+
+  /* receive time - send time, with the skew since the reference taken out */
+  double corrected( const int64_t delay, const uint64_t send_time ) const;
+
+  /* an epoch is over: measure the skew again */
+  void finish_epoch( void );
+
+public:
+  OneWayDelayEstimator();
+
+  /* a datagram sent at send_time (sender's clock) arrived at recv_time,
+     and its ack was sent at ack_send_time (both receiver's clock) and
+     arrived at ack_recv_time (sender's clock) */
+  void add_sample( const uint64_t send_time, const uint64_t recv_time,
+		   const uint64_t ack_send_time, const uint64_t ack_recv_time );
+
+  bool have_sample( void ) const { return epoch_count_ > 0; }
+
+  /* how much faster the receiver's clock runs than the sender's
+     (e.g. 1e-6 is one part per million) */
+  double skew( void ) const { return skew_; }
+
+  /* receiver's clock less the sender's, as of the latest sample */
+  int64_t offset_us( void ) const;
+
+  /* forward queueing delay of the latest datagram acknowledged */
+  uint64_t queueing_delay_us( void ) const;
+
+  /* forward delay of the latest datagram acknowledged (only as good as
+     the offset, i.e. the path's symmetry) */
+  uint64_t one_way_delay_us( void ) const;
+};
+
+#endif /* ESTIMATORS_HH */
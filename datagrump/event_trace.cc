@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "event_trace.hh"
+#include "util.hh"
+
+using namespace std;
+
+static_assert( sizeof( TraceRecord ) == 32, "trace records are 32 bytes" );
+static_assert( sizeof( EventTrace::FileHeader ) == sizeof( TraceRecord ),
+	       "the trace file's header is the size of a record" );
+
+const char * TraceRecord::type_name( const Type type )
+{
+  switch ( type ) {
+  case Type::None: return "none";
+  case Type::Sent: return "sent";
+  case Type::Acked: return "acked";
+  case Type::Lost: return "lost";
+  case Type::Window: return "window";
+  case Type::Timeout: return "timeout";
+  case Type::Received: return "received";
+  case Type::AckSent: return "ack_sent";
+  case Type::Dropped: return "dropped";
+  }
+
+  return "unknown";
+}
+
+TraceRing::TraceRing( const uint16_t thread )
+  : records_( new TraceRecord[ CAPACITY ] ),
+    thread_( thread ),
+    head_( 0 ),
+    cached_tail_( 0 ),
+    dropped_( 0 ),
+    padding_(),
+    tail_( 0 ),
+    reported_dropped_( 0 )
+{}
+
+uint64_t TraceRing::peek( const TraceRecord * & first, uint64_t & first_count,
+			  const TraceRecord * & second, uint64_t & second_count ) const
+{
+  const uint64_t tail = tail_.load( memory_order_relaxed );
+  const uint64_t count = head_.load( memory_order_acquire ) - tail;
+  const uint64_t start = tail & ( CAPACITY - 1 );
+
+  first = &records_[ start ];
+  first_count = min( count, CAPACITY - start );
+  second = &records_[ 0 ];
+  second_count = count - first_count;
+  return count;
+}
+
+uint64_t TraceRing::newly_dropped( void )
+{
+  const uint64_t dropped = dropped_.load( memory_order_relaxed );
+  const uint64_t newly = dropped - reported_dropped_;
+  reported_dropped_ = dropped;
+  return newly;
+}
+
+const char EventTrace::MAGIC[ 8 ] = { 'D', 'G', 'T', 'R', 'A', 'C', 'E', '\0' };
+
+atomic<EventTrace *> EventTrace::current_( nullptr );
+
+/* a number for each trace (0 meaning none) */
+static atomic<uint64_t> trace_count( 0 );
+
+EventTrace::EventTrace( const string & filename, const bool lossless )
+  : file_( SystemCall( "open " + filename,
+		       open( filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ) ),
+    filename_( filename ),
+    id_( ++trace_count ),
+    lossless_( lossless ),
+    chunk_( nullptr ),
+    chunk_offset_( 0 ),
+    chunk_used_( 0 ),
+    rings_mutex_(),
+    rings_(),
+    flusher_mutex_(),
+    flusher_wakeup_(),
+    stopping_( false ),
+    flusher_()
+{
+  if ( current_.load() ) {
+    throw runtime_error( "only one event trace can be recorded at a time" );
+  }
+
+  next_chunk();
+
+  FileHeader header;
+  zero( header );
+  memcpy( header.magic, MAGIC, sizeof( MAGIC ) );
+  header.version = VERSION;
+  header.record_size = sizeof( TraceRecord );
+  memcpy( chunk_, &header, sizeof( header ) );
+  chunk_used_ = sizeof( header );
+
+  flusher_ = thread( [this] () { flush_until_stopped(); } );
+  current_.store( this );
+}
+
+EventTrace::~EventTrace()
+{
+  current_.store( nullptr );
+
+  {
+    lock_guard<mutex> lock( flusher_mutex_ );
+    stopping_ = true;
+  }
+  flusher_wakeup_.notify_one();
+  flusher_.join();
+
+  try {
+    flush();
+
+    /* (the unused rest of the chunk goes) */
+    SystemCall( "ftruncate " + filename_, ftruncate( file_.fd_num(), chunk_offset_ + chunk_used_ ) );
+  } catch ( const exception & e ) { /* don't throw from destructor */
+    print_exception( e );
+  }
+
+  if ( chunk_ and munmap( chunk_, CHUNK_SIZE ) < 0 ) {
+    print_exception( unix_error( "munmap" ) );
+  }
+}
+
+/* this thread's ring, made the first time it records */
+TraceRing & EventTrace::ring( void )
+{
+  static thread_local uint64_t ring_trace = 0;
+  static thread_local TraceRing * ring = nullptr;
+
+  if ( ring_trace != id_ ) {
+    lock_guard<mutex> lock( rings_mutex_ );
+    rings_.emplace_back( new TraceRing( rings_.size() ) );
+    ring = rings_.back().get();
+    ring_trace = id_;
+  }
+
+  return *ring;
+}
+
+/* map the next chunk of the file, growing it */
+void EventTrace::next_chunk( void )
+{
+  if ( chunk_ ) {
+    SystemCall( "munmap", munmap( chunk_, CHUNK_SIZE ) );
+    chunk_ = nullptr;
+    chunk_offset_ += CHUNK_SIZE;
+    chunk_used_ = 0;
+  }
+
+  /* allocate the disk space now, so a full disk is an error here rather
+     than a SIGBUS when the mapping is written */
+  const int error = posix_fallocate( file_.fd_num(), chunk_offset_, CHUNK_SIZE );
+  if ( error ) {
+    throw unix_error( "posix_fallocate " + filename_, error );
+  }
+
+  void * const address = mmap( nullptr, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			       file_.fd_num(), chunk_offset_ );
+  if ( address == MAP_FAILED ) {
+    throw unix_error( "mmap " + filename_ );
+  }
+  chunk_ = static_cast<char *>( address );
+}
+
+/* copy records into the file */
+void EventTrace::write( const TraceRecord * records, uint64_t count )
+{
+  while ( count ) {
+    if ( chunk_used_ == CHUNK_SIZE ) {
+      next_chunk();
+    }
+
+    const uint64_t fits = min<uint64_t>( count, ( CHUNK_SIZE - chunk_used_ ) / sizeof( TraceRecord ) );
+    memcpy( chunk_ + chunk_used_, records, fits * sizeof( TraceRecord ) );
+    chunk_used_ += fits * sizeof( TraceRecord );
+    records += fits;
+    count -= fits;
+  }
+}
+
+/* move everything in the rings so far to the file */
+void EventTrace::flush( void )
+{
+  lock_guard<mutex> lock( rings_mutex_ );
+
+  for ( const auto & ring : rings_ ) {
+    /* (records are dropped only once the ring fills, so any dropped
+       since the last flush came after everything in it) */
+    const uint64_t dropped = ring->newly_dropped();
+
+    const TraceRecord * first, * second;
+    uint64_t first_count, second_count;
+    const uint64_t count = ring->peek( first, first_count, second, second_count );
+    write( first, first_count );
+    write( second, second_count );
+
+    if ( dropped ) {
+      /* stamped like the record before it, on whatever clock (maybe
+	 virtual) the thread records in */
+      const uint64_t timestamp = second_count ? second[ second_count - 1 ].timestamp
+	: first_count ? first[ first_count - 1 ].timestamp : 0;
+      const TraceRecord record = { timestamp, 0, dropped, 0, ring->thread(),
+				   TraceRecord::Type::Dropped, 0 };
+      write( &record, 1 );
+    }
+
+    ring->consume( count );
+  }
+}
+
+/* the flusher thread's body */
+void EventTrace::flush_until_stopped( void )
+{
+  try {
+    unique_lock<mutex> lock( flusher_mutex_ );
+    while ( not stopping_ ) {
+      flusher_wakeup_.wait_for( lock, chrono::milliseconds( FLUSH_INTERVAL_MS ) );
+      flush();
+    }
+  } catch ( const exception & e ) {
+    /* stop recording, but leave the process running */
+    print_exception( e );
+    current_.store( nullptr );
+  }
+}
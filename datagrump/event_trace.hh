@@ -0,0 +1,219 @@
+#ifndef EVENT_TRACE_HH
+#define EVENT_TRACE_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "file_descriptor.hh"
+
+/* One traced event, in a fixed-size binary record (in host byte order).
+   What the fields mean depends on the type:
+
+     Sent      sequence_number was sent at timestamp
+     Acked     sequence_number (sent at value) was acked at timestamp
+     Lost      sequence_number (sent at value) was given up for lost
+     Window    the window became value datagrams
+     Timeout   the retransmission timer fired; the next is in value ms
+     Received  sequence_number (sent at value) reached the receiver
+     AckSent   ack sequence_number went out, for the newest datagram value
+               (and extra datagrams in all)
+     Dropped   value records were lost to a full ring (just after the
+               record before it, so stamped with its time)
+
+   Times are in microseconds, on the clock of whatever reported them (so
+   in virtual time in the emulator). */
+struct TraceRecord
+{
+  enum class Type : uint8_t { None = 0, Sent, Acked, Lost, Window, Timeout,
+			      Received, AckSent, Dropped };
+
+  uint64_t timestamp;
+  uint64_t sequence_number;
+  uint64_t value;
+  uint32_t extra;
+  uint16_t thread; /* the order in which threads first traced something */
+  Type type;
+  uint8_t reserved;
+
+  /* the name of a type (for decoding) */
+  static const char * type_name( const Type type );
+};
+
+/* A ring of records from one thread (the producer) to the flusher (the
+   consumer), without locks: each side only writes its own index. When
+   the ring is full, the producer either counts the record as dropped
+   rather than wait, or (for a lossless trace) flushes it itself. */
+class TraceRing
+{
+public:
+  static const uint64_t CAPACITY = 1 << 16; /* records (a power of two) */
+
+private:
+  std::unique_ptr<TraceRecord[]> records_;
+  uint16_t thread_;
+
+  /* the indices only increase; the producer's and the consumer's are a
+     cache line apart, so the two threads don't contend for one */
+  std::atomic<uint64_t> head_;    /* next to write (written by the producer) */
+  uint64_t cached_tail_;          /* the producer's last look at tail_ */
+  std::atomic<uint64_t> dropped_; /* (written by the producer) */
+  char padding_[ 64 ];
+  std::atomic<uint64_t> tail_;    /* next to read (written by the consumer) */
+  uint64_t reported_dropped_;     /* (the consumer's) */
+
+public:
+  TraceRing( const uint16_t thread );
+
+  /* the thread whose records these are */
+  uint16_t thread( void ) const { return thread_; }
+
+  /* add a record, unless the ring is full (producer only) */
+  bool try_push( const TraceRecord & record )
+  {
+    const uint64_t head = head_.load( std::memory_order_relaxed );
+    if ( head - cached_tail_ == CAPACITY ) {
+      cached_tail_ = tail_.load( std::memory_order_acquire );
+      if ( head - cached_tail_ == CAPACITY ) {
+	return false;
+      }
+    }
+
+    records_[ head & ( CAPACITY - 1 ) ] = record;
+    head_.store( head + 1, std::memory_order_release );
+    return true;
+  }
+
+  /* a record didn't fit (producer only) */
+  void drop( void ) { dropped_.store( dropped_.load( std::memory_order_relaxed ) + 1,
+				      std::memory_order_relaxed ); }
+
+  /* the records pushed so far, as up to two contiguous runs (consumer
+     only); returns how many records there are in all */
+  uint64_t peek( const TraceRecord * & first, uint64_t & first_count,
+		 const TraceRecord * & second, uint64_t & second_count ) const;
+
+  /* the consumer is done with this many of them */
+  void consume( const uint64_t count ) { tail_.store( tail_.load( std::memory_order_relaxed ) + count,
+						      std::memory_order_release ); }
+
+  /* how many records were dropped since the last call (consumer only) */
+  uint64_t newly_dropped( void );
+};
+
+/* A binary trace of events, written to a file. Each thread that records
+   an event gets its own TraceRing, and a background thread flushes them
+   all every few milliseconds into the file, which is memory-mapped (and
+   grown a chunk at a time), so recording costs a few stores and never a
+   syscall. The records reach the file in each thread's order, but
+   threads' records are interleaved only as the flushes happen.
+
+   A real-time program records into a lossy trace, which drops records
+   (and says how many) rather than hold up a thread whose ring is full.
+   A lossless trace, for programs that run in virtual time and would
+   rather run slower than lose records, has such a thread flush the rings
+   itself instead.
+
+   While an EventTrace exists, EventTrace::record() records into it. If
+   the process is killed, the file still holds everything flushed so far
+   (up to a tail of zeroed, unused records, which readers ignore). Destroy
+   it only once the threads that record have finished. */
+class EventTrace
+{
+public:
+  /* the file starts with a header the size of a record */
+  struct FileHeader
+  {
+    char magic[ 8 ];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t reserved[ 2 ];
+  };
+
+  static const char MAGIC[ 8 ];
+  static const uint32_t VERSION = 1;
+
+private:
+  /* how often the flusher runs, and how much the file grows at a time */
+  static const unsigned int FLUSH_INTERVAL_MS = 10;
+  static const size_t CHUNK_SIZE = 16 * 1024 * 1024;
+
+  FileDescriptor file_;
+  std::string filename_;
+  uint64_t id_; /* (unique to each trace, so threads know whose ring they have) */
+  bool lossless_;
+
+  /* the mapped chunk of the file, and where the next record goes in it */
+  char * chunk_;
+  uint64_t chunk_offset_;
+  size_t chunk_used_;
+
+  /* every thread's ring (only ever added to) */
+  std::mutex rings_mutex_;
+  std::vector<std::unique_ptr<TraceRing>> rings_;
+
+  std::mutex flusher_mutex_;
+  std::condition_variable flusher_wakeup_;
+  bool stopping_;
+  std::thread flusher_;
+
+  /* the trace being recorded into, if any */
+  static std::atomic<EventTrace *> current_;
+
+  /* this thread's ring, made the first time it records */
+  TraceRing & ring( void );
+
+  /* map the next chunk of the file, growing it */
+  void next_chunk( void );
+
+  /* copy records into the file */
+  void write( const TraceRecord * records, uint64_t count );
+
+  /* move everything in the rings so far to the file (with the rings
+     locked, whichever thread does it is their consumer) */
+  void flush( void );
+
+  /* the flusher thread's body */
+  void flush_until_stopped( void );
+
+public:
+  /* create (or truncate) the file and start recording into it */
+  EventTrace( const std::string & filename, const bool lossless = false );
+
+  /* stop recording, flush the rest, and trim the file to fit */
+  ~EventTrace();
+
+  /* is anything being recorded? */
+  static bool enabled( void ) { return current_.load( std::memory_order_relaxed ) != nullptr; }
+
+  /* record an event (doing nothing if no trace is being recorded) */
+  static void record( const TraceRecord::Type type, const uint64_t timestamp,
+		      const uint64_t sequence_number, const uint64_t value = 0,
+		      const uint32_t extra = 0 )
+  {
+    EventTrace * const trace = current_.load( std::memory_order_acquire );
+    if ( trace ) {
+      TraceRing & ring = trace->ring();
+      const TraceRecord record = { timestamp, sequence_number, value, extra, ring.thread(), type, 0 };
+      if ( not ring.try_push( record ) ) {
+	if ( trace->lossless_ ) {
+	  trace->flush();
+	  ring.try_push( record );
+	} else {
+	  ring.drop();
+	}
+      }
+    }
+  }
+
+  /* forbid copying EventTrace objects or assigning them */
+  EventTrace( const EventTrace & other ) = delete;
+  EventTrace & operator=( const EventTrace & other ) = delete;
+};
+
+#endif /* EVENT_TRACE_HH */
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "in_flight.hh"
+
+using namespace std;
+
+InFlightTable::InFlightTable( const size_t initial_capacity )
+  : ring_(),
+    base_( 0 ),
+    next_( 0 ),
+    largest_acked_( 0 ),
+    in_flight_( 0 ),
+    bytes_in_flight_( 0 ),
+    rack_send_time_( 0 ),
+    rack_rtt_( 0 ),
+    min_rtt_( MIN_RTT_WINDOW_US )
+{
+  size_t capacity = 1;
+  while ( capacity < initial_capacity ) {
+    capacity *= 2;
+  }
+  ring_.resize( capacity );
+}
+
+/* the next datagram was sent */
+void InFlightTable::sent( const uint64_t sequence_number, const uint64_t now, const uint32_t size )
+{
+  if ( sequence_number != next_ ) {
+    throw runtime_error( "InFlightTable: datagrams must be sent in sequence" );
+  }
+
+  if ( next_ - base_ == ring_.size() ) {
+    grow();
+  }
+
+  entry( next_++ ) = { now, size, State::InFlight };
+  in_flight_++;
+  bytes_in_flight_ += size;
+}
+
+/* the kernel says when these datagrams actually left the host */
+void InFlightTable::departed( const uint64_t first_datagram, const uint64_t count,
+			      const uint64_t timestamp )
+{
+  const uint64_t end = min( first_datagram + count, next_ );
+  for ( uint64_t sequence_number = max( first_datagram, base_ ); sequence_number < end; sequence_number++ ) {
+    Datagram & datagram = entry( sequence_number );
+    if ( datagram.state == State::InFlight ) {
+      datagram.send_time = timestamp;
+    }
+  }
+}
+
+/* a datagram was acknowledged */
+InFlightTable::State InFlightTable::acked( const uint64_t sequence_number, const uint64_t now,
+					   uint64_t & send_time )
+{
+  if ( sequence_number < base_ or sequence_number >= next_ ) {
+    return State::Unknown;
+  }
+
+  Datagram & datagram = entry( sequence_number );
+  const State previous = datagram.state;
+  send_time = datagram.send_time;
+
+  if ( previous == State::InFlight ) {
+    land( datagram, State::Acked );
+  } else if ( previous == State::Lost ) {
+    /* it was only late (the window doesn't get it back, since it has
+       already been taken out of flight) */
+    datagram.state = State::Acked;
+  } else {
+    return previous;
+  }
+
+  largest_acked_ = max( largest_acked_, sequence_number + 1 );
+
+  /* RACK follows the most recently sent datagram to be acknowledged */
+  if ( now >= send_time ) {
+    min_rtt_.update( now, now - send_time );
+    if ( send_time >= rack_send_time_ ) {
+      rack_send_time_ = send_time;
+      rack_rtt_ = now - send_time;
+    }
+  }
+
+  advance_base();
+  return previous;
+}
+
+/* datagrams were received, though without their own acks */
+uint64_t InFlightTable::acked_range( const uint64_t first, const uint64_t end )
+{
+  const uint64_t last = min( end, next_ );
+  uint64_t count = 0;
+
+  for ( uint64_t sequence_number = max( first, base_ ); sequence_number < last; sequence_number++ ) {
+    Datagram & datagram = entry( sequence_number );
+    if ( datagram.state == State::InFlight ) {
+      land( datagram, State::Acked );
+      count++;
+    }
+  }
+
+  if ( count ) {
+    largest_acked_ = max( largest_acked_, last );
+    advance_base();
+  }
+
+  return count;
+}
+
+/* take a datagram out of flight */
+void InFlightTable::land( Datagram & datagram, const State state )
+{
+  datagram.state = state;
+  in_flight_--;
+  bytes_in_flight_ -= datagram.size;
+}
+
+/* drop everything acknowledged or lost from the front of the ring */
+void InFlightTable::advance_base( void )
+{
+  while ( base_ < next_ and entry( base_ ).state != State::InFlight ) {
+    base_++;
+  }
+}
+
+/* double the ring, keeping each datagram at its sequence number */
+void InFlightTable::grow( void )
+{
+  vector<Datagram> bigger( 2 * ring_.size() );
+  for ( uint64_t sequence_number = base_; sequence_number < next_; sequence_number++ ) {
+    bigger[ sequence_number & ( bigger.size() - 1 ) ] = entry( sequence_number );
+  }
+  ring_.swap( bigger );
+}
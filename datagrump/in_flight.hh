@@ -0,0 +1,139 @@
+#ifndef IN_FLIGHT_HH
+#define IN_FLIGHT_HH
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "windowed_filter.hh"
+
+/* The sender's record of every datagram from the oldest one not yet
+   acknowledged or given up for lost to the newest sent, in a ring indexed
+   by sequence number (which grows if the window ever outgrows it). A
+   datagram is lost once three later ones have been acknowledged, or once
+   a later-sent one has been acknowledged and a reordering window has
+   passed since it would have been (as in RACK, RFC 8985). All times are
+   in microseconds. */
+class InFlightTable
+{
+public:
+  enum class State : uint8_t { Unknown, InFlight, Acked, Lost };
+
+  struct Datagram
+  {
+    uint64_t send_time;
+    uint32_t size;
+    State state;
+  };
+
+private:
+  /* acks of later datagrams that mean an earlier one is lost */
+  static const uint64_t DUPTHRESH = 3;
+
+  /* how long RACK's minimum RTT is remembered */
+  static const uint64_t MIN_RTT_WINDOW_US = 10000000;
+
+  std::vector<Datagram> ring_; /* size is a power of two */
+
+  uint64_t base_;          /* oldest datagram in the ring */
+  uint64_t next_;          /* one past the newest sent */
+  uint64_t largest_acked_; /* plus one (0 until the first ack) */
+
+  uint64_t in_flight_, bytes_in_flight_;
+
+  /* RACK: the send time and RTT of the most recently sent datagram acknowledged */
+  uint64_t rack_send_time_, rack_rtt_;
+  WindowedFilter<uint64_t, std::less<uint64_t>> min_rtt_;
+
+  Datagram & entry( const uint64_t sequence_number ) { return ring_[ sequence_number & ( ring_.size() - 1 ) ]; }
+
+  /* take a datagram out of flight */
+  void land( Datagram & datagram, const State state );
+
+  /* drop everything acknowledged or lost from the front of the ring */
+  void advance_base( void );
+
+  void grow( void );
+
+public:
+  InFlightTable( const size_t initial_capacity = 4096 );
+
+  /* the next datagram was sent (its sequence number must be next_sequence_number()) */
+  void sent( const uint64_t sequence_number, const uint64_t now, const uint32_t size );
+
+  /* the kernel says these datagrams actually left the host at this time */
+  void departed( const uint64_t first_datagram, const uint64_t count, const uint64_t timestamp );
+
+  /* a datagram was acknowledged: returns what was known of it before
+     (Unknown if it was never sent, or was forgotten long ago), and its
+     send time if known */
+  State acked( const uint64_t sequence_number, const uint64_t now, uint64_t & send_time );
+
+  /* every datagram from first up to (not including) end was received,
+     though without its own ack: returns how many of them were in flight */
+  uint64_t acked_range( const uint64_t first, const uint64_t end );
+
+  /* give up on each datagram that is lost by now, calling
+     lost( sequence_number, send_time ) for each, and return when the
+     next one will be (0 if none yet) */
+  template <typename Callback>
+  uint64_t detect_losses( const uint64_t now, Callback && lost );
+
+  /* the retransmission timer expired: everything in flight is lost */
+  template <typename Callback>
+  void all_lost( Callback && lost );
+
+  uint64_t next_sequence_number( void ) const { return next_; }
+  uint64_t in_flight( void ) const { return in_flight_; }
+  uint64_t bytes_in_flight( void ) const { return bytes_in_flight_; }
+};
+
+template <typename Callback>
+uint64_t InFlightTable::detect_losses( const uint64_t now, Callback && lost )
+{
+  /* how much later than the most recently sent ack a datagram may be
+     before it's lost (a quarter of the min RTT, as in RACK) */
+  const uint64_t reordering_window = min_rtt_.best() / 4;
+
+  uint64_t deadline = 0;
+
+  /* datagrams are sent (and depart) in sequence order, so the first one
+     still in flight that isn't lost yet is the next to be */
+  for ( uint64_t sequence_number = base_; sequence_number + 1 < largest_acked_; sequence_number++ ) {
+    Datagram & datagram = entry( sequence_number );
+    if ( datagram.state != State::InFlight ) {
+      continue;
+    }
+
+    const uint64_t lost_at = datagram.send_time + rack_rtt_ + reordering_window;
+    if ( largest_acked_ - 1 - sequence_number >= DUPTHRESH
+	 or ( datagram.send_time <= rack_send_time_ and lost_at <= now ) ) {
+      land( datagram, State::Lost );
+      lost( sequence_number, datagram.send_time );
+    } else {
+      if ( datagram.send_time <= rack_send_time_ ) {
+	deadline = lost_at;
+      }
+      break;
+    }
+  }
+
+  advance_base();
+  return deadline;
+}
+
+template <typename Callback>
+void InFlightTable::all_lost( Callback && lost )
+{
+  for ( uint64_t sequence_number = base_; sequence_number < next_; sequence_number++ ) {
+    Datagram & datagram = entry( sequence_number );
+    if ( datagram.state == State::InFlight ) {
+      land( datagram, State::Lost );
+      lost( sequence_number, datagram.send_time );
+    }
+  }
+
+  advance_base();
+}
+
+#endif /* IN_FLIGHT_HH */
@@ -0,0 +1,347 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "link_emulator.hh"
+#include "mapped_file.hh"
+
+using namespace std;
+
+/* sizes on the wire: each datagram carries the same dummy payload as
+   the sender's, and an ack is just the header */
+static const uint32_t IP_UDP_HEADER_SIZE = 28;
+static const uint32_t DATAGRAM_SIZE = ContestMessage::Header::WIRE_SIZE + 1424;
+static const uint32_t ACK_SIZE = ContestMessage::Header::WIRE_SIZE;
+
+LinkTrace::LinkTrace( const string & filename )
+  : filename_( filename ),
+    opportunities_()
+{
+  const MappedFile file( filename );
+
+  /* one number per line (blank lines are skipped) */
+  const char * p = file.begin();
+  while ( p != file.end() ) {
+    const char * const line = p;
+    if ( *p == '\n' or *p == '\r' ) {
+      p++;
+      continue;
+    }
+
+    uint64_t ms = 0;
+    for ( ; p != file.end() and *p >= '0' and *p <= '9'; p++ ) {
+      ms = 10 * ms + ( *p - '0' );
+    }
+
+    if ( p == line or ( p != file.end() and *p != '\n' and *p != '\r' ) ) {
+      throw runtime_error( filename + ": not a trace (each line should be a time in milliseconds)" );
+    }
+
+    if ( not opportunities_.empty() and ms < opportunities_.back() ) {
+      throw runtime_error( filename + ": times in a trace must not decrease" );
+    }
+
+    opportunities_.push_back( ms );
+  }
+
+  if ( opportunities_.empty() or opportunities_.back() == 0 ) {
+    throw runtime_error( filename + ": a trace must last at least a millisecond" );
+  }
+}
+
+TraceLink::TraceLink( const LinkTrace & trace, const uint64_t start_time,
+		      const uint64_t queue_packets, const uint64_t queue_bytes,
+		      ostream * log, LinkLogAnalyzer * analyzer )
+  : trace_( trace ),
+    start_time_( start_time ),
+    queue_packets_( queue_packets ),
+    queue_bytes_( queue_bytes ),
+    log_( log ),
+    analyzer_( analyzer ),
+    next_opportunity_( 0 ),
+    queue_(),
+    queued_bytes_( 0 )
+{}
+
+/* a packet arrives at the queue */
+bool TraceLink::enqueue( const uint64_t now, EmulatedPacket packet )
+{
+  if ( opportunity_time( next_opportunity_ ) <= now ) {
+    throw runtime_error( "TraceLink: packet arrived before the link was advanced to its time" );
+  }
+
+  const uint64_t waiting = queue_.size() - front_in_transit();
+  if ( ( queue_packets_ and waiting + 1 > queue_packets_ )
+       or ( queue_bytes_ and queued_bytes_ + packet.size > queue_bytes_ ) ) {
+    if ( log_ ) {
+      *log_ << log_time( now ) << " d " << packet.size << "\n";
+    }
+    if ( analyzer_ ) {
+      analyzer_->drop( log_time( now ), packet.size );
+    }
+    return false;
+  }
+
+  if ( log_ ) {
+    *log_ << log_time( now ) << " + " << packet.size << "\n";
+  }
+  if ( analyzer_ ) {
+    analyzer_->arrival( log_time( now ), packet.size );
+  }
+
+  packet.bytes_left = packet.size;
+  packet.time = now;
+  queue_.push_back( packet );
+  queued_bytes_ += packet.size;
+  return true;
+}
+
+string TraceLink::queue_description( void ) const
+{
+  if ( queue_packets_ == 0 and queue_bytes_ == 0 ) {
+    return "infinite";
+  }
+
+  string limits;
+  if ( queue_bytes_ ) {
+    limits = "bytes=" + to_string( queue_bytes_ );
+  }
+  if ( queue_packets_ ) {
+    limits += ( limits.empty() ? "" : ", " ) + ( "packets=" + to_string( queue_packets_ ) );
+  }
+  return "droptail [" + limits + "]";
+}
+
+LinkEmulator::Settings::Settings()
+  : delay_ms( 20 ),
+    queue_packets( 0 ),
+    queue_bytes( 0 ),
+    duration_ms( 0 ),
+    pacing( true ),
+    uplink_log( nullptr )
+{}
+
+bool LinkEmulator::Settings::is_setting( const string & name )
+{
+  return name == "delay" or name == "queue_packets" or name == "queue_bytes"
+    or name == "duration" or name == "pacing";
+}
+
+/* a whole non-negative number, or false */
+static bool parse_number( const string & value, uint64_t & number )
+{
+  if ( value.empty() or value.find_first_not_of( "0123456789" ) != string::npos ) {
+    return false;
+  }
+
+  number = stoull( value );
+  return true;
+}
+
+bool LinkEmulator::Settings::set( const string & name, const string & value )
+{
+  if ( name == "delay" ) {
+    return parse_number( value, delay_ms );
+  } else if ( name == "queue_packets" ) {
+    return parse_number( value, queue_packets );
+  } else if ( name == "queue_bytes" ) {
+    return parse_number( value, queue_bytes );
+  } else if ( name == "duration" ) {
+    return parse_number( value, duration_ms );
+  } else if ( name == "pacing" and ( value == "off" or value == "user" ) ) {
+    pacing = value == "user";
+    return true;
+  }
+
+  return false;
+}
+
+LinkEmulator::LinkEmulator( const LinkTrace & uplink, const LinkTrace & downlink,
+			    Controller & controller, const Settings & settings )
+  : settings_( settings ),
+    controller_( controller ),
+    end_time_( START_TIME_US
+	       + 1000 * ( settings.duration_ms ? settings.duration_ms : uplink.period_ms() ) ),
+    analyzer_(),
+    uplink_( uplink, START_TIME_US, settings.queue_packets, settings.queue_bytes,
+	     settings.uplink_log, &analyzer_ ),
+    uplink_delay_( settings.delay_ms * 1000 ),
+    downlink_delay_( settings.delay_ms * 1000 ),
+    downlink_( downlink, START_TIME_US, 0, 0, nullptr, nullptr ),
+    in_flight_(),
+    pacer_(),
+    retransmit_deadline_( 0 ),
+    loss_deadline_( 0 ),
+    ack_sequence_number_( 0 ),
+    results_()
+{
+  if ( settings_.uplink_log ) {
+    *settings_.uplink_log << "# mahimahi mm-link (uplink) [" << uplink.filename() << "] (emulated)\n"
+			  << "# queue: " << uplink_.queue_description() << "\n"
+			  << "# init timestamp: 0\n"
+			  << "# base timestamp: 0\n";
+  }
+}
+
+bool LinkEmulator::window_is_open( void )
+{
+  return in_flight_.in_flight() < controller_.window_size();
+}
+
+void LinkEmulator::send_datagram( const uint64_t now )
+{
+  EmulatedPacket packet = EmulatedPacket();
+  ContestMessageView cm = ContestMessageView::make( packet.header.data(),
+						    in_flight_.next_sequence_number() );
+  cm.set_send_timestamp( now );
+  packet.size = DATAGRAM_SIZE + IP_UDP_HEADER_SIZE;
+
+  in_flight_.sent( cm.sequence_number(), now, DATAGRAM_SIZE );
+  controller_.datagram_was_sent( cm.sequence_number(), now );
+  results_.datagrams_sent++;
+
+  if ( not uplink_.enqueue( now, packet ) ) {
+    results_.datagrams_dropped++;
+  }
+}
+
+/* close the window, as fast as pacing allows */
+void LinkEmulator::send_more( const uint64_t now )
+{
+  pacer_.set_rate( settings_.pacing ? controller_.pacing_rate() : 0 );
+
+  while ( window_is_open() and pacer_.can_send( now ) ) {
+    send_datagram( now );
+    pacer_.sent( now );
+  }
+}
+
+/* the sender hears an ack */
+void LinkEmulator::got_ack( const uint64_t now, EmulatedPacket packet )
+{
+  /* (the header is all there is of it) */
+  const ContestMessageView ack( packet.header.data(), packet.header.size() );
+
+  uint64_t send_timestamp = ack.ack_send_timestamp();
+  const InFlightTable::State previous = in_flight_.acked( ack.ack_sequence_number(), now, send_timestamp );
+  if ( previous == InFlightTable::State::Acked ) {
+    return; /* a duplicate */
+  }
+
+  controller_.ack_received( ack.ack_sequence_number(), send_timestamp,
+			    ack.ack_recv_timestamp(), ack.send_timestamp(), now );
+}
+
+void LinkEmulator::look_for_losses( const uint64_t now )
+{
+  loss_deadline_ = in_flight_.detect_losses( now, [&] ( const uint64_t sequence_number,
+							 const uint64_t send_timestamp ) {
+					       results_.datagrams_lost++;
+					       controller_.datagram_was_lost( sequence_number, send_timestamp, now );
+					     } );
+}
+
+/* no ack for a while: give up on everything in flight and send one datagram */
+void LinkEmulator::retransmit_timeout( const uint64_t now )
+{
+  in_flight_.all_lost( [&] ( const uint64_t sequence_number,
+			     const uint64_t send_timestamp ) {
+			 results_.datagrams_lost++;
+			 controller_.datagram_was_lost( sequence_number, send_timestamp, now );
+		       } );
+  controller_.timeout_expired();
+  results_.timeouts++;
+
+  send_datagram( now );
+  retransmit_deadline_ = now + controller_.timeout_ms() * 1000;
+}
+
+/* when the sender next has something to do */
+uint64_t LinkEmulator::sender_next_event_time( const uint64_t now )
+{
+  uint64_t next = retransmit_deadline_;
+  if ( loss_deadline_ ) {
+    next = min( next, loss_deadline_ );
+  }
+  if ( window_is_open() ) {
+    next = min( next, pacer_.can_send( now ) ? now : pacer_.next_send_time() );
+  }
+  return next;
+}
+
+/* a datagram got through the uplink's queue */
+void LinkEmulator::uplink_delivered( const EmulatedPacket & packet, const uint64_t time )
+{
+  results_.datagrams_delivered++;
+  uplink_delay_.push( time, packet );
+}
+
+/* the receiver acknowledges a datagram */
+void LinkEmulator::receive( const uint64_t now, EmulatedPacket packet )
+{
+  /* (the view has the datagram's length, so the ack says how long its
+     payload was, but only the header is read and written) */
+  ContestMessageView message( packet.header.data(), packet.size - IP_UDP_HEADER_SIZE );
+  message.transform_into_ack( ack_sequence_number_++, now );
+  message.set_send_timestamp( now );
+  packet.size = ACK_SIZE + IP_UDP_HEADER_SIZE;
+
+  downlink_delay_.push( now, packet );
+}
+
+void LinkEmulator::step( const uint64_t now )
+{
+  /* the sender hears acks */
+  bool acked = false;
+  downlink_.advance( now, [&] ( const EmulatedPacket & packet, const uint64_t ) {
+      got_ack( now, packet );
+      acked = true;
+    } );
+  if ( acked ) {
+    look_for_losses( now );
+    retransmit_deadline_ = now + controller_.timeout_ms() * 1000;
+  }
+
+  /* the receiver acks what arrives, and the acks reach the downlink */
+  uplink_delay_.advance( now, [&] ( const EmulatedPacket & packet ) { receive( now, packet ); } );
+  downlink_delay_.advance( now, [&] ( const EmulatedPacket & packet ) { downlink_.enqueue( now, packet ); } );
+
+  /* datagrams get through the uplink */
+  uplink_.advance( now, [&] ( const EmulatedPacket & packet, const uint64_t time ) {
+      uplink_delivered( packet, time );
+    } );
+
+  /* the sender's timers, then more datagrams */
+  if ( loss_deadline_ and loss_deadline_ <= now ) {
+    look_for_losses( now );
+  }
+  if ( retransmit_deadline_ <= now ) {
+    retransmit_timeout( now );
+  }
+  send_more( now );
+}
+
+LinkEmulator::Results LinkEmulator::run( void )
+{
+  retransmit_deadline_ = START_TIME_US + controller_.timeout_ms() * 1000;
+
+  for ( uint64_t now = START_TIME_US; now <= end_time_; ) {
+    step( now );
+
+    now = min( { sender_next_event_time( now ),
+		 uplink_.next_event_time(), uplink_delay_.next_event_time(),
+		 downlink_delay_.next_event_time(), downlink_.next_event_time() } );
+  }
+
+  finish();
+  return results_;
+}
+
+/* the rest of the uplink's opportunities, and the statistics */
+void LinkEmulator::finish( void )
+{
+  uplink_.advance( end_time_, [&] ( const EmulatedPacket & packet, const uint64_t time ) {
+      uplink_delivered( packet, time );
+    } );
+
+  results_.uplink = analyzer_.summary();
+}
@@ -0,0 +1,290 @@
+#ifndef LINK_EMULATOR_HH
+#define LINK_EMULATOR_HH
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "contest_message.hh"
+#include "controller.hh"
+#include "in_flight.hh"
+#include "log_analyzer.hh"
+#include "pacer.hh"
+
+/* A mahimahi link trace: each line is the time (in milliseconds) of an
+   opportunity to deliver up to PACKET_SIZE bytes, and the trace repeats
+   once its last line has passed. */
+class LinkTrace
+{
+private:
+  std::string filename_;
+  std::vector<uint64_t> opportunities_; /* in order */
+
+public:
+  /* bytes an opportunity can deliver (as in mm-link) */
+  static const uint64_t PACKET_SIZE = 1504;
+
+  /* read a trace file (memory-mapped); throws if it isn't one */
+  LinkTrace( const std::string & filename );
+
+  const std::string & filename( void ) const { return filename_; }
+
+  /* how long before the trace repeats */
+  uint64_t period_ms( void ) const { return opportunities_.back(); }
+
+  /* when the nth opportunity comes, counting on through the repeats */
+  uint64_t opportunity_ms( const uint64_t n ) const
+  {
+    return opportunities_[ n % opportunities_.size() ] + n / opportunities_.size() * period_ms();
+  }
+};
+
+/* A datagram or ack crossing the emulated network. Only its header is
+   kept (the payload is never read), along with its size on the wire. */
+struct EmulatedPacket
+{
+  std::array<char, ContestMessage::Header::WIRE_SIZE> header;
+  uint32_t size;       /* including the IP and UDP headers */
+  uint32_t bytes_left; /* still to be delivered by the link */
+  uint64_t time;       /* when it reached the link, or leaves the delay line */
+};
+
+/* One direction of a link, as in mm-link: a droptail queue drained at
+   the trace's delivery opportunities. A packet may take several
+   opportunities (or share one with others), and an opportunity that
+   finds the queue empty is wasted. If given a log, it writes one in
+   mm-link's format, and if given an analyzer, it feeds it the same
+   events. All times are in microseconds. */
+class TraceLink
+{
+private:
+  const LinkTrace & trace_;
+  uint64_t start_time_; /* when the trace starts */
+
+  /* queue limits (0: unlimited) */
+  uint64_t queue_packets_, queue_bytes_;
+
+  std::ostream * log_;
+  LinkLogAnalyzer * analyzer_;
+
+  uint64_t next_opportunity_;
+  std::deque<EmulatedPacket> queue_; /* the front may be partly delivered */
+  uint64_t queued_bytes_;
+
+  uint64_t opportunity_time( const uint64_t n ) const
+  {
+    return start_time_ + trace_.opportunity_ms( n ) * 1000;
+  }
+
+  uint64_t log_time( const uint64_t time ) const { return ( time - start_time_ ) / 1000; }
+
+  /* is the front packet partly delivered (so no longer waiting in the queue)? */
+  bool front_in_transit( void ) const
+  {
+    return not queue_.empty() and queue_.front().bytes_left < queue_.front().size;
+  }
+
+public:
+  TraceLink( const LinkTrace & trace, const uint64_t start_time,
+	     const uint64_t queue_packets, const uint64_t queue_bytes,
+	     std::ostream * log, LinkLogAnalyzer * analyzer );
+
+  /* a packet arrives (after the link has been advanced to now): returns
+     false if the queue is full, and it was dropped */
+  bool enqueue( const uint64_t now, EmulatedPacket packet );
+
+  /* use every opportunity up to now, calling delivered( packet, time )
+     for each packet that has been delivered in full */
+  template <typename Callback>
+  void advance( const uint64_t now, Callback && delivered );
+
+  /* when a packet may next be delivered (-1 if none is queued) */
+  uint64_t next_event_time( void ) const
+  {
+    return queue_.empty() ? uint64_t( -1 ) : opportunity_time( next_opportunity_ );
+  }
+
+  /* opportunities so far */
+  uint64_t opportunities( void ) const { return next_opportunity_; }
+
+  /* a description of the queue, as in mm-link's log */
+  std::string queue_description( void ) const;
+
+  /* forbid copying links or assigning them */
+  TraceLink( const TraceLink & other ) = delete;
+  TraceLink & operator=( const TraceLink & other ) = delete;
+};
+
+/* A fixed propagation delay, as in mm-delay */
+class DelayLine
+{
+private:
+  uint64_t delay_;
+  std::deque<EmulatedPacket> packets_;
+
+public:
+  DelayLine( const uint64_t delay ) : delay_( delay ), packets_() {}
+
+  void push( const uint64_t now, EmulatedPacket packet )
+  {
+    packet.time = now + delay_;
+    packets_.push_back( packet );
+  }
+
+  /* call arrived( packet ) for each packet out of the delay by now */
+  template <typename Callback>
+  void advance( const uint64_t now, Callback && arrived )
+  {
+    while ( not packets_.empty() and packets_.front().time <= now ) {
+      const EmulatedPacket packet = packets_.front();
+      packets_.pop_front();
+      arrived( packet );
+    }
+  }
+
+  uint64_t next_event_time( void ) const
+  {
+    return packets_.empty() ? uint64_t( -1 ) : packets_.front().time;
+  }
+};
+
+/* Runs a sender and receiver over an emulated path like run-contest's
+   (mm-delay DELAY mm-link UPLINK DOWNLINK) in virtual time. Datagrams
+   cross the uplink's queue and then the delay, and acks the delay and
+   then the downlink's queue. The sender follows DatagrumpSender's rules
+   (the window, pacing, loss detection and the retransmission timeout)
+   with the real Controller and ContestMessage code, and the receiver
+   acknowledges each datagram. Nothing waits on a clock, so a whole trace
+   takes a fraction of a second, and a run always comes out the same.
+   Each emulator makes one run (but traces can be shared between them). */
+class LinkEmulator
+{
+public:
+  struct Settings
+  {
+    uint64_t delay_ms;      /* one way */
+    uint64_t queue_packets; /* the uplink's droptail limits (0: unlimited) */
+    uint64_t queue_bytes;
+    uint64_t duration_ms;   /* 0: one pass over the uplink trace */
+    bool pacing;            /* at the controller's rate */
+    std::ostream * uplink_log; /* or nullptr */
+
+    /* like run-contest's */
+    Settings();
+
+    /* is this (e.g. from a command line's name=value) one of the
+       settings above? (all but the log) */
+    static bool is_setting( const std::string & name );
+
+    /* change one: returns false if the value isn't valid for it */
+    bool set( const std::string & name, const std::string & value );
+  };
+
+  struct Results
+  {
+    /* the uplink, as its log would be analyzed */
+    LinkLogAnalyzer::Summary uplink;
+
+    uint64_t datagrams_sent, datagrams_delivered;
+    uint64_t datagrams_dropped; /* by the uplink's queue */
+    uint64_t datagrams_lost;    /* as far as the sender could tell */
+    uint64_t timeouts;
+  };
+
+private:
+  /* virtual time starts here (not at 0, which the sender's bookkeeping
+     takes to mean "never") */
+  static const uint64_t START_TIME_US = 1000000;
+
+  Settings settings_;
+  Controller & controller_;
+  uint64_t end_time_;
+
+  LinkLogAnalyzer analyzer_; /* of the uplink */
+  TraceLink uplink_;
+  DelayLine uplink_delay_, downlink_delay_;
+  TraceLink downlink_;
+
+  /* the sender */
+  InFlightTable in_flight_;
+  Pacer pacer_;
+  uint64_t retransmit_deadline_, loss_deadline_;
+
+  /* the receiver */
+  uint64_t ack_sequence_number_;
+
+  Results results_;
+
+  bool window_is_open( void );
+  void send_datagram( const uint64_t now );
+  void send_more( const uint64_t now );
+  void got_ack( const uint64_t now, EmulatedPacket packet );
+  void look_for_losses( const uint64_t now );
+  void retransmit_timeout( const uint64_t now );
+  uint64_t sender_next_event_time( const uint64_t now );
+
+  void uplink_delivered( const EmulatedPacket & packet, const uint64_t time );
+  void receive( const uint64_t now, EmulatedPacket packet );
+
+  /* everything that happens at this time */
+  void step( const uint64_t now );
+
+  void finish( void );
+
+public:
+  LinkEmulator( const LinkTrace & uplink, const LinkTrace & downlink,
+		Controller & controller, const Settings & settings );
+
+  /* run to the end */
+  Results run( void );
+
+  /* forbid copying emulators or assigning them */
+  LinkEmulator( const LinkEmulator & other ) = delete;
+  LinkEmulator & operator=( const LinkEmulator & other ) = delete;
+};
+
+template <typename Callback>
+void TraceLink::advance( const uint64_t now, Callback && delivered )
+{
+  for ( uint64_t time = opportunity_time( next_opportunity_ ); time <= now;
+	time = opportunity_time( ++next_opportunity_ ) ) {
+    if ( log_ ) {
+      *log_ << log_time( time ) << " # " << LinkTrace::PACKET_SIZE << "\n";
+    }
+    if ( analyzer_ ) {
+      analyzer_->opportunity( log_time( time ), LinkTrace::PACKET_SIZE );
+    }
+
+    uint64_t budget = LinkTrace::PACKET_SIZE;
+    while ( budget and not queue_.empty() ) {
+      EmulatedPacket & packet = queue_.front();
+      if ( packet.bytes_left == packet.size ) {
+	queued_bytes_ -= packet.size; /* now in transit */
+      }
+
+      if ( packet.bytes_left > budget ) {
+	packet.bytes_left -= budget;
+	break;
+      }
+
+      budget -= packet.bytes_left;
+      packet.bytes_left = 0;
+      if ( log_ ) {
+	*log_ << log_time( time ) << " - " << packet.size
+	      << " " << log_time( time ) - log_time( packet.time ) << "\n";
+      }
+      if ( analyzer_ ) {
+	analyzer_->departure( log_time( time ), packet.size, log_time( time ) - log_time( packet.time ) );
+      }
+
+      const EmulatedPacket done = packet;
+      queue_.pop_front();
+      delivered( done, time );
+    }
+  }
+}
+
+#endif /* LINK_EMULATOR_HH */
@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include "log_analyzer.hh"
+
+using namespace std;
+
+void DelayHistogram::add( const uint64_t ms )
+{
+  if ( ms >= counts_.size() ) {
+    counts_.resize( max<size_t>( ms + 1, 2 * counts_.size() ) );
+  }
+
+  counts_[ ms ]++;
+  total_count_++;
+  sum_ += ms;
+}
+
+uint64_t DelayHistogram::percentile( const double fraction ) const
+{
+  const uint64_t rank = max<uint64_t>( 1, ceil( fraction * total_count_ ) );
+
+  uint64_t seen = 0;
+  for ( uint64_t ms = 0; ms < counts_.size(); ms++ ) {
+    seen += counts_[ ms ];
+    if ( seen >= rank ) {
+      return ms;
+    }
+  }
+
+  return 0; /* (empty) */
+}
+
+LinkLogAnalyzer::LinkLogAnalyzer()
+  : started_( false ),
+    base_timestamp_( 0 ),
+    first_timestamp_( 0 ),
+    last_timestamp_( 0 ),
+    capacity_bytes_( 0 ),
+    delivered_bytes_( 0 ),
+    delays_(),
+    signal_delays_(),
+    signal_cursor_( 0 ),
+    freshest_send_time_( -1 ),
+    partial_line_(),
+    line_number_( 0 )
+{}
+
+/* note an event's time, returning it relative to the base timestamp */
+uint64_t LinkLogAnalyzer::event( const uint64_t timestamp )
+{
+  if ( timestamp < base_timestamp_ ) {
+    throw runtime_error( "log event before the base timestamp" );
+  }
+
+  const uint64_t relative = timestamp - base_timestamp_;
+  if ( not started_ ) {
+    started_ = true;
+    first_timestamp_ = last_timestamp_ = signal_cursor_ = relative;
+  }
+
+  last_timestamp_ = max( last_timestamp_, relative );
+  advance_signal( relative );
+  return relative;
+}
+
+/* each millisecond's signal delay is fixed once the next event comes */
+void LinkLogAnalyzer::advance_signal( const uint64_t timestamp )
+{
+  if ( freshest_send_time_ == uint64_t( -1 ) ) {
+    /* (nothing has been delivered yet, so there is no signal) */
+    signal_cursor_ = max( signal_cursor_, timestamp );
+    return;
+  }
+
+  for ( ; signal_cursor_ < timestamp; signal_cursor_++ ) {
+    signal_delays_.add( signal_cursor_ - freshest_send_time_ );
+  }
+}
+
+void LinkLogAnalyzer::opportunity( const uint64_t timestamp, const uint64_t bytes )
+{
+  event( timestamp );
+  capacity_bytes_ += bytes;
+}
+
+void LinkLogAnalyzer::arrival( const uint64_t timestamp, const uint64_t )
+{
+  event( timestamp );
+}
+
+void LinkLogAnalyzer::departure( const uint64_t timestamp, const uint64_t bytes, const uint64_t delay )
+{
+  const uint64_t relative = event( timestamp );
+  delivered_bytes_ += bytes;
+  delays_.add( delay );
+
+  const uint64_t send_time = relative - min( delay, relative );
+  if ( freshest_send_time_ == uint64_t( -1 ) or send_time > freshest_send_time_ ) {
+    freshest_send_time_ = send_time;
+  }
+}
+
+void LinkLogAnalyzer::drop( const uint64_t timestamp, const uint64_t )
+{
+  event( timestamp );
+}
+
+/* read a number at p, moving past it and any spaces after it */
+static uint64_t parse_number( const char * & p, const char * const end )
+{
+  const char * const start = p;
+  uint64_t value = 0;
+  for ( ; p != end and *p >= '0' and *p <= '9'; p++ ) {
+    value = 10 * value + ( *p - '0' );
+  }
+
+  if ( p == start ) {
+    throw runtime_error( "expected a number" );
+  }
+
+  while ( p != end and ( *p == ' ' or *p == '\t' ) ) {
+    p++;
+  }
+  return value;
+}
+
+/* one line: TIME + BYTES, TIME # BYTES, TIME - BYTES DELAY, TIME d BYTES,
+   or a comment (which may give the base timestamp) */
+void LinkLogAnalyzer::parse_line( const char * begin, const char * end )
+{
+  line_number_++;
+
+  if ( end != begin and *( end - 1 ) == '\r' ) {
+    end--;
+  }
+  if ( begin == end ) {
+    return;
+  }
+
+  try {
+    if ( *begin == '#' ) {
+      static const char base_prefix[] = "# base timestamp: ";
+      const size_t prefix_length = sizeof( base_prefix ) - 1;
+      if ( size_t( end - begin ) > prefix_length and memcmp( begin, base_prefix, prefix_length ) == 0 ) {
+	const char * p = begin + prefix_length;
+	base_timestamp_ = parse_number( p, end );
+      }
+      return;
+    }
+
+    const char * p = begin;
+    const uint64_t timestamp = parse_number( p, end );
+    if ( p == end ) {
+      throw runtime_error( "expected an event type" );
+    }
+    const char type = *p++;
+    while ( p != end and *p == ' ' ) {
+      p++;
+    }
+    const uint64_t bytes = parse_number( p, end );
+
+    switch ( type ) {
+    case '#': opportunity( timestamp, bytes ); break;
+    case '+': arrival( timestamp, bytes ); break;
+    case 'd': drop( timestamp, bytes ); break;
+    case '-': departure( timestamp, bytes, parse_number( p, end ) ); break;
+    default: throw runtime_error( string( "unknown event type " ) + type );
+    }
+
+    if ( p != end ) {
+      throw runtime_error( "unexpected text after the event" );
+    }
+  } catch ( const runtime_error & e ) {
+    throw runtime_error( "log line " + to_string( line_number_ ) + ": " + e.what() );
+  }
+}
+
+void LinkLogAnalyzer::parse( const char * data, const size_t length )
+{
+  const char * p = data;
+  const char * const end = data + length;
+
+  while ( p != end ) {
+    const char * const newline = static_cast<const char *>( memchr( p, '\n', end - p ) );
+    if ( newline == nullptr ) {
+      partial_line_.append( p, end );
+      return;
+    }
+
+    if ( partial_line_.empty() ) {
+      parse_line( p, newline );
+    } else {
+      partial_line_.append( p, newline );
+      parse_line( partial_line_.data(), partial_line_.data() + partial_line_.size() );
+      partial_line_.clear();
+    }
+    p = newline + 1;
+  }
+}
+
+LinkLogAnalyzer::Summary LinkLogAnalyzer::summary( void )
+{
+  if ( not partial_line_.empty() ) {
+    const string last_line = move( partial_line_ );
+    partial_line_.clear();
+    parse_line( last_line.data(), last_line.data() + last_line.size() );
+  }
+
+  /* the last millisecond's signal delay */
+  if ( started_ ) {
+    advance_signal( last_timestamp_ + 1 );
+  }
+
+  Summary summary = Summary();
+  const uint64_t duration_ms = last_timestamp_ - first_timestamp_;
+  summary.duration_s = duration_ms / 1000.0;
+  if ( duration_ms ) {
+    summary.capacity_mbps = capacity_bytes_ * 8.0 / ( duration_ms * 1000 );
+    summary.throughput_mbps = delivered_bytes_ * 8.0 / ( duration_ms * 1000 );
+  }
+
+  summary.mean_delay_ms = delays_.mean();
+  summary.delay_p95_ms = delays_.percentile( 0.95 );
+  summary.signal_delay_p95_ms = signal_delays_.percentile( 0.95 );
+  return summary;
+}
@@ -0,0 +1,92 @@
+#ifndef LOG_ANALYZER_HH
+#define LOG_ANALYZER_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Counts of whole milliseconds, for exact percentiles in memory that
+   grows with the largest value rather than with how many there are */
+class DelayHistogram
+{
+private:
+  std::vector<uint64_t> counts_;
+  uint64_t total_count_;
+  double sum_;
+
+public:
+  DelayHistogram() : counts_(), total_count_( 0 ), sum_( 0 ) {}
+
+  void add( const uint64_t ms );
+
+  uint64_t count( void ) const { return total_count_; }
+  double mean( void ) const { return total_count_ ? sum_ / total_count_ : 0; }
+
+  /* the smallest value at least this fraction of them are at or below */
+  uint64_t percentile( const double fraction ) const;
+};
+
+/* Analyzes a link's events as mm-link logs them (and as the emulator's
+   TraceLink does), in one pass: delivery opportunities give the
+   capacity, departures the throughput and each packet's queueing delay,
+   and the signal delay at each millisecond is how long ago the freshest
+   datagram delivered so far was sent (so it grows while the link, or
+   the sender, is idle). Times are in milliseconds, and the results
+   match mm-throughput-graph's summary. */
+class LinkLogAnalyzer
+{
+public:
+  struct Summary
+  {
+    double duration_s;
+    double capacity_mbps, throughput_mbps;
+    double mean_delay_ms, delay_p95_ms;    /* per-packet queueing delay */
+    double signal_delay_p95_ms;
+
+    double utilization( void ) const
+    {
+      return capacity_mbps > 0 ? throughput_mbps / capacity_mbps : 0;
+    }
+  };
+
+private:
+  bool started_;
+  uint64_t base_timestamp_, first_timestamp_, last_timestamp_;
+  uint64_t capacity_bytes_, delivered_bytes_;
+
+  DelayHistogram delays_, signal_delays_;
+
+  /* the next millisecond whose signal delay is due, and when the
+     freshest datagram delivered before it was sent (-1 if none yet) */
+  uint64_t signal_cursor_, freshest_send_time_;
+
+  /* a line split across two blocks of input */
+  std::string partial_line_;
+  uint64_t line_number_;
+
+  /* an event at this time */
+  uint64_t event( const uint64_t timestamp );
+
+  /* record signal delays up to (not including) this time */
+  void advance_signal( const uint64_t timestamp );
+
+  void parse_line( const char * begin, const char * end );
+
+public:
+  LinkLogAnalyzer();
+
+  /* the events */
+  void opportunity( const uint64_t timestamp, const uint64_t bytes );
+  void arrival( const uint64_t timestamp, const uint64_t bytes );
+  void departure( const uint64_t timestamp, const uint64_t bytes, const uint64_t delay );
+  void drop( const uint64_t timestamp, const uint64_t bytes );
+
+  /* parse the next block of a log in mm-link's format (lines may be
+     split between blocks); throws if a line isn't an event or comment */
+  void parse( const char * data, const size_t length );
+
+  /* the results so far (after the last line, if it had no newline) */
+  Summary summary( void );
+};
+
+#endif /* LOG_ANALYZER_HH */
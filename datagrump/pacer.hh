@@ -0,0 +1,47 @@
+#ifndef PACER_HH
+#define PACER_HH
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+/* Spreads datagrams out at a rate (in datagrams per second), instead of
+   sending a whole window at once. Each datagram sent pushes back when the
+   next may go by one interval at the current rate. After a quiet spell the
+   sender may catch up by a short burst, at most BURST_US worth (or two
+   datagrams, if that is more), so that timers firing a little late don't
+   cost throughput. All times are in microseconds. */
+class Pacer
+{
+private:
+  static const uint64_t BURST_US = 250;
+
+  double rate_;             /* 0 means unpaced */
+  double next_send_time_;
+
+public:
+  Pacer() : rate_( 0 ), next_send_time_( 0 ) {}
+
+  void set_rate( const double rate ) { rate_ = rate; }
+  double rate( void ) const { return rate_; }
+
+  /* may a datagram go now? */
+  bool can_send( const uint64_t now ) const { return rate_ <= 0 or next_send_time_ <= now; }
+
+  /* when the next one may go (rounded up, so it may go then) */
+  uint64_t next_send_time( void ) const { return std::ceil( next_send_time_ ); }
+
+  /* a datagram was sent */
+  void sent( const uint64_t now )
+  {
+    if ( rate_ <= 0 ) {
+      return;
+    }
+
+    const double interval = 1000000 / rate_;
+    const double earliest = now - std::max( double( BURST_US ), 2 * interval );
+    next_send_time_ = std::max( next_send_time_, earliest ) + interval;
+  }
+};
+
+#endif /* PACER_HH */
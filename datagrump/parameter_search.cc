@@ -0,0 +1,459 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <thread>
+
+#include "parameter_search.hh"
+
+using namespace std;
+
+/* a number, or throw */
+static double parse_double( const string & name, const string & text )
+{
+  char * end = nullptr;
+  const double value = strtod( text.c_str(), &end );
+  if ( text.empty() or end != text.c_str() + text.size() or not isfinite( value ) ) {
+    throw runtime_error( "invalid value for " + name + ": " + text );
+  }
+  return value;
+}
+
+/* split text at each separator */
+static vector<string> split( const string & text, const char separator )
+{
+  vector<string> pieces( 1 );
+  for ( const char c : text ) {
+    if ( c == separator ) {
+      pieces.emplace_back();
+    } else {
+      pieces.back().push_back( c );
+    }
+  }
+  return pieces;
+}
+
+SearchParameter::SearchParameter( const string & name, const string & specification )
+  : name_( name ),
+    values_(),
+    low_( 0 ),
+    high_( 0 ),
+    step_( 0 )
+{
+  if ( specification.find( ',' ) != string::npos ) {
+    for ( const string & value : split( specification, ',' ) ) {
+      values_.push_back( parse_double( name, value ) );
+    }
+    sort( values_.begin(), values_.end() );
+    values_.erase( unique( values_.begin(), values_.end() ), values_.end() );
+    low_ = values_.front();
+    high_ = values_.back();
+    return;
+  }
+
+  const vector<string> bounds = split( specification, ':' );
+  if ( bounds.size() != 2 and bounds.size() != 3 ) {
+    throw runtime_error( "search parameter " + name + " should be LOW:HIGH[:STEP] or a list A,B,...: "
+			 + specification );
+  }
+
+  low_ = parse_double( name, bounds[ 0 ] );
+  high_ = parse_double( name, bounds[ 1 ] );
+  if ( bounds.size() == 3 ) {
+    step_ = parse_double( name, bounds[ 2 ] );
+  }
+
+  if ( high_ < low_ or step_ < 0 ) {
+    throw runtime_error( "search parameter " + name + " has an empty range: " + specification );
+  }
+}
+
+bool SearchParameter::is_specification( const string & value )
+{
+  return value.find_first_of( ":," ) != string::npos;
+}
+
+vector<double> SearchParameter::grid( void ) const
+{
+  if ( not values_.empty() ) {
+    return values_;
+  }
+
+  if ( step_ == 0 ) {
+    if ( high_ > low_ ) {
+      throw runtime_error( "a grid search needs a step for " + name_ + " (LOW:HIGH:STEP)" );
+    }
+    return { low_ };
+  }
+
+  /* (allowing for rounding in the last step) */
+  vector<double> values;
+  const uint64_t steps = floor( ( high_ - low_ ) / step_ + 1e-9 );
+  for ( uint64_t i = 0; i <= steps; i++ ) {
+    values.push_back( low_ + i * step_ );
+  }
+  return values;
+}
+
+double SearchParameter::value_at( const double point ) const
+{
+  const double target = low_ + max( 0.0, min( 1.0, point ) ) * ( high_ - low_ );
+
+  if ( not values_.empty() ) {
+    const auto above = lower_bound( values_.begin(), values_.end(), target );
+    if ( above == values_.begin() ) {
+      return *above;
+    } else if ( above == values_.end() or target - *prev( above ) < *above - target ) {
+      return *prev( above );
+    }
+    return *above;
+  }
+
+  if ( step_ == 0 ) {
+    return target;
+  }
+
+  const double steps = floor( ( high_ - low_ ) / step_ + 1e-9 );
+  return low_ + min( steps, round( ( target - low_ ) / step_ ) ) * step_;
+}
+
+double SearchParameter::point_of( const double value ) const
+{
+  return high_ > low_ ? ( value - low_ ) / ( high_ - low_ ) : 0;
+}
+
+/* Gaussian-process regression of scores over points in [0, 1]^d, with
+   a squared-exponential kernel whose length scale is chosen by maximum
+   likelihood (the scores are standardized first) */
+class GaussianProcess
+{
+private:
+  /* the trials are deterministic, so there is almost no noise */
+  static constexpr double NOISE = 1e-4;
+
+  vector<vector<double>> points_;
+  double mean_, scale_, length_;
+
+  vector<vector<double>> cholesky_; /* of the kernel matrix */
+  vector<double> weights_;          /* its inverse times the scores */
+
+  double kernel( const vector<double> & a, const vector<double> & b ) const
+  {
+    double distance = 0;
+    for ( size_t i = 0; i < a.size(); i++ ) {
+      distance += ( a[ i ] - b[ i ] ) * ( a[ i ] - b[ i ] );
+    }
+    return exp( -distance / ( 2 * length_ * length_ ) );
+  }
+
+  /* solve L x = b, in place */
+  void forward_substitute( vector<double> & x ) const
+  {
+    for ( size_t i = 0; i < x.size(); i++ ) {
+      for ( size_t j = 0; j < i; j++ ) {
+	x[ i ] -= cholesky_[ i ][ j ] * x[ j ];
+      }
+      x[ i ] /= cholesky_[ i ][ i ];
+    }
+  }
+
+  /* fit with the current length scale, returning the log likelihood */
+  double fit( const vector<double> & scores )
+  {
+    const size_t n = points_.size();
+    cholesky_.assign( n, vector<double>( n, 0 ) );
+
+    double log_determinant = 0;
+    for ( size_t i = 0; i < n; i++ ) {
+      for ( size_t j = 0; j <= i; j++ ) {
+	double sum = kernel( points_[ i ], points_[ j ] ) + ( i == j ? NOISE : 0 );
+	for ( size_t k = 0; k < j; k++ ) {
+	  sum -= cholesky_[ i ][ k ] * cholesky_[ j ][ k ];
+	}
+
+	if ( i == j ) {
+	  if ( sum <= 0 ) {
+	    return -numeric_limits<double>::infinity();
+	  }
+	  cholesky_[ i ][ i ] = sqrt( sum );
+	  log_determinant += 2 * log( cholesky_[ i ][ i ] );
+	} else {
+	  cholesky_[ i ][ j ] = sum / cholesky_[ j ][ j ];
+	}
+      }
+    }
+
+    /* weights = K^-1 y, by solving L z = y and then L^T w = z */
+    weights_.resize( n );
+    for ( size_t i = 0; i < n; i++ ) {
+      weights_[ i ] = ( scores[ i ] - mean_ ) / scale_;
+    }
+    forward_substitute( weights_ );
+    double fit_term = 0;
+    for ( const double z : weights_ ) {
+      fit_term += z * z;
+    }
+    for ( size_t i = n; i-- > 0; ) {
+      for ( size_t j = i + 1; j < n; j++ ) {
+	weights_[ i ] -= cholesky_[ j ][ i ] * weights_[ j ];
+      }
+      weights_[ i ] /= cholesky_[ i ][ i ];
+    }
+
+    return -0.5 * fit_term - 0.5 * log_determinant;
+  }
+
+public:
+  GaussianProcess( const vector<vector<double>> & points, const vector<double> & scores )
+    : points_( points ), mean_( 0 ), scale_( 1 ), length_( 0 ), cholesky_(), weights_()
+  {
+    mean_ = accumulate( scores.begin(), scores.end(), 0.0 ) / scores.size();
+    double variance = 0;
+    for ( const double score : scores ) {
+      variance += ( score - mean_ ) * ( score - mean_ );
+    }
+    scale_ = variance > 0 ? sqrt( variance / scores.size() ) : 1;
+
+    double best_length = 0.2, best_likelihood = -numeric_limits<double>::infinity();
+    for ( const double length : { 0.05, 0.1, 0.2, 0.3, 0.5, 1.0 } ) {
+      length_ = length;
+      const double likelihood = fit( scores );
+      if ( likelihood > best_likelihood ) {
+	best_length = length;
+	best_likelihood = likelihood;
+      }
+    }
+
+    length_ = best_length;
+    fit( scores );
+  }
+
+  /* the predicted score at a point, and its standard deviation */
+  void predict( const vector<double> & point, double & mean, double & deviation ) const
+  {
+    vector<double> similarity( points_.size() );
+    for ( size_t i = 0; i < points_.size(); i++ ) {
+      similarity[ i ] = kernel( point, points_[ i ] );
+    }
+
+    double standardized = 0;
+    for ( size_t i = 0; i < points_.size(); i++ ) {
+      standardized += similarity[ i ] * weights_[ i ];
+    }
+
+    forward_substitute( similarity );
+    double explained = 0;
+    for ( const double v : similarity ) {
+      explained += v * v;
+    }
+
+    mean = mean_ + scale_ * standardized;
+    deviation = scale_ * sqrt( max( 1e-12, 1 + NOISE - explained ) );
+  }
+};
+
+/* expected improvement on the best score so far (with a small margin,
+   so the search doesn't just polish the best) */
+static double expected_improvement( const double mean, const double deviation, const double best )
+{
+  const double improvement = mean - best - 0.01 * deviation;
+  const double z = improvement / deviation;
+  const double cdf = 0.5 * erfc( -z / sqrt( 2.0 ) );
+  const double pdf = exp( -0.5 * z * z ) / sqrt( 2 * M_PI );
+  return improvement * cdf + deviation * pdf;
+}
+
+ParameterSearch::ParameterSearch( const vector<SearchParameter> & parameters,
+				  const Evaluator & evaluator, const unsigned int threads )
+  : parameters_( parameters ),
+    evaluator_( evaluator ),
+    threads_( max( 1u, threads ) )
+{
+  if ( parameters_.empty() ) {
+    throw runtime_error( "nothing to search over" );
+  }
+}
+
+/* run trials [first, end) on up to threads_ threads */
+void ParameterSearch::evaluate( vector<Trial> & trials, const size_t first ) const
+{
+  atomic<size_t> next( first );
+  mutex error_mutex;
+  exception_ptr error;
+
+  auto work = [&] () {
+    try {
+      for ( size_t i = next++; i < trials.size(); i = next++ ) {
+	evaluator_( trials[ i ] );
+      }
+    } catch ( ... ) {
+      lock_guard<mutex> lock( error_mutex );
+      error = current_exception();
+      next = trials.size();
+    }
+  };
+
+  vector<thread> workers;
+  const size_t count = min<size_t>( threads_, trials.size() - first );
+  for ( size_t i = 1; i < count; i++ ) {
+    workers.emplace_back( work );
+  }
+  work(); /* this thread works too */
+
+  for ( auto & worker : workers ) {
+    worker.join();
+  }
+
+  if ( error ) {
+    rethrow_exception( error );
+  }
+}
+
+vector<Trial> ParameterSearch::grid( void ) const
+{
+  vector<vector<double>> axes;
+  for ( const auto & parameter : parameters_ ) {
+    axes.push_back( parameter.grid() );
+  }
+
+  /* count through the combinations like an odometer, the last parameter fastest */
+  vector<Trial> trials;
+  vector<size_t> position( axes.size(), 0 );
+  while ( true ) {
+    vector<double> values;
+    for ( size_t i = 0; i < axes.size(); i++ ) {
+      values.push_back( axes[ i ][ position[ i ] ] );
+    }
+    trials.emplace_back( values );
+
+    size_t i = axes.size();
+    while ( i > 0 and ++position[ i - 1 ] == axes[ i - 1 ].size() ) {
+      position[ --i ] = 0;
+    }
+    if ( i == 0 ) {
+      break;
+    }
+  }
+
+  evaluate( trials, 0 );
+  return trials;
+}
+
+vector<Trial> ParameterSearch::bayesian( const unsigned int total, const uint64_t seed ) const
+{
+  mt19937_64 random( seed );
+  uniform_real_distribution<double> uniform( 0, 1 );
+  normal_distribution<double> nudge( 0, 0.05 );
+
+  const size_t dimensions = parameters_.size();
+  vector<Trial> trials;
+  set<vector<double>> tried;
+
+  /* move a point to the nearest allowed values (and find those values) */
+  auto snap = [&] ( vector<double> & point, vector<double> & values ) {
+    values.resize( dimensions );
+    for ( size_t i = 0; i < dimensions; i++ ) {
+      values[ i ] = parameters_[ i ].value_at( point[ i ] );
+      point[ i ] = parameters_[ i ].point_of( values[ i ] );
+    }
+  };
+
+  /* start with a spread of random points (a Latin hypercube) */
+  const size_t initial = min<size_t>( total, max<size_t>( threads_, 2 * dimensions + 2 ) );
+  vector<vector<size_t>> strata( dimensions, vector<size_t>( initial ) );
+  for ( auto & stratum : strata ) {
+    iota( stratum.begin(), stratum.end(), 0 );
+    shuffle( stratum.begin(), stratum.end(), random );
+  }
+
+  for ( size_t k = 0; k < initial; k++ ) {
+    vector<double> point( dimensions ), values;
+    for ( size_t i = 0; i < dimensions; i++ ) {
+      point[ i ] = ( strata[ i ][ k ] + uniform( random ) ) / initial;
+    }
+    snap( point, values );
+    if ( tried.insert( values ).second ) {
+      trials.emplace_back( values );
+    }
+  }
+  evaluate( trials, 0 );
+
+  /* then a batch at a time where the model expects the most improvement */
+  while ( trials.size() < total ) {
+    vector<vector<double>> points;
+    vector<double> scores;
+    for ( const auto & trial : trials ) {
+      vector<double> point( dimensions );
+      for ( size_t i = 0; i < dimensions; i++ ) {
+	point[ i ] = parameters_[ i ].point_of( trial.values[ i ] );
+      }
+      points.push_back( point );
+      scores.push_back( trial.score );
+    }
+
+    /* the best trials so far, to look near */
+    vector<size_t> ranked( trials.size() );
+    iota( ranked.begin(), ranked.end(), 0 );
+    sort( ranked.begin(), ranked.end(),
+	  [&] ( const size_t a, const size_t b ) { return trials[ a ].score > trials[ b ].score; } );
+    ranked.resize( min<size_t>( ranked.size(), 5 ) );
+
+    const size_t batch_start = trials.size();
+    const size_t batch = min<size_t>( threads_, total - trials.size() );
+    for ( size_t b = 0; b < batch; b++ ) {
+      const GaussianProcess model( points, scores );
+      const double best = *max_element( scores.begin(), scores.end() );
+
+      /* candidates: anywhere at random, and near the best */
+      double best_gain = -1;
+      vector<double> best_point, best_values;
+      for ( size_t c = 0; c < 2000; c++ ) {
+	vector<double> point( dimensions ), values;
+	for ( size_t i = 0; i < dimensions; i++ ) {
+	  point[ i ] = c < 1500 ? uniform( random )
+	    : points[ ranked[ c % ranked.size() ] ][ i ] + nudge( random );
+	}
+	snap( point, values );
+	if ( tried.count( values ) ) {
+	  continue;
+	}
+
+	double mean, deviation;
+	model.predict( point, mean, deviation );
+	const double gain = expected_improvement( mean, deviation, best );
+	if ( gain > best_gain ) {
+	  best_gain = gain;
+	  best_point = point;
+	  best_values = values;
+	}
+      }
+
+      if ( best_values.empty() ) {
+	break; /* every candidate has been tried */
+      }
+
+      /* (the rest of the batch assumes this one scores as predicted) */
+      double mean, deviation;
+      model.predict( best_point, mean, deviation );
+      points.push_back( best_point );
+      scores.push_back( mean );
+
+      tried.insert( best_values );
+      trials.emplace_back( best_values );
+    }
+
+    if ( trials.size() == batch_start ) {
+      break;
+    }
+    evaluate( trials, batch_start );
+  }
+
+  return trials;
+}
@@ -0,0 +1,81 @@
+#ifndef PARAMETER_SEARCH_HH
+#define PARAMETER_SEARCH_HH
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "link_emulator.hh"
+
+/* A controller option to search over: either a range (LOW:HIGH, or
+   LOW:HIGH:STEP to take only every STEP from LOW) or a list of values
+   (A,B,C...). The search sees each one as the interval [0, 1]. */
+class SearchParameter
+{
+private:
+  std::string name_;
+  std::vector<double> values_; /* the list, in order (empty for a range) */
+  double low_, high_, step_;   /* (step 0: any value in the range) */
+
+public:
+  /* parse a specification (throws if it is neither a range nor a list) */
+  SearchParameter( const std::string & name, const std::string & specification );
+
+  /* does a value look like a specification (rather than a plain value)? */
+  static bool is_specification( const std::string & value );
+
+  const std::string & name( void ) const { return name_; }
+
+  /* every value, for a grid search (throws for a range without steps) */
+  std::vector<double> grid( void ) const;
+
+  /* the allowed value nearest to a point in [0, 1], and a value's point */
+  double value_at( const double point ) const;
+  double point_of( const double value ) const;
+};
+
+/* one configuration tried */
+struct Trial
+{
+  std::vector<double> values; /* one for each parameter */
+  LinkEmulator::Results results;
+  double score;               /* higher is better */
+
+  Trial( const std::vector<double> & s_values ) : values( s_values ), results(), score( 0 ) {}
+};
+
+/* Searches the parameters' space for the configuration that scores
+   best, running trials in parallel threads. A grid search tries every
+   combination. A Bayesian search tries a spread of random ones, then
+   fits a Gaussian process to the scores so far and tries wherever its
+   expected improvement on the best is greatest, a batch of one per
+   thread at a time (each batch chosen as if the trials before it in the
+   batch had scored as predicted). */
+class ParameterSearch
+{
+public:
+  /* runs a trial (filling in its results and score); it is called from
+     several threads at once */
+  typedef std::function<void( Trial & trial )> Evaluator;
+
+private:
+  std::vector<SearchParameter> parameters_;
+  Evaluator evaluator_;
+  unsigned int threads_;
+
+  /* run trials [first, end) in parallel */
+  void evaluate( std::vector<Trial> & trials, const size_t first ) const;
+
+public:
+  ParameterSearch( const std::vector<SearchParameter> & parameters,
+		   const Evaluator & evaluator, const unsigned int threads );
+
+  /* every combination of the parameters' values */
+  std::vector<Trial> grid( void ) const;
+
+  /* up to this many trials, the random choices following the seed */
+  std::vector<Trial> bayesian( const unsigned int trials, const uint64_t seed ) const;
+};
+
+#endif /* PARAMETER_SEARCH_HH */
@@ -1,12 +1,428 @@
-/* simple UDP receiver that acknowledges every datagram */
+/* simple UDP receiver that acknowledges every datagram
+   (each with its own ack, or several per ack) */
 
 #include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 
 #include "socket.hh"
+#include "io_uring.hh"
+#include "reactor.hh"
+#include "util.hh"
 #include "contest_message.hh"
+#include "event_trace.hh"
 
 using namespace std;
+using namespace PollerShortNames;
+
+/* maximum number of datagrams to receive (and acknowledge) at once */
+static const unsigned int BATCH_SIZE = 64;
+
+/* most datagrams one coalesced ack can cover */
+static const unsigned int MAX_ACK_EVERY = 256;
+
+/* turn a received datagram into its acknowledgment, in place in its buffer */
+static iovec make_ack( const iovec & datagram, const uint64_t recv_timestamp,
+		       uint64_t & sequence_number )
+{
+  ContestMessageView message( static_cast<char *>( datagram.iov_base ), datagram.iov_len );
+  EventTrace::record( TraceRecord::Type::Received, recv_timestamp,
+		      message.sequence_number(), message.send_timestamp() );
+
+  /* assemble the acknowledgment */
+  message.transform_into_ack( sequence_number++, recv_timestamp );
+
+  /* timestamp the ack just before sending */
+  message.set_send_timestamp();
+  EventTrace::record( TraceRecord::Type::AckSent, message.send_timestamp(),
+		      message.sequence_number(), message.ack_sequence_number(), 1 );
+
+  return { message.data(), message.length() };
+}
+
+/* how the receiver acknowledges datagrams */
+struct AckPolicy
+{
+  unsigned int every;    /* datagrams per ack (1: ack each one in place) */
+  uint64_t max_delay_us; /* longest an ack waits for that many */
+};
+
+/* acknowledges datagrams on a non-blocking socket, a batch per syscall,
+   either one ack per datagram or coalesced (see SelectiveAckView) */
+class Acknowledger
+{
+private:
+  /* ranges reported in each coalesced ack, and remembered */
+  static const unsigned int MAX_SACK_RANGES = 4;
+  static const unsigned int MAX_TRACKED_RANGES = 32;
+
+  UDPSocket & socket_;
+  Poller & poller_;
+  AckPolicy policy_;
+  uint64_t sequence_number_;
+
+  /* reusable receive buffers, so the receive path doesn't allocate */
+  BufferPool pool_;
+  vector<UDPSocket::received_datagram_view> batch_;
+  vector<pair<Address, iovec>> acks_; /* point into batch_'s buffers, or ack_space_ */
+
+  /* coalesced acks are written here, one per ack_stride_ bytes */
+  size_t ack_stride_;
+  vector<char> ack_space_;
+
+  /* what has been received from one sender: everything before
+     cumulative_ack, and these ranges above it (in order) */
+  struct ReceivedRanges
+  {
+    uint64_t cumulative_ack;
+    vector<SelectiveAckView::Range> ranges;
+
+    ReceivedRanges() : cumulative_ack( 0 ), ranges() { ranges.reserve( MAX_TRACKED_RANGES + 1 ); }
+
+    /* add a sequence number */
+    void add( const uint64_t sequence_number )
+    {
+      /* a sender starting over at 0 (from the same address) is a new session */
+      if ( sequence_number == 0 and ( cumulative_ack or not ranges.empty() ) ) {
+	cumulative_ack = 0;
+	ranges.clear();
+      }
+
+      if ( sequence_number < cumulative_ack ) {
+	return;
+      }
+
+      /* usually it's the newest, so search from the top */
+      auto it = ranges.end();
+      while ( it != ranges.begin() and sequence_number < prev( it )->first ) {
+	--it;
+      }
+
+      if ( it != ranges.begin() and sequence_number < prev( it )->end ) {
+	return; /* a duplicate */
+      }
+
+      const bool joins_below = it != ranges.begin() and prev( it )->end == sequence_number;
+      const bool joins_above = it != ranges.end() and it->first == sequence_number + 1;
+      if ( joins_below and joins_above ) {
+	prev( it )->end = it->end;
+	ranges.erase( it );
+      } else if ( joins_below ) {
+	prev( it )->end++;
+      } else if ( joins_above ) {
+	it->first--;
+      } else {
+	ranges.insert( it, { sequence_number, sequence_number + 1 } );
+      }
+
+      /* the range at the bottom may fill the hole below it */
+      if ( ranges.front().first == cumulative_ack ) {
+	cumulative_ack = ranges.front().end;
+	ranges.erase( ranges.begin() );
+      } else if ( ranges.size() > MAX_TRACKED_RANGES ) {
+	ranges.erase( ranges.begin() );
+      }
+    }
+  };
+
+  /* each sender's (all forgotten if there get to be too many) */
+  static const size_t MAX_SOURCES = 4096;
+  unordered_map<Address, ReceivedRanges> received_;
+
+  /* datagrams received but not yet acknowledged: the newest, who sent
+     it, and the others */
+  unsigned int pending_count_;
+  Address pending_source_;
+  ReceivedRanges * pending_received_; /* (pending_source_'s) */
+  uint64_t newest_sequence_number_, newest_send_timestamp_;
+  uint64_t newest_recv_timestamp_, newest_payload_length_;
+  vector<SelectiveAckView::Sample> pending_samples_;
+
+  Poller::TimerID delay_timer_;
+
+  /* what has been received from a sender */
+  ReceivedRanges & received_from( const Address & source )
+  {
+    auto it = received_.find( source );
+    if ( it == received_.end() ) {
+      if ( received_.size() >= MAX_SOURCES ) {
+	received_.clear();
+      }
+      it = received_.emplace( source, ReceivedRanges() ).first;
+    }
+    return it->second;
+  }
+
+  /* a datagram arrived, to be acknowledged in a coalesced ack */
+  void coalesce( const Address & source, const uint64_t recv_timestamp, const iovec & datagram )
+  {
+    const ContestMessageView message( static_cast<char *>( datagram.iov_base ), datagram.iov_len );
+
+    if ( pending_count_ and source != pending_source_ ) {
+      flush();
+    }
+
+    if ( pending_count_ ) {
+      pending_samples_.push_back( { newest_sequence_number_, newest_recv_timestamp_ } );
+    } else {
+      pending_source_ = source;
+      pending_received_ = &received_from( source );
+    }
+
+    newest_sequence_number_ = message.sequence_number();
+    newest_send_timestamp_ = message.send_timestamp();
+    newest_recv_timestamp_ = recv_timestamp;
+    newest_payload_length_ = message.payload_length();
+    pending_received_->add( newest_sequence_number_ );
+    EventTrace::record( TraceRecord::Type::Received, recv_timestamp,
+			newest_sequence_number_, newest_send_timestamp_ );
+
+    if ( ++pending_count_ >= policy_.every ) {
+      flush();
+    } else if ( pending_count_ == 1 ) {
+      /* don't hold the first one back for long */
+      if ( poller_.timer_valid( delay_timer_ ) ) {
+	poller_.reschedule_timer( delay_timer_, policy_.max_delay_us );
+      } else {
+	delay_timer_ = poller_.add_timer( policy_.max_delay_us, [this] () {
+	    flush();
+	    send_acks();
+	    return ResultType::Continue;
+	  } );
+      }
+    }
+  }
+
+  /* write one ack for all the pending datagrams */
+  void flush( void )
+  {
+    if ( pending_count_ == 0 ) {
+      return;
+    }
+
+    if ( ack_space_.size() < ( acks_.size() + 1 ) * ack_stride_ ) {
+      ack_space_.resize( ( acks_.size() + 1 ) * ack_stride_ );
+    }
+    char * const ack = &ack_space_[ acks_.size() * ack_stride_ ];
+
+    ContestMessageView message = ContestMessageView::make( ack, sequence_number_++ );
+    message.set_acked( newest_sequence_number_, newest_send_timestamp_,
+		       newest_recv_timestamp_, newest_payload_length_ );
+
+    /* the newest ranges, newest first */
+    SelectiveAckView::Range ranges[ MAX_SACK_RANGES ];
+    uint32_t range_count = 0;
+    const ReceivedRanges & received = *pending_received_;
+    for ( auto it = received.ranges.rbegin();
+	  it != received.ranges.rend() and range_count < MAX_SACK_RANGES; ++it ) {
+      ranges[ range_count++ ] = *it;
+    }
+
+    const size_t payload_length
+      = SelectiveAckView::write( ack + ContestMessage::Header::WIRE_SIZE, received.cumulative_ack,
+				 ranges, range_count,
+				 pending_samples_.data(), pending_samples_.size() );
+
+    /* timestamp the ack just before sending */
+    message.set_send_timestamp();
+    EventTrace::record( TraceRecord::Type::AckSent, message.send_timestamp(),
+			message.sequence_number(), newest_sequence_number_, pending_count_ );
+
+    /* (its place in ack_space_ is filled in once the batch is done,
+       since ack_space_ may still grow) */
+    acks_.emplace_back( pending_source_,
+			iovec { nullptr, ContestMessage::Header::WIRE_SIZE + payload_length } );
+
+    pending_count_ = 0;
+    pending_samples_.clear();
+    if ( poller_.timer_valid( delay_timer_ ) ) {
+      poller_.cancel_timer( delay_timer_ );
+    }
+  }
+
+  /* send the acks written so far */
+  void send_acks( void )
+  {
+    if ( acks_.empty() ) {
+      return;
+    }
+
+    if ( policy_.every > 1 ) {
+      for ( size_t i = 0; i < acks_.size(); i++ ) {
+	acks_[ i ].second.iov_base = &ack_space_[ i * ack_stride_ ];
+      }
+    }
+
+    /* (acks the send buffer has no room for are dropped, as a full
+       queue in the network would drop them) */
+    socket_.try_sendto_batch( acks_ );
+    acks_.clear();
+  }
+
+public:
+  Acknowledger( UDPSocket & socket, Poller & poller, const AckPolicy & policy )
+    : socket_( socket ), poller_( poller ), policy_( policy ), sequence_number_( 0 ),
+      pool_( 65536, BATCH_SIZE ), batch_(), acks_(),
+      ack_stride_( ContestMessage::Header::WIRE_SIZE
+		   + SelectiveAckView::size( MAX_SACK_RANGES, policy.every - 1 ) ),
+      ack_space_(), received_(),
+      pending_count_( 0 ), pending_source_(), pending_received_( nullptr ),
+      newest_sequence_number_( 0 ), newest_send_timestamp_( 0 ),
+      newest_recv_timestamp_( 0 ), newest_payload_length_( 0 ),
+      pending_samples_(), delay_timer_( 0 )
+  {
+    socket_.set_blocking( false );
+    acks_.reserve( BATCH_SIZE );
+    pending_samples_.reserve( policy_.every );
+  }
+
+  /* receive and acknowledge every pending datagram, until the socket would block */
+  void drain( void )
+  {
+    while ( socket_.try_recv_batch( pool_, batch_, BATCH_SIZE ) ) {
+      for ( auto & recd : batch_ ) {
+	/* GRO may have coalesced several datagrams into one receive */
+	for ( size_t i = 0; i < recd.segment_count(); i++ ) {
+	  if ( policy_.every > 1 ) {
+	    coalesce( recd.source_address, recd.timestamp, recd.segment_iovec( i ) );
+	  } else {
+	    acks_.emplace_back( recd.source_address,
+				make_ack( recd.segment_iovec( i ), recd.timestamp, sequence_number_ ) );
+	  }
+	}
+      }
+
+      /* send the acks */
+      send_acks();
+    }
+  }
+
+  /* poller action that drains the socket each time it becomes readable */
+  Action action( void )
+  {
+    return Action( socket_, Direction::In, [this] () {
+	drain();
+	return ResultType::Continue;
+      }, Action::Trigger::Edge );
+  }
+
+  /* forbid copying Acknowledger objects or assigning them */
+  Acknowledger( const Acknowledger & other ) = delete;
+  Acknowledger & operator=( const Acknowledger & other ) = delete;
+};
+
+/* receive and acknowledge batches of datagrams from an epoll loop */
+static void ack_with_recvmmsg( UDPSocket & socket, const AckPolicy & policy )
+{
+  Poller poller( Poller::Backend::Epoll );
+  Acknowledger acknowledger( socket, poller, policy );
+  poller.add_action( acknowledger.action() );
+
+  /* Loop and acknowledge every incoming datagram back to its source */
+  while ( true ) {
+    poller.poll( -1 );
+  }
+}
+
+/* keep BATCH_SIZE receives queued on an io_uring, each one re-queued
+   once its acknowledgment has been sent */
+static void ack_with_io_uring( UDPSocket & socket )
+{
+  struct PendingReceive {
+    UDPSocket::receive_slot slot;
+    msghdr header;
+    UDPSocket::received_datagram_view datagram;
+
+    iovec ack_iovec; /* points into the datagram's buffer */
+    msghdr ack_header;
+
+    PendingReceive() : slot(), header(), datagram(), ack_iovec(), ack_header() {}
+  };
+
+  uint64_t sequence_number = 0;
+
+  IOUring ring( 2 * BATCH_SIZE );
+  BufferPool pool( 65536, BATCH_SIZE );
+  vector<PendingReceive> pending( BATCH_SIZE );
+
+  /* (each completion captures only what fits in a std::function
+     without allocating) */
+  function<void(PendingReceive &)> post_receive;
+  function<void(PendingReceive &, const int)> received, sent;
+
+  post_receive = [&] ( PendingReceive & p ) {
+    p.slot.prepare( p.header, p.datagram.payload );
+
+    ring.recvmsg( socket, p.header, [&p, &received] ( const int result ) {
+	received( p, result );
+      } );
+  };
+
+  /* (a receive or send that fails loses one datagram or ack, as the
+     network might; the receiver carries on) */
+  received = [&] ( PendingReceive & p, const int result ) {
+    if ( result < 0 ) {
+      post_receive( p );
+      return;
+    }
+
+    UDPSocket::finish_receive( p.header, result, p.datagram );
+    p.ack_iovec = make_ack( { p.datagram.payload.data(), p.datagram.payload.size() },
+			    p.datagram.timestamp, sequence_number );
+
+    /* send the ack back to the datagram's source */
+    zero( p.ack_header );
+    p.ack_header.msg_name = const_cast<sockaddr *>( &p.datagram.source_address.to_sockaddr() );
+    p.ack_header.msg_namelen = p.datagram.source_address.size();
+    p.ack_header.msg_iov = &p.ack_iovec;
+    p.ack_header.msg_iovlen = 1;
+
+    ring.sendmsg( socket, p.ack_header, [&p, &sent] ( const int send_result ) {
+	sent( p, send_result );
+      } );
+  };
+
+  sent = [&] ( PendingReceive & p, const int ) {
+    post_receive( p );
+  };
+
+  for ( auto & p : pending ) {
+    p.datagram.payload = pool.acquire();
+    post_receive( p );
+  }
+
+  /* Loop and acknowledge every incoming datagram back to its source */
+  while ( true ) {
+    ring.run();
+  }
+}
+
+/* shard the port across worker threads with SO_REUSEPORT,
+   each receiving and acknowledging batches from its own epoll loop */
+static unsigned int ack_with_reactors( const string & port, const unsigned int threads,
+				       const bool cpu_affinity, const AckPolicy & policy )
+{
+  ReactorPool reactors( threads );
+
+  return reactors.run( [&] ( ReactorPool::Worker & worker ) {
+      UDPSocket & socket = worker.make<UDPSocket>();
+      socket.set_reuseport();
+      socket.set_timestamps();
+      socket.set_gro();
+      socket.bind( Address( "::0", port ) );
+
+      /* the group's filter applies to every worker's socket */
+      if ( cpu_affinity and worker.index() == 0 ) {
+	socket.set_reuseport_cpu_affinity();
+      }
+
+      worker.poller().add_action( worker.make<Acknowledger>( socket, worker.poller(), policy ).action() );
+    } );
+}
 
 int main( int argc, char *argv[] )
 {
@@ -15,11 +431,54 @@ int main( int argc, char *argv[] )
     abort();
   }
 
-  if ( argc != 2 ) {
-    cerr << "Usage: " << argv[ 0 ] << " PORT" << endl;
+  bool use_io_uring = false, cpu_affinity = false;
+  unsigned int threads = 0;
+  AckPolicy policy = { 1, 1000 };
+  string trace_filename;
+
+  bool usage_ok = argc >= 2;
+  for ( int i = 2; usage_ok and i < argc; i++ ) {
+    const string arg = argv[ i ];
+    if ( arg == "io_uring" ) {
+      use_io_uring = true;
+    } else if ( arg == "cpu_affinity" ) {
+      cpu_affinity = true;
+    } else if ( arg.substr( 0, 8 ) == "threads=" and arg.size() > 8 ) {
+      threads = stoul( arg.substr( 8 ) );
+    } else if ( arg.substr( 0, 10 ) == "ack_every=" and arg.size() > 10 ) {
+      policy.every = stoul( arg.substr( 10 ) );
+      usage_ok = policy.every >= 1 and policy.every <= MAX_ACK_EVERY;
+    } else if ( arg.substr( 0, 10 ) == "ack_delay=" and arg.size() > 10 ) {
+      policy.max_delay_us = stoul( arg.substr( 10 ) );
+    } else if ( arg.substr( 0, 6 ) == "trace=" and arg.size() > 6 ) {
+      trace_filename = arg.substr( 6 );
+    } else {
+      usage_ok = false;
+    }
+  }
+
+  /* (the io_uring receiver acks each datagram as its receive completes) */
+  if ( policy.every > 1 and use_io_uring ) {
+    usage_ok = false;
+  }
+
+  if ( not usage_ok ) {
+    cerr << "Usage: " << argv[ 0 ] << " PORT [io_uring] [threads=N [cpu_affinity]]"
+	 << " [ack_every=N [ack_delay=MICROSECONDS]] [trace=FILE]" << endl;
     return EXIT_FAILURE;
   }
 
+  /* (each worker thread traces into its own ring) */
+  unique_ptr<EventTrace> trace;
+  if ( not trace_filename.empty() ) {
+    trace.reset( new EventTrace( trace_filename ) );
+  }
+
+  if ( threads ) {
+    cerr << "Listening on port " << argv[ 1 ] << " with " << threads << " threads" << endl;
+    return ack_with_reactors( argv[ 1 ], threads, cpu_affinity, policy );
+  }
+
   /* create UDP socket for incoming datagrams */
   UDPSocket socket;
 
@@ -31,21 +490,17 @@ int main( int argc, char *argv[] )
 
   cerr << "Listening on " << socket.local_address().to_string() << endl;
 
-  uint64_t sequence_number = 0;
-
-  /* Loop and acknowledge every incoming datagram back to its source */
-  while ( true ) {
-    const UDPSocket::received_datagram recd = socket.recv();
-    ContestMessage message = recd.payload;
-
-    /* assemble the acknowledgment */
-    message.transform_into_ack( sequence_number++, recd.timestamp );
-
-    /* timestamp the ack just before sending */
-    message.set_send_timestamp();
+  if ( use_io_uring and not IOUring::available() ) {
+    cerr << "io_uring is not available; falling back to recvmmsg" << endl;
+    use_io_uring = false;
+  }
 
-    /* send the ack */
-    socket.sendto( recd.source_address, message.to_string() );
+  if ( use_io_uring ) {
+    ack_with_io_uring( socket );
+  } else {
+    /* take bursts from the sender as few large receives */
+    socket.set_gro();
+    ack_with_recvmmsg( socket, policy );
   }
 
   return EXIT_SUCCESS;
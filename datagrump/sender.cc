@@ -1,37 +1,75 @@
 /* UDP sender for congestion-control contest */
 
+#include <algorithm>
+#include <array>
 #include <cstdlib>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <vector>
 
 #include "socket.hh"
 #include "contest_message.hh"
 #include "controller.hh"
+#include "event_trace.hh"
+#include "in_flight.hh"
+#include "pacer.hh"
 #include "poller.hh"
+#include "resolver.hh"
+#include "timestamp.hh"
 
 using namespace std;
 using namespace PollerShortNames;
 
+/* how the sender spreads out what the window allows */
+enum class Pacing { Off, User, Kernel };
+
 /* simple sender class to handle the accounting */
 class DatagrumpSender
 {
 private:
+  string host_, port_;
+  bool connected_; /* once the receiver's address has been looked up */
+
   UDPSocket socket_;
-  Controller controller_; /* your class */
+  unique_ptr<Controller> controller_; /* see controllers.hh */
+
+  /* every datagram not yet acknowledged or lost (the next one sent gets
+     its next_sequence_number()); the socket numbers datagrams in the
+     order sent too, so its transmit timestamps apply directly */
+  InFlightTable in_flight_;
+  vector<UDPSocket::transmit_timestamp> transmit_timestamps_;
 
-  uint64_t sequence_number_; /* next outgoing sequence number */
+  /* at the controller's pacing rate, either here (with timers) or by
+     the kernel (SO_MAX_PACING_RATE, in bytes per second) */
+  Pacing pacing_;
+  Pacer pacer_;
+  uint64_t kernel_pacing_rate_;
 
-  /* if network does not reorder or lose datagrams,
-     this is the sequence number that the sender
-     next expects will be acknowledged by the receiver */
-  uint64_t next_ack_expected_;
+  /* datagrams made (and counted as sent) that the socket's send buffer
+     hasn't taken yet; they go out first, in order, once it has room */
+  typedef array<char, ContestMessage::Header::WIRE_SIZE> WireHeader;
+  deque<WireHeader> unsent_;
+  vector<iovec> unsent_iovecs_;
 
-  void send_datagram( void );
-  void got_ack( const uint64_t timestamp, const ContestMessage & msg );
+  void make_datagram( char * header );
+  void queue_datagram( void );
+  void send_unsent( void );
+  void got_transmit_timestamps( void );
+  void got_ack( const uint64_t timestamp, const ContestMessageView & msg );
+  void acknowledged( const uint64_t sequence_number, uint64_t send_timestamp,
+		     const uint64_t recv_timestamp, const uint64_t ack_send_timestamp,
+		     const uint64_t timestamp );
+  uint64_t detect_losses( const uint64_t now );
+  void all_lost( const uint64_t now );
+  void update_pacing_rate( void );
   bool window_is_open( void );
 
 public:
   DatagrumpSender( const char * const host, const char * const port,
-		   const bool debug );
+		   const string & algorithm, const Controller::Options & options,
+		   const Pacing pacing );
   int loop( void );
 };
 
@@ -42,76 +80,274 @@ int main( int argc, char *argv[] )
     abort();
   }
 
-  bool debug = false;
-  if ( argc == 4 and string( argv[ 3 ] ) == "debug" ) {
-    debug = true;
-  } else if ( argc == 3 ) {
-    /* do nothing */
-  } else {
-    cerr << "Usage: " << argv[ 0 ] << " HOST PORT [debug]" << endl;
+  /* after HOST and PORT: cc=ALGORITHM, pacing=off|user|kernel,
+     trace=FILE (to record every event; see tracedump), and the
+     algorithm's options (as name=value), in any order */
+  string algorithm = Controller::DEFAULT_ALGORITHM;
+  string trace_filename;
+  Pacing pacing = Pacing::User;
+  Controller::Options options;
+  bool usage_error = argc < 3;
+
+  for ( int i = 3; i < argc and not usage_error; i++ ) {
+    const string arg( argv[ i ] );
+    const size_t equals = arg.find( '=' );
+
+    if ( equals == string::npos or equals == 0 ) {
+      usage_error = true;
+    } else if ( arg.substr( 0, equals ) == "cc" ) {
+      algorithm = arg.substr( equals + 1 );
+    } else if ( arg.substr( 0, equals ) == "trace" ) {
+      trace_filename = arg.substr( equals + 1 );
+    } else if ( arg == "pacing=off" ) {
+      pacing = Pacing::Off;
+    } else if ( arg == "pacing=user" ) {
+      pacing = Pacing::User;
+    } else if ( arg == "pacing=kernel" ) {
+      pacing = Pacing::Kernel;
+    } else if ( arg.substr( 0, equals ) == "pacing" ) {
+      usage_error = true;
+    } else {
+      options[ arg.substr( 0, equals ) ] = arg.substr( equals + 1 );
+    }
+  }
+
+  const vector<string> algorithms = Controller::algorithms();
+  if ( find( algorithms.begin(), algorithms.end(), algorithm ) == algorithms.end() ) {
+    usage_error = true;
+  }
+
+  if ( usage_error ) {
+    cerr << "Usage: " << argv[ 0 ] << " HOST PORT [cc=ALGORITHM] [pacing=off|user|kernel]"
+	 << " [trace=FILE] [OPTION=VALUE]..." << endl;
+    cerr << "Algorithms (default " << Controller::DEFAULT_ALGORITHM << "):";
+    for ( const auto & name : algorithms ) {
+      cerr << " " << name;
+    }
+    cerr << endl;
     return EXIT_FAILURE;
   }
 
+  unique_ptr<EventTrace> trace;
+  if ( not trace_filename.empty() ) {
+    trace.reset( new EventTrace( trace_filename ) );
+  }
+
   /* create sender object to handle the accounting */
   /* all the interesting work is done by the Controller */
-  DatagrumpSender sender( argv[ 1 ], argv[ 2 ], debug );
+  DatagrumpSender sender( argv[ 1 ], argv[ 2 ], algorithm, options, pacing );
   return sender.loop();
 }
 
 DatagrumpSender::DatagrumpSender( const char * const host,
 				  const char * const port,
-				  const bool debug )
-  : socket_(),
-    controller_( debug ),
-    sequence_number_( 0 ),
-    next_ack_expected_( 0 )
+				  const string & algorithm,
+				  const Controller::Options & options,
+				  const Pacing pacing )
+  : host_( host ),
+    port_( port ),
+    connected_( false ),
+    socket_(),
+    controller_( Controller::make( algorithm, options ) ),
+    in_flight_(),
+    transmit_timestamps_(),
+    pacing_( pacing ),
+    pacer_(),
+    kernel_pacing_rate_( 0 ),
+    unsent_(),
+    unsent_iovecs_()
 {
   /* turn on timestamps when socket receives a datagram */
   socket_.set_timestamps();
 
-  /* connect socket to the remote host */
-  /* (note: this doesn't send anything; it just tags the socket
-     locally with the remote address */
-  socket_.connect( Address( host, port ) );  
+  /* learn when each datagram actually leaves (not just when it was made) */
+  socket_.set_transmit_timestamps();
+
+  /* take bursts of acks as few large receives */
+  socket_.set_gro();
+
+  /* never block in a syscall; the poller does the waiting */
+  socket_.set_blocking( false );
 
-  cerr << "Sending to " << socket_.peer_address().to_string() << endl;
+  /* see whether the kernel will pace (starting unlimited) */
+  if ( pacing_ == Pacing::Kernel ) {
+    try {
+      socket_.set_max_pacing_rate( uint64_t( -1 ) );
+    } catch ( const unix_error & e ) {
+      cerr << "Kernel pacing is not available (" << e.what() << "); pacing here instead" << endl;
+      pacing_ = Pacing::User;
+    }
+  }
 }
 
 void DatagrumpSender::got_ack( const uint64_t timestamp,
-			       const ContestMessage & ack )
+			       const ContestMessageView & ack )
 {
   if ( not ack.is_ack() ) {
     throw runtime_error( "sender got something other than an ack from the receiver" );
   }
 
-  /* Update sender's counter */
-  next_ack_expected_ = max( next_ack_expected_,
-			    ack.header.ack_sequence_number + 1 );
+  if ( ack.payload_length() == 0 ) {
+    acknowledged( ack.ack_sequence_number(), ack.ack_send_timestamp(),
+		  ack.ack_recv_timestamp(), ack.send_timestamp(), timestamp );
+    return;
+  }
+
+  /* a coalesced ack: first the older datagrams it acknowledges (whose
+     send times only the in-flight table knows), then the newest */
+  const SelectiveAckView sack( ack.payload(), ack.payload_length() );
+  uint64_t newest = ack.ack_sequence_number();
+  for ( uint32_t i = 0; i < sack.sample_count(); i++ ) {
+    const SelectiveAckView::Sample sample = sack.sample( i );
+    acknowledged( sample.sequence_number, -1,
+		  sample.recv_timestamp, ack.send_timestamp(), timestamp );
+    newest = max( newest, sample.sequence_number );
+  }
+
+  acknowledged( ack.ack_sequence_number(), ack.ack_send_timestamp(),
+		ack.ack_recv_timestamp(), ack.send_timestamp(), timestamp );
+
+  /* anything else received must have been in an ack that was lost; but
+     believe the ranges only up to the newest datagram this ack is for
+     (any higher one received was reported in an earlier ack), so a
+     receiver with stale state, e.g. from an earlier session, can't claim
+     datagrams it never saw */
+  const uint64_t seen = newest + 1;
+  in_flight_.acked_range( 0, min( sack.cumulative_ack(), seen ) );
+  for ( uint32_t i = 0; i < sack.range_count(); i++ ) {
+    const SelectiveAckView::Range range = sack.range( i );
+    in_flight_.acked_range( range.first, min( range.end, seen ) );
+  }
+}
+
+/* one datagram was acknowledged (send_timestamp is from the ack, or -1
+   if only the in-flight table knows it) */
+void DatagrumpSender::acknowledged( const uint64_t sequence_number,
+				    uint64_t send_timestamp,
+				    const uint64_t recv_timestamp,
+				    const uint64_t ack_send_timestamp,
+				    const uint64_t timestamp )
+{
+  /* prefer the recorded send time (the kernel's departure time, once
+     known) to the one in the header, so time spent queued in the sending
+     host doesn't count as network delay */
+  const InFlightTable::State previous = in_flight_.acked( sequence_number, timestamp, send_timestamp );
+  if ( previous == InFlightTable::State::Acked ) {
+    return; /* a duplicate */
+  } else if ( previous == InFlightTable::State::Unknown and send_timestamp == uint64_t( -1 ) ) {
+    return; /* too old to say when it was sent */
+  }
 
   /* Inform congestion controller */
-  controller_.ack_received( ack.header.ack_sequence_number,
-			    ack.header.ack_send_timestamp,
-			    ack.header.ack_recv_timestamp,
+  controller_->ack_received( sequence_number,
+			    send_timestamp,
+			    recv_timestamp,
+			    ack_send_timestamp,
 			    timestamp );
 }
 
-void DatagrumpSender::send_datagram( void )
+/* record when datagrams left the host */
+void DatagrumpSender::got_transmit_timestamps( void )
 {
-  /* All messages use the same dummy payload */
-  static const string dummy_payload( 1424, 'x' );
+  socket_.recv_transmit_timestamps( transmit_timestamps_ );
+
+  for ( const auto & stamp : transmit_timestamps_ ) {
+    in_flight_.departed( stamp.first_datagram, stamp.datagram_count, stamp.timestamp );
+  }
+}
 
-  ContestMessage cm( sequence_number_++, dummy_payload );
+/* tell the controller about datagrams that are lost by now, and
+   return when the next one will be (0 if none yet) */
+uint64_t DatagrumpSender::detect_losses( const uint64_t now )
+{
+  return in_flight_.detect_losses( now, [&] ( const uint64_t sequence_number,
+					      const uint64_t send_timestamp ) {
+				     controller_->datagram_was_lost( sequence_number, send_timestamp, now );
+				   } );
+}
+
+/* the retransmission timer expired, so give up on everything in flight */
+void DatagrumpSender::all_lost( const uint64_t now )
+{
+  in_flight_.all_lost( [&] ( const uint64_t sequence_number,
+			     const uint64_t send_timestamp ) {
+			 controller_->datagram_was_lost( sequence_number, send_timestamp, now );
+		       } );
+}
+
+/* All messages use the same dummy payload */
+static const string dummy_payload( 1424, 'x' );
+
+/* the header and payload of an outgoing datagram, sent without copying them together */
+static void datagram_iovecs( char * header, iovec * iov )
+{
+  iov[ 0 ].iov_base = header;
+  iov[ 0 ].iov_len = ContestMessage::Header::WIRE_SIZE;
+  iov[ 1 ].iov_base = const_cast<char *>( dummy_payload.data() );
+  iov[ 1 ].iov_len = dummy_payload.size();
+}
+
+/* write the header of the next datagram (which carries dummy_payload) */
+void DatagrumpSender::make_datagram( char * header )
+{
+  ContestMessageView cm = ContestMessageView::make( header, in_flight_.next_sequence_number() );
   cm.set_send_timestamp();
-  socket_.send( cm.to_string() );
+
+  in_flight_.sent( cm.sequence_number(), cm.send_timestamp(),
+		   ContestMessage::Header::WIRE_SIZE + dummy_payload.size() );
 
   /* Inform congestion controller */
-  controller_.datagram_was_sent( cm.header.sequence_number,
-				 cm.header.send_timestamp );
+  controller_->datagram_was_sent( cm.sequence_number(),
+				 cm.send_timestamp() );
+}
+
+/* make the next datagram, to be sent after any still unsent */
+void DatagrumpSender::queue_datagram( void )
+{
+  unsent_.emplace_back();
+  make_datagram( unsent_.back().data() );
+}
+
+/* hand the socket as many unsent datagrams as its send buffer will take,
+   in one syscall (with the kernel splitting them into datagrams) */
+void DatagrumpSender::send_unsent( void )
+{
+  unsent_iovecs_.resize( 2 * unsent_.size() );
+  for ( size_t i = 0; i < unsent_.size(); i++ ) {
+    datagram_iovecs( unsent_[ i ].data(), &unsent_iovecs_[ 2 * i ] );
+  }
+
+  const IOResult<size_t> sent = socket_.try_send_segmented( unsent_iovecs_, 2 );
+  if ( sent ) {
+    unsent_.erase( unsent_.begin(), unsent_.begin() + sent.value() );
+  }
+}
+
+/* follow the controller's pacing rate */
+void DatagrumpSender::update_pacing_rate( void )
+{
+  const double rate = pacing_ == Pacing::Off ? 0 : controller_->pacing_rate();
+
+  if ( pacing_ != Pacing::Kernel ) {
+    pacer_.set_rate( rate );
+    return;
+  }
+
+  /* (only when it changes by more than an eighth, to save syscalls) */
+  const uint64_t bytes_per_second = rate > 0
+    ? uint64_t( rate * ( ContestMessage::Header::WIRE_SIZE + dummy_payload.size() ) )
+    : uint64_t( -1 );
+  const uint64_t change = max( bytes_per_second, kernel_pacing_rate_ )
+    - min( bytes_per_second, kernel_pacing_rate_ );
+  if ( change > kernel_pacing_rate_ / 8 ) {
+    socket_.set_max_pacing_rate( bytes_per_second );
+    kernel_pacing_rate_ = bytes_per_second;
+  }
 }
 
 bool DatagrumpSender::window_is_open( void )
 {
-  return sequence_number_ - next_ack_expected_ < controller_.window_size();
+  return in_flight_.in_flight() < controller_->window_size();
 }
 
 int DatagrumpSender::loop( void )
@@ -119,36 +355,135 @@ int DatagrumpSender::loop( void )
   /* read and write from the receiver using an event-driven "poller" */
   Poller poller;
 
+  Poller::TimerID retransmit_timer = 0;
+  Poller::TimerID loss_timer = 0;
+
+  /* look for lost datagrams, and look again when the next may be */
+  function<void( void )> look_for_losses = [&] () {
+    const uint64_t now = timestamp_us();
+    const uint64_t next_loss = detect_losses( now );
+    if ( next_loss == 0 ) {
+      return;
+    }
+
+    const uint64_t delay = next_loss > now ? next_loss - now : 0;
+    if ( poller.timer_valid( loss_timer ) ) {
+      poller.reschedule_timer( loss_timer, delay );
+    } else {
+      loss_timer = poller.add_timer( delay, [&] () {
+	  look_for_losses();
+	  return ResultType::Continue;
+	} );
+    }
+  };
+
+  /* look up the receiver without blocking, and start once it's found */
+  Resolver resolver( poller );
+  resolver.resolve( host_, port_, [&] ( const vector<Address> & addresses ) {
+      if ( addresses.empty() ) {
+	throw runtime_error( "could not resolve " + host_ + ":" + port_ );
+      }
+
+      /* connect socket to the remote host */
+      /* (note: this doesn't send anything; it just tags the socket
+	 locally with the remote address */
+      socket_.connect( addresses.front() );
+      connected_ = true;
+
+      cerr << "Sending to " << socket_.peer_address().to_string() << endl;
+
+      /* second rule: if no ack arrives for a while, give up on everything
+	 in flight and send one datagram to try to get things moving again
+	 (and wait twice as long for the next) */
+      retransmit_timer = poller.add_timer( controller_->timeout_ms() * 1000, [&] () {
+	  all_lost( timestamp_us() );
+	  controller_->timeout_expired();
+	  queue_datagram();
+	  send_unsent();
+	  poller.reschedule_timer( retransmit_timer, controller_->timeout_ms() * 1000 );
+	  return ResultType::Continue;
+	} );
+    } );
+
+  /* when pacing holds back the next datagram, wake up once it may go */
+  Poller::TimerID pacing_timer = 0;
+  auto wake_for_pacing = [&] ( const uint64_t now ) {
+    const uint64_t delay = pacer_.next_send_time() > now ? pacer_.next_send_time() - now : 0;
+    if ( poller.timer_valid( pacing_timer ) ) {
+      poller.reschedule_timer( pacing_timer, delay );
+    } else {
+      /* (the send_more rule does the sending once it's time) */
+      pacing_timer = poller.add_timer( delay, [] () { return ResultType::Continue; } );
+    }
+  };
+
   /* first rule: if the window is open, close it by
-     sending more datagrams */
-  poller.add_action( Action( socket_, Direction::Out, [&] () {
-	/* Close the window */
-	while ( window_is_open() ) {
-	  send_datagram();
+     sending more datagrams (as fast as pacing allows) */
+  Action send_more( socket_, Direction::Out, [&] () {
+	/* Close the window, sending the whole burst in one syscall
+	   (after any the send buffer had no room for before) */
+	const uint64_t now = timestamp_us();
+	update_pacing_rate();
+
+	while ( window_is_open() and pacer_.can_send( now ) ) {
+	  queue_datagram();
+	  pacer_.sent( now );
 	}
+
+	/* (even if the window is closed now: acks may open it before then,
+	   and nothing else would wake us to send) */
+	if ( not pacer_.can_send( now ) ) {
+	  wake_for_pacing( now );
+	}
+
+	send_unsent();
 	return ResultType::Continue;
       },
-      /* We're only interested in this rule when the window is open */
-      [&] () { return window_is_open(); } ) );
+      /* We're only interested in this rule when the window is open
+	 (and pacing allows), or the socket has yet to take datagrams */
+      [&] () {
+	return connected_ and ( not unsent_.empty()
+				or ( window_is_open() and pacer_.can_send( timestamp_us() ) ) );
+      } );
 
-  /* second rule: if sender receives an ack,
+  /* third rule: if sender receives an ack,
      process it and inform the controller
      (by using the sender's got_ack method) */
-  poller.add_action( Action( socket_, Direction::In, [&] () {
-	const UDPSocket::received_datagram recd = socket_.recv();
-	const ContestMessage ack  = recd.payload;
-	got_ack( recd.timestamp, ack );
+  BufferPool pool( 65536, 64 );
+  vector<UDPSocket::received_datagram_view> acks;
+  Action hear_acks( socket_, Direction::In, [&] () {
+	/* drain every pending ack before sending more */
+	while ( socket_.try_recv_batch( pool, acks, 64 ) ) {
+	  for ( auto & recd : acks ) {
+	    for ( size_t i = 0; i < recd.segment_count(); i++ ) {
+	      const iovec segment = recd.segment_iovec( i );
+	      got_ack( recd.timestamp,
+		       ContestMessageView( static_cast<char *>( segment.iov_base ), segment.iov_len ) );
+	    }
+	  }
+	}
+	look_for_losses();
+	poller.reschedule_timer( retransmit_timer, controller_->timeout_ms() * 1000 );
 	return ResultType::Continue;
-      } ) );
+      },
+      /* nothing to hear until we know whom we're talking to */
+      [&] () { return connected_; } );
+
+  /* fourth rule: the kernel reports when datagrams left the host
+     as an error on the socket, so record the departure times */
+  send_more.error_callback = hear_acks.error_callback = [&] () {
+    got_transmit_timestamps();
+    return ResultType::Continue;
+  };
+
+  poller.add_action( send_more );
+  poller.add_action( hear_acks );
 
-  /* Run these two rules forever */
+  /* Run these rules forever */
   while ( true ) {
-    const auto ret = poller.poll( controller_.timeout_ms() );
+    const auto ret = poller.poll( -1 );
     if ( ret.result == PollResult::Exit ) {
       return ret.exit_status;
-    } else if ( ret.result == PollResult::Timeout ) {
-      /* After a timeout, send one datagram to try to get things moving again */
-      send_datagram();
     }
   }
 }
@@ -0,0 +1,113 @@
+/* prints an event trace (from trace=FILE; see event_trace.hh) as text,
+   one event per line: the time in microseconds, the thread, the type of
+   event and what it says, e.g.
+
+     1000250 t0 sent seq=17
+     1021730 t0 acked seq=17 rtt=21480
+
+   followed (on stderr) by how many events there were of each type */
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+#include "event_trace.hh"
+#include "mapped_file.hh"
+
+using namespace std;
+
+/* one record's line */
+static void print_record( ostream & out, const TraceRecord & record )
+{
+  typedef TraceRecord::Type Type;
+
+  out << record.timestamp << " t" << record.thread << " " << TraceRecord::type_name( record.type );
+
+  switch ( record.type ) {
+  case Type::Sent:
+    out << " seq=" << record.sequence_number;
+    break;
+  case Type::Acked:
+    out << " seq=" << record.sequence_number << " rtt=" << int64_t( record.timestamp - record.value );
+    break;
+  case Type::Lost:
+    out << " seq=" << record.sequence_number << " sent=" << record.value;
+    break;
+  case Type::Window:
+    out << " window=" << record.value;
+    break;
+  case Type::Timeout:
+    out << " rto_ms=" << record.value;
+    break;
+  case Type::Received:
+    /* (between clocks on different hosts, this includes their offset) */
+    out << " seq=" << record.sequence_number << " delay=" << int64_t( record.timestamp - record.value );
+    break;
+  case Type::AckSent:
+    out << " ack=" << record.sequence_number << " newest=" << record.value
+	<< " datagrams=" << record.extra;
+    break;
+  case Type::Dropped:
+    out << " records=" << record.value;
+    break;
+  case Type::None:
+    break;
+  }
+
+  out << "\n";
+}
+
+int main( int argc, char *argv[] )
+{
+   /* check the command-line arguments */
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  if ( argc != 2 ) {
+    cerr << "Usage: " << argv[ 0 ] << " TRACEFILE" << endl;
+    return EXIT_FAILURE;
+  }
+
+  const MappedFile trace( argv[ 1 ] );
+
+  EventTrace::FileHeader header;
+  if ( trace.size() < sizeof( header ) ) {
+    cerr << argv[ 1 ] << ": too short to be an event trace" << endl;
+    return EXIT_FAILURE;
+  }
+
+  memcpy( &header, trace.data(), sizeof( header ) );
+  if ( memcmp( header.magic, EventTrace::MAGIC, sizeof( header.magic ) ) != 0
+       or header.version != EventTrace::VERSION
+       or header.record_size != sizeof( TraceRecord ) ) {
+    cerr << argv[ 1 ] << ": not an event trace (or from another version)" << endl;
+    return EXIT_FAILURE;
+  }
+
+  ios::sync_with_stdio( false );
+
+  map<TraceRecord::Type, uint64_t> counts;
+  for ( const char * p = trace.data() + sizeof( header );
+	p + sizeof( TraceRecord ) <= trace.end();
+	p += sizeof( TraceRecord ) ) {
+    TraceRecord record;
+    memcpy( &record, p, sizeof( record ) );
+
+    /* (a trace cut short by the process dying ends in unused records) */
+    if ( record.type == TraceRecord::Type::None ) {
+      break;
+    }
+
+    print_record( cout, record );
+    counts[ record.type ]++;
+  }
+
+  cout.flush();
+  for ( const auto & count : counts ) {
+    cerr << TraceRecord::type_name( count.first ) << ": " << count.second << endl;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,198 @@
+/* searches a congestion controller's options for the best configuration,
+   running each one over an emulated link (see link_emulator.hh and
+   parameter_search.hh) on every core, e.g.
+
+     tune UPLINK DOWNLINK cc=fixed window=1:60:1
+     tune UPLINK DOWNLINK cc=aimd search=bayes trials=100 window=1:100:1 ssthresh=10:1000
+
+   Each configuration is scored by its power: throughput over the 95th
+   percentile signal delay (plus the propagation delay). The table of
+   results goes to stdout, best first, and plot=FILE writes them in
+   trial order as columns (for gnuplot). */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+
+#include "controller.hh"
+#include "link_emulator.hh"
+#include "parameter_search.hh"
+#include "reactor.hh"
+#include "timestamp.hh"
+
+using namespace std;
+
+/* an option's value as the controller will parse it */
+static string format_value( const double value )
+{
+  ostringstream text;
+  text << setprecision( 6 ) << value;
+  return text.str();
+}
+
+/* throughput (Mbits/s) over the 95th percentile signal delay (s) */
+static double power( const LinkLogAnalyzer::Summary & uplink, const LinkEmulator::Settings & settings )
+{
+  return uplink.throughput_mbps * 1000 / ( uplink.signal_delay_p95_ms + settings.delay_ms );
+}
+
+/* the table: one column for each parameter, then the results */
+static void write_table( ostream & out, const vector<SearchParameter> & parameters,
+			 const vector<Trial> & trials, const vector<size_t> & order,
+			 const LinkEmulator::Settings & settings, const bool for_plotting )
+{
+  const int width = 12;
+
+  out << ( for_plotting ? "#" : "" );
+  for ( const auto & parameter : parameters ) {
+    out << setw( max<int>( width, parameter.name().size() + 1 ) ) << parameter.name();
+  }
+  out << setw( width ) << "Mbits/s" << setw( width ) << "utilization"
+      << setw( width ) << "delay_p95" << setw( width ) << "signal_p95" << setw( width ) << "power" << "\n";
+
+  for ( const size_t i : order ) {
+    const Trial & trial = trials[ i ];
+    out << ( for_plotting ? " " : "" );
+    for ( size_t j = 0; j < parameters.size(); j++ ) {
+      out << setw( max<int>( width, parameters[ j ].name().size() + 1 ) )
+	  << format_value( trial.values[ j ] );
+    }
+    const LinkLogAnalyzer::Summary & uplink = trial.results.uplink;
+    out << fixed << setprecision( 3 )
+	<< setw( width ) << uplink.throughput_mbps
+	<< setw( width ) << uplink.utilization()
+	<< setprecision( 0 )
+	<< setw( width ) << uplink.delay_p95_ms
+	<< setw( width ) << uplink.signal_delay_p95_ms
+	<< setprecision( 3 )
+	<< setw( width ) << power( uplink, settings ) << "\n";
+    out.unsetf( ios::floatfield );
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+   /* check the command-line arguments */
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  /* after the traces: cc=ALGORITHM, how to search, the path's settings
+     (as for the emulator), and the algorithm's options, each either a
+     value or a range or list of values to search over */
+  string algorithm = Controller::DEFAULT_ALGORITHM;
+  bool bayesian = false;
+  unsigned int trial_count = 50, threads = ReactorPool::cpu_count();
+  uint64_t seed = 1;
+  string plot_filename;
+  LinkEmulator::Settings settings;
+  Controller::Options options;
+  vector<SearchParameter> parameters;
+  bool usage_error = argc < 3;
+
+  for ( int i = 3; i < argc and not usage_error; i++ ) {
+    const string arg( argv[ i ] );
+    const size_t equals = arg.find( '=' );
+    const string name = arg.substr( 0, equals );
+    const string value = equals == string::npos ? "" : arg.substr( equals + 1 );
+
+    if ( equals == string::npos or equals == 0 or value.empty() ) {
+      usage_error = true;
+    } else if ( name == "cc" ) {
+      algorithm = value;
+    } else if ( name == "search" ) {
+      usage_error = value != "grid" and value != "bayes";
+      bayesian = value == "bayes";
+    } else if ( name == "trials" ) {
+      trial_count = stoul( value );
+    } else if ( name == "threads" ) {
+      threads = stoul( value );
+    } else if ( name == "seed" ) {
+      seed = stoull( value );
+    } else if ( name == "plot" ) {
+      plot_filename = value;
+    } else if ( LinkEmulator::Settings::is_setting( name ) ) {
+      usage_error = not settings.set( name, value );
+    } else if ( SearchParameter::is_specification( value ) ) {
+      parameters.emplace_back( name, value );
+    } else {
+      options[ name ] = value;
+    }
+  }
+
+  const vector<string> algorithms = Controller::algorithms();
+  if ( find( algorithms.begin(), algorithms.end(), algorithm ) == algorithms.end()
+       or parameters.empty() or threads == 0 ) {
+    usage_error = true;
+  }
+
+  if ( usage_error ) {
+    cerr << "Usage: " << argv[ 0 ] << " UPLINK_TRACE DOWNLINK_TRACE [cc=ALGORITHM]"
+	 << " [search=grid|bayes] [trials=N] [threads=N] [seed=N] [plot=FILE]"
+	 << " [delay=MS] [queue_packets=N] [queue_bytes=N] [duration=MS] [pacing=off|user]"
+	 << " OPTION=LOW:HIGH[:STEP]|OPTION=A,B,...  [OPTION=VALUE]..." << endl;
+    cerr << "Algorithms (default " << Controller::DEFAULT_ALGORITHM << "):";
+    for ( const auto & name : algorithms ) {
+      cerr << " " << name;
+    }
+    cerr << endl;
+    return EXIT_FAILURE;
+  }
+
+  const LinkTrace uplink( argv[ 1 ] ), downlink( argv[ 2 ] );
+
+  /* run one configuration */
+  atomic<unsigned int> finished( 0 );
+  mutex progress_mutex;
+  auto evaluate = [&] ( Trial & trial ) {
+    Controller::Options trial_options = options;
+    for ( size_t i = 0; i < parameters.size(); i++ ) {
+      trial_options[ parameters[ i ].name() ] = format_value( trial.values[ i ] );
+    }
+
+    unique_ptr<Controller> controller = Controller::make( algorithm, trial_options );
+    LinkEmulator emulator( uplink, downlink, *controller, settings );
+    trial.results = emulator.run();
+    trial.score = log( max( 1e-9, power( trial.results.uplink, settings ) ) );
+
+    lock_guard<mutex> lock( progress_mutex );
+    cerr << "[" << ++finished << "]";
+    for ( size_t i = 0; i < parameters.size(); i++ ) {
+      cerr << " " << parameters[ i ].name() << "=" << format_value( trial.values[ i ] );
+    }
+    cerr << fixed << setprecision( 2 ) << ": " << trial.results.uplink.throughput_mbps << " Mbits/s, "
+	 << setprecision( 0 ) << trial.results.uplink.signal_delay_p95_ms << " ms signal delay" << endl;
+    cerr.unsetf( ios::floatfield );
+  };
+
+  const uint64_t start = timestamp_us();
+
+  const ParameterSearch search( parameters, evaluate, threads );
+  const vector<Trial> trials = bayesian ? search.bayesian( trial_count, seed ) : search.grid();
+
+  cerr << "Ran " << trials.size() << " configurations in "
+       << ( timestamp_us() - start ) / 1e6 << " s on " << threads << " threads" << endl;
+
+  vector<size_t> order( trials.size() );
+  iota( order.begin(), order.end(), 0 );
+
+  if ( not plot_filename.empty() ) {
+    ofstream plot;
+    plot.exceptions( ofstream::failbit | ofstream::badbit );
+    plot.open( plot_filename );
+    write_table( plot, parameters, trials, order, settings, true );
+  }
+
+  stable_sort( order.begin(), order.end(),
+	       [&] ( const size_t a, const size_t b ) { return trials[ a ].score > trials[ b ].score; } );
+  write_table( cout, parameters, trials, order, settings, false );
+
+  return EXIT_SUCCESS;
+}
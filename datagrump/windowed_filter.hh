@@ -0,0 +1,88 @@
+#ifndef WINDOWED_FILTER_HH
+#define WINDOWED_FILTER_HH
+
+#include <cstdint>
+#include <functional>
+
+/* Running minimum or maximum of a signal over a sliding window (of time,
+   or of any other increasing count, like round trips), kept in constant
+   space with Kathleen Nichols' algorithm: the best, second-best and
+   third-best samples from successive parts of the window. Compare is
+   std::less for a minimum (e.g. of RTT), std::greater for a maximum
+   (e.g. of delivery rate). */
+template <typename T, class Compare>
+class WindowedFilter
+{
+private:
+  struct Sample
+  {
+    uint64_t time;
+    T value;
+  };
+
+  uint64_t window_;
+  Sample best_[ 3 ];
+  bool empty_;
+
+  static bool better( const T & a, const T & b ) { return Compare()( a, b ); }
+
+public:
+  WindowedFilter( const uint64_t window )
+    : window_( window ), best_(), empty_( true )
+  {}
+
+  /* forget every sample except this one */
+  void reset( const uint64_t time, const T & value )
+  {
+    best_[ 0 ] = best_[ 1 ] = best_[ 2 ] = { time, value };
+    empty_ = false;
+  }
+
+  /* add a sample (times must not decrease), and return the new best */
+  const T & update( const uint64_t time, const T & value )
+  {
+    /* a new best, or nothing in the window: start over */
+    if ( empty_ or not better( best_[ 0 ].value, value )
+	 or time - best_[ 2 ].time > window_ ) {
+      reset( time, value );
+      return best_[ 0 ].value;
+    }
+
+    if ( not better( best_[ 1 ].value, value ) ) {
+      best_[ 1 ] = best_[ 2 ] = { time, value };
+    } else if ( not better( best_[ 2 ].value, value ) ) {
+      best_[ 2 ] = { time, value };
+    }
+
+    /* age out the best sample, promoting the others */
+    const uint64_t age = time - best_[ 0 ].time;
+    if ( age > window_ ) {
+      best_[ 0 ] = best_[ 1 ];
+      best_[ 1 ] = best_[ 2 ];
+      best_[ 2 ] = { time, value };
+      if ( time - best_[ 0 ].time > window_ ) {
+	best_[ 0 ] = best_[ 1 ];
+	best_[ 1 ] = best_[ 2 ];
+	best_[ 2 ] = { time, value };
+      }
+    } else if ( best_[ 1 ].time == best_[ 0 ].time and age > window_ / 4 ) {
+      /* a quarter of the window without a better sample: take a second choice */
+      best_[ 1 ] = best_[ 2 ] = { time, value };
+    } else if ( best_[ 2 ].time == best_[ 1 ].time and age > window_ / 2 ) {
+      /* half the window: take a third choice */
+      best_[ 2 ] = { time, value };
+    }
+
+    return best_[ 0 ].value;
+  }
+
+  /* best sample in the window (or T() if none yet) */
+  T best( void ) const { return empty_ ? T() : best_[ 0 ].value; }
+
+  bool empty( void ) const { return empty_; }
+
+  /* change the window (e.g. as the RTT changes) */
+  void set_window( const uint64_t window ) { window_ = window; }
+};
+
+#endif /* WINDOWED_FILTER_HH */
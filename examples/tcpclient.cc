@@ -4,6 +4,7 @@
 #include "socket.hh"
 #include "util.hh"
 #include "poller.hh"
+#include "resolver.hh"
 
 using namespace std;
 using namespace PollerShortNames;
@@ -22,44 +23,51 @@ int main( int argc, char *argv[] )
 
   string host { argv[ 1 ] }, port { argv[ 2 ] };
 
-  /* Look up the server's address */
-  cerr << "Looking up " << host << ":" << port << endl;
-  Address server( host, port );
-  cerr << "Done. Found " << server.to_string() << endl;
-
   /* create a TCP socket */
   TCPSocket socket;
+  FileDescriptor keyboard( 0 );
 
-  /* connect to the server */
-  cerr << "Connecting...";
-  socket.connect( server );
-  cerr << "done." << endl;
-
-  /* now read and write from the server using an event-driven "poller" */
+  /* read and write from the server using an event-driven "poller" */
   Poller poller;
 
-  /* first rule: if the socket has data ready (in the "In" direction),
-     print it to the screen (cout) */
-  poller.add_action( Action( socket, Direction::In,
-			     [&] () {
-			       cout << socket.read();
+  /* Look up the server's address (the poller calls back when it's found) */
+  cerr << "Looking up " << host << ":" << port << endl;
+  Resolver resolver( poller );
+  resolver.resolve( host, port, [&] ( const vector<Address> & addresses ) {
+      if ( addresses.empty() ) {
+	throw runtime_error( "could not resolve " + host + ":" + port );
+      }
 
-			       /* exit if the server closes the connection */
-			       if ( socket.eof() ) {
-				 return ResultType::Exit;
-			       } else {
-				 return ResultType::Continue;
-			       }
-			     } ) );
+      const Address & server = addresses.front();
+      cerr << "Done. Found " << server.to_string() << endl;
 
-  /* second rule: if the keyboard has data ready (also in the "In" direction),
-     write it to the server, plus a carriage return and newline */
-  FileDescriptor keyboard( 0 );
-  poller.add_action( Action( keyboard, Direction::In,
-			     [&] () {
-			       socket.write( keyboard.read() + "\r\n" );
-			       return ResultType::Continue;
-			     } ) );
+      /* connect to the server */
+      cerr << "Connecting...";
+      socket.connect( server );
+      cerr << "done." << endl;
+
+      /* first rule: if the socket has data ready (in the "In" direction),
+	 print it to the screen (cout) */
+      poller.add_action( Action( socket, Direction::In,
+				 [&] () {
+				   cout << socket.read();
+
+				   /* exit if the server closes the connection */
+				   if ( socket.eof() ) {
+				     return ResultType::Exit;
+				   } else {
+				     return ResultType::Continue;
+				   }
+				 } ) );
+
+      /* second rule: if the keyboard has data ready (also in the "In" direction),
+	 write it to the server, plus a carriage return and newline */
+      poller.add_action( Action( keyboard, Direction::In,
+				 [&] () {
+				   socket.write( keyboard.read() + "\r\n" );
+				   return ResultType::Continue;
+				 } ) );
+    } );
 
   /* run these two rules forever until it's time to quit */
   while ( true ) {
@@ -1,14 +1,167 @@
 /* simple TCP listener/server to demonstrate sourdough starter classes */
 /* Keith Winstein <keithw@cs.stanford.edu>, January 2015 */
 
-#include <thread>
+#include <csignal>
 #include <iostream>
+#include <map>
+#include <memory>
+
+#include <sys/resource.h>
 
 #include "socket.hh"
 #include "util.hh"
+#include "io_uring.hh"
+#include "tcp_server.hh"
 
 using namespace std;
 
+/* handle every client from a few event-driven worker threads */
+unsigned int serve_with_events( const Address & address )
+{
+  TCPServer::Handlers handlers;
+
+  handlers.on_connect = [] ( TCPServer::Connection & client ) {
+    cerr << "New connection from " << client.peer().to_string() << endl;
+  };
+
+  /* Print every chunk that the client sends */
+  handlers.on_data = [] ( TCPServer::Connection & client ) {
+    const string & chunk = client.input();
+    cerr << "Got " << chunk.size() << " bytes from "
+	 << client.peer().to_string() << ": " << chunk;
+    client.send( "Received " + to_string( chunk.size() ) + " bytes from you.\n" );
+    client.input().clear();
+  };
+
+  handlers.on_close = [] ( TCPServer::Connection & client ) {
+    cerr << client.peer().to_string() << " closed the connection." << endl;
+  };
+
+  TCPServer server( address, handlers );
+  return server.run();
+}
+
+/* handle every client from one thread, with all I/O going through io_uring */
+void serve_with_io_uring( TCPSocket & listening_socket )
+{
+  /* the first connections read into buffers registered with the kernel */
+  const unsigned int FIXED_BUFFERS = 256;
+  const size_t BUFFER_SIZE = 16384;
+
+  struct Connection {
+    TCPSocket socket;
+    string peer;
+    int fixed_index; /* -1 if not using a registered buffer */
+    BufferPool::Buffer buffer;
+    string reply;
+
+    Connection( TCPSocket && s_socket )
+      : socket( move( s_socket ) ), peer( socket.peer_address().to_string() ),
+	fixed_index( -1 ), buffer(), reply() {}
+  };
+
+  IOUring ring;
+  BufferPool pool( BUFFER_SIZE, FIXED_BUFFERS );
+
+  vector<BufferPool::Buffer> fixed_buffers;
+  vector<iovec> fixed_iovecs;
+  vector<int> free_fixed_indices;
+  for ( unsigned int i = 0; i < FIXED_BUFFERS; i++ ) {
+    fixed_buffers.push_back( pool.acquire() );
+    fixed_iovecs.push_back( { fixed_buffers.back().data(), fixed_buffers.back().capacity() } );
+    free_fixed_indices.push_back( FIXED_BUFFERS - 1 - i );
+  }
+  ring.register_buffers( fixed_iovecs );
+
+  /* a write to a client that has gone away fails with EPIPE (rather
+     than killing the server) */
+  signal( SIGPIPE, SIG_IGN );
+
+  /* how long to wait before accepting again, after accept fails */
+  const uint64_t ACCEPT_BACKOFF_NS = 100 * 1000 * 1000;
+
+  map<int, unique_ptr<Connection>> connections;
+
+  /* a client going away (even abruptly) only ends its own connection */
+  auto close_connection = [&] ( Connection & connection, const string & why ) {
+    cerr << connection.peer << " " << why << endl;
+    if ( connection.fixed_index >= 0 ) {
+      free_fixed_indices.push_back( connection.fixed_index );
+    }
+    connections.erase( connection.socket.fd_num() );
+  };
+
+  function<void(Connection &)> post_read = [&] ( Connection & connection ) {
+    auto completion = [&] ( const int result ) {
+      if ( result < 0 ) {
+	close_connection( connection, unix_error( "read", -result ).what() );
+	return;
+      }
+
+      if ( result == 0 ) {
+	close_connection( connection, "closed the connection." );
+	return;
+      }
+
+      const char * const data = connection.fixed_index >= 0
+	? fixed_buffers.at( connection.fixed_index ).data()
+	: connection.buffer.data();
+
+      cerr << "Got " << result << " bytes from " << connection.peer << ": " << string( data, result );
+      connection.reply = "Received " + to_string( result ) + " bytes from you.\n";
+
+      ring.write( connection.socket, connection.reply.data(), connection.reply.size(),
+		  [&] ( const int write_result ) {
+		    if ( write_result < 0 ) {
+		      close_connection( connection, unix_error( "write", -write_result ).what() );
+		      return;
+		    }
+		    post_read( connection );
+		  } );
+    };
+
+    if ( connection.fixed_index >= 0 ) {
+      ring.read_fixed( connection.socket, fixed_buffers.at( connection.fixed_index ).data(),
+		       BUFFER_SIZE, connection.fixed_index, completion );
+    } else {
+      ring.read( connection.socket, connection.buffer.data(), connection.buffer.capacity(),
+		 completion );
+    }
+  };
+
+  function<void(void)> post_accept = [&] () {
+    ring.accept( listening_socket, [&] ( const int result ) {
+	/* (e.g. out of file descriptors): wait a little, then try again */
+	if ( result < 0 ) {
+	  print_exception( unix_error( "accept", -result ) );
+	  ring.timeout( ACCEPT_BACKOFF_NS, [&] ( const int ) { post_accept(); } );
+	  return;
+	}
+
+	unique_ptr<Connection> connection( new Connection( TCPSocket( FileDescriptor( result ) ) ) );
+	cerr << "New connection from " << connection->peer << endl;
+
+	if ( free_fixed_indices.empty() ) {
+	  connection->buffer = pool.acquire();
+	} else {
+	  connection->fixed_index = free_fixed_indices.back();
+	  free_fixed_indices.pop_back();
+	}
+
+	post_read( *connection );
+	connections[ result ] = move( connection );
+
+	post_accept();
+      } );
+  };
+
+  post_accept();
+
+  while ( true ) {
+    ring.run();
+  }
+}
+
 int main( int argc, char *argv[] )
 {
   /* check the command-line arguments */
@@ -16,11 +169,30 @@ int main( int argc, char *argv[] )
     abort();
   }
 
-  if ( argc != 2 ) {
-    cerr << "Usage: " << argv[ 0 ] << " PORT" << endl;
+  bool use_io_uring = false;
+  if ( argc == 3 and string( argv[ 2 ] ) == "io_uring" ) {
+    use_io_uring = true;
+  } else if ( argc != 2 ) {
+    cerr << "Usage: " << argv[ 0 ] << " PORT [io_uring]" << endl;
     return EXIT_FAILURE;
   }
 
+  /* allow as many connections as the hard limit on open files does */
+  rlimit files;
+  SystemCall( "getrlimit", getrlimit( RLIMIT_NOFILE, &files ) );
+  files.rlim_cur = files.rlim_max;
+  SystemCall( "setrlimit", setrlimit( RLIMIT_NOFILE, &files ) );
+
+  if ( use_io_uring and not IOUring::available() ) {
+    cerr << "io_uring is not available; falling back to event-driven workers" << endl;
+    use_io_uring = false;
+  }
+
+  if ( not use_io_uring ) {
+    cerr << "Listening on port " << argv[ 1 ] << endl;
+    return serve_with_events( Address( "::0", argv[ 1 ] ) );
+  }
+
   /* create a TCP socket */
   TCPSocket listening_socket;
 
@@ -35,35 +207,7 @@ int main( int argc, char *argv[] )
   listening_socket.listen();
   cerr << "Listening on local address: " << listening_socket.local_address().to_string() << endl;
 
-  /* Wait for clients to connect */
-  while ( true ) {
-
-    /* This line does a lot. It waits for a client to connect
-       ("listening_socket.accept()"). When that returns a new socket,
-       it starts a thread to handle that client and passes in the
-       result of accept() as the "client" parameter to the handler. */
-
-    thread client_handler( [] ( TCPSocket client ) {
-	cerr << "New connection from " << client.peer_address().to_string() << endl;
-
-	/* Print every line that the client sends */
-	while ( true ) {
-	  const string chunk = client.read();
-	  if ( client.eof() ) { break; }
-	  cerr << "Got " << chunk.size() << " bytes from "
-	       << client.peer_address().to_string() << ": " << chunk;
-	  client.write( "Received " + to_string( chunk.size() ) + " bytes from you.\n" );
-	}
-
-	cerr << client.peer_address().to_string() << " closed the connection." << endl; 
-      }, listening_socket.accept() );
-
-    /* Let the client handler continue to run without having
-       to keep track of it. The main thread can go back to accepting
-       new incoming connections. */
-
-    client_handler.detach();
-  }
+  serve_with_io_uring( listening_socket );
 
   return EXIT_SUCCESS;
 }
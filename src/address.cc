@@ -3,6 +3,7 @@
 #include <memory>
 
 #include <netdb.h>
+#include <arpa/inet.h>
 
 #include "address.hh"
 #include "util.hh"
@@ -12,24 +13,30 @@ using namespace std;
 /* constructors */
 
 Address::Address()
-  : size_( 0 ),
-    addr_()
-{}
+  : addr_()
+{
+  addr_.as_sockaddr.sa_family = AF_UNSPEC;
+}
 
 Address::Address( const raw & addr, const size_t size )
   : Address( addr.as_sockaddr, size )
 {}
 
 Address::Address( const sockaddr & addr, const size_t size )
-  : size_( size ),
-    addr_()
+  : Address()
 {
-  /* make sure proposed sockaddr can fit */
-  if ( size > sizeof( addr_ ) ) {
-    throw runtime_error( "invalid sockaddr size" );
+  if ( size == 0 ) {
+    return;
   }
 
-  memcpy( &addr_, &addr, size );
+  /* make sure proposed sockaddr is one we hold, and complete */
+  if ( addr.sa_family == AF_INET and size >= sizeof( sockaddr_in ) ) {
+    memcpy( &addr_.as_sockaddr_in, &addr, sizeof( sockaddr_in ) );
+  } else if ( addr.sa_family == AF_INET6 and size >= sizeof( sockaddr_in6 ) ) {
+    memcpy( &addr_.as_sockaddr_in6, &addr, sizeof( sockaddr_in6 ) );
+  } else {
+    throw runtime_error( "invalid sockaddr family or size" );
+  }
 }
 
 /* error category for getaddrinfo and getnameinfo */
@@ -45,8 +52,7 @@ public:
 
 /* private constructor given ip/host, service/port, and optional hints */
 Address::Address( const string & node, const string & service, const addrinfo * hints )
-  : size_(),
-    addr_()
+  : addr_()
 {
   /* prepare for the answer */
   addrinfo *resolved_address;
@@ -86,7 +92,23 @@ Address::Address( const std::string & hostname, const std::string & service )
 Address::Address( const std::string & ip, const uint16_t port )
   : Address()
 {
-  /* tell getaddrinfo that we don't want to resolve anything */
+  /* like the sockets, hold IPv4 addresses as v4-mapped IPv6 addresses */
+  sockaddr_in6 & addr = addr_.as_sockaddr_in6;
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons( port );
+
+  if ( inet_pton( AF_INET6, ip.c_str(), &addr.sin6_addr ) == 1 ) {
+    return;
+  }
+
+  in_addr ipv4;
+  if ( inet_pton( AF_INET, ip.c_str(), &ipv4 ) == 1 ) {
+    addr.sin6_addr.s6_addr[ 10 ] = addr.sin6_addr.s6_addr[ 11 ] = 0xff;
+    memcpy( &addr.sin6_addr.s6_addr[ 12 ], &ipv4, sizeof( ipv4 ) );
+    return;
+  }
+
+  /* anything else (e.g. with a scope) goes through getaddrinfo */
   addrinfo hints;
   zero( hints );
   hints.ai_family = AF_INET6;
@@ -95,48 +117,225 @@ Address::Address( const std::string & ip, const uint16_t port )
   *this = Address( ip, ::to_string( port ), &hints );
 }
 
-/* accessors */
+socklen_t Address::size( void ) const
+{
+  switch ( addr_.as_sockaddr.sa_family ) {
+  case AF_INET: return sizeof( sockaddr_in );
+  case AF_INET6: return sizeof( sockaddr_in6 );
+  default: return 0;
+  }
+}
 
-pair<string, uint16_t> Address::ip_port( void ) const
+/* formatting (without getnameinfo) */
+
+/* write n in decimal, returning the end */
+static char * put_decimal( char * out, unsigned int n )
+{
+  char digits[ 10 ];
+  int count = 0;
+
+  do {
+    digits[ count++ ] = '0' + n % 10;
+    n /= 10;
+  } while ( n );
+
+  while ( count ) {
+    *out++ = digits[ --count ];
+  }
+
+  return out;
+}
+
+/* write a dotted-quad IPv4 address */
+static char * put_ipv4( char * out, const uint8_t * const bytes )
 {
-  char ip[ NI_MAXHOST ], port[ NI_MAXSERV ];
-
-  const int gni_ret = getnameinfo( &to_sockaddr(),
-                                   size_,
-                                   ip, sizeof( ip ),
-                                   port, sizeof( port ),
-                                   NI_NUMERICHOST | NI_NUMERICSERV );
-  if ( gni_ret ) {
-    throw tagged_error( gai_error_category(), "getnameinfo", gni_ret );
-  }
-
-  /* attempt to shorten v4-mapped address if possible */
-  string ip_string { ip };
-  if ( ip_string.size() > 7
-       and ip_string.substr( 0, 7 ) == "::ffff:" ) {
-    const string candidate_ipv4 = ip_string.substr( 7 );
-    Address candidate_addr( candidate_ipv4, stoi( port ) );
-    if ( candidate_addr == *this ) {
-      ip_string = candidate_ipv4;
+  for ( int i = 0; i < 4; i++ ) {
+    if ( i ) {
+      *out++ = '.';
     }
+    out = put_decimal( out, bytes[ i ] );
   }
 
-  return make_pair( ip_string, stoi( port ) );
+  return out;
 }
 
-string Address::to_string( void ) const
+/* write an IPv6 address in the canonical form of RFC 5952 */
+static char * put_ipv6( char * out, const uint8_t * const bytes )
 {
-  const auto ip_and_port = ip_port();
-  return ip_and_port.first + ":" + ::to_string( ip_and_port.second );
+  static const char hex_digits[] = "0123456789abcdef";
+
+  uint16_t groups[ 8 ];
+  for ( int i = 0; i < 8; i++ ) {
+    groups[ i ] = ( bytes[ 2 * i ] << 8 ) | bytes[ 2 * i + 1 ];
+  }
+
+  /* find the first longest run of two or more zero groups */
+  int best_start = -1, best_length = 1;
+  for ( int i = 0; i < 8; ) {
+    int j = i;
+    while ( j < 8 and groups[ j ] == 0 ) {
+      j++;
+    }
+
+    if ( j - i > best_length ) {
+      best_start = i;
+      best_length = j - i;
+    }
+
+    i = ( j == i ) ? i + 1 : j;
+  }
+
+  for ( int i = 0; i < 8; i++ ) {
+    if ( i == best_start ) {
+      *out++ = ':';
+      if ( i == 0 ) {
+	*out++ = ':';
+      }
+      i += best_length - 1;
+      continue;
+    }
+
+    /* hex without leading zeros */
+    bool started = false;
+    for ( int shift = 12; shift >= 0; shift -= 4 ) {
+      const unsigned int digit = ( groups[ i ] >> shift ) & 0xf;
+      if ( digit or started or shift == 0 ) {
+	*out++ = hex_digits[ digit ];
+	started = true;
+      }
+    }
+
+    if ( i < 7 ) {
+      *out++ = ':';
+    }
+  }
+
+  return out;
 }
 
-const sockaddr & Address::to_sockaddr( void ) const
+/* is this a v4-mapped IPv6 address (::ffff:a.b.c.d)? */
+static bool is_v4_mapped( const in6_addr & address )
 {
-  return addr_.as_sockaddr;
+  static const uint8_t prefix[ 12 ] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+  return 0 == memcmp( address.s6_addr, prefix, sizeof( prefix ) );
+}
+
+/* write the IP address (v4-mapped addresses as plain IPv4) */
+char * Address::format_ip( char * out ) const
+{
+  switch ( addr_.as_sockaddr.sa_family ) {
+  case AF_INET:
+    return put_ipv4( out, reinterpret_cast<const uint8_t *>( &addr_.as_sockaddr_in.sin_addr ) );
+  case AF_INET6:
+    {
+      const sockaddr_in6 & addr = addr_.as_sockaddr_in6;
+      if ( is_v4_mapped( addr.sin6_addr ) ) {
+	return put_ipv4( out, &addr.sin6_addr.s6_addr[ 12 ] );
+      }
+
+      out = put_ipv6( out, addr.sin6_addr.s6_addr );
+      if ( addr.sin6_scope_id ) {
+	*out++ = '%';
+	out = put_decimal( out, addr.sin6_scope_id );
+      }
+      return out;
+    }
+  default:
+    throw runtime_error( "Address: no IP address to format" );
+  }
+}
+
+/* the longest address format_ip() and format() can write */
+static_assert( Address::MAX_STRING_LENGTH
+	       >= sizeof( "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff%4294967295:65535" ),
+	       "Address::MAX_STRING_LENGTH holds any address, scope and port" );
+
+/* write "ip:port" without allocating */
+size_t Address::format( char * out ) const
+{
+  char * end = format_ip( out );
+  *end++ = ':';
+  end = put_decimal( end, port() );
+  *end = 0;
+
+  return end - out;
+}
+
+/* accessors */
+
+string Address::ip( void ) const
+{
+  char buffer[ MAX_STRING_LENGTH ];
+  return string( buffer, format_ip( buffer ) );
+}
+
+uint16_t Address::port( void ) const
+{
+  switch ( addr_.as_sockaddr.sa_family ) {
+  case AF_INET: return ntohs( addr_.as_sockaddr_in.sin_port );
+  case AF_INET6: return ntohs( addr_.as_sockaddr_in6.sin6_port );
+  default: return 0;
+  }
+}
+
+pair<string, uint16_t> Address::ip_port( void ) const
+{
+  return make_pair( ip(), port() );
+}
+
+string Address::to_string( void ) const
+{
+  char buffer[ MAX_STRING_LENGTH ];
+  return string( buffer, format( buffer ) );
 }
 
 /* equality */
 bool Address::operator==( const Address & other ) const
 {
-  return 0 == memcmp( &addr_, &other.addr_, size_ );
+  if ( addr_.as_sockaddr.sa_family != other.addr_.as_sockaddr.sa_family ) {
+    return false;
+  }
+
+  switch ( addr_.as_sockaddr.sa_family ) {
+  case AF_INET:
+    return addr_.as_sockaddr_in.sin_port == other.addr_.as_sockaddr_in.sin_port
+      and addr_.as_sockaddr_in.sin_addr.s_addr == other.addr_.as_sockaddr_in.sin_addr.s_addr;
+  case AF_INET6:
+    return addr_.as_sockaddr_in6.sin6_port == other.addr_.as_sockaddr_in6.sin6_port
+      and addr_.as_sockaddr_in6.sin6_scope_id == other.addr_.as_sockaddr_in6.sin6_scope_id
+      and 0 == memcmp( &addr_.as_sockaddr_in6.sin6_addr, &other.addr_.as_sockaddr_in6.sin6_addr,
+		       sizeof( in6_addr ) );
+  default:
+    return true;
+  }
+}
+
+/* mix the fields that equality compares */
+size_t Address::hash( void ) const
+{
+  uint64_t words[ 2 ] = { 0, 0 };
+  uint64_t extra = addr_.as_sockaddr.sa_family;
+
+  switch ( addr_.as_sockaddr.sa_family ) {
+  case AF_INET:
+    words[ 0 ] = addr_.as_sockaddr_in.sin_addr.s_addr;
+    extra |= uint64_t( addr_.as_sockaddr_in.sin_port ) << 16;
+    break;
+  case AF_INET6:
+    memcpy( words, &addr_.as_sockaddr_in6.sin6_addr, sizeof( words ) );
+    extra |= ( uint64_t( addr_.as_sockaddr_in6.sin6_port ) << 16 )
+      | ( uint64_t( addr_.as_sockaddr_in6.sin6_scope_id ) << 32 );
+    break;
+  }
+
+  /* multiply-xorshift mixing, as in splitmix64 */
+  uint64_t h = extra;
+  for ( const uint64_t word : words ) {
+    h ^= word + 0x9e3779b97f4a7c15ULL + ( h << 6 ) + ( h >> 2 );
+    h = ( h ^ ( h >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+    h = ( h ^ ( h >> 27 ) ) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+  }
+
+  return h;
 }
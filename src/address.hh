@@ -3,28 +3,37 @@
 
 #include <string>
 #include <utility>
+#include <functional>
 
 #include <netinet/in.h>
 #include <netdb.h>
 
-/* Address class for IPv4/IPv6 addresses */
+/* Address class for IPv4/IPv6 addresses, stored as the kernel's own
+   sockaddr (28 bytes at most), so it can be passed to syscalls as is,
+   compared and hashed cheaply, and used as the key of a flow table */
 class Address
 {
 public:
   typedef union {
     sockaddr as_sockaddr;
-    sockaddr_storage as_sockaddr_storage;
+    sockaddr_in as_sockaddr_in;
+    sockaddr_in6 as_sockaddr_in6;
   } raw;
 
 private:
-  socklen_t size_;
-
   raw addr_;
 
   /* private constructor given ip/host, service/port, and optional hints */
   Address( const std::string & node, const std::string & service, const addrinfo * hints );
 
+  /* write the IP address (without the port) as text, returning the end */
+  char * format_ip( char * out ) const;
+
 public:
+  /* longest string that to_string() returns, plus a terminator: a full
+     IPv6 address (39), "%" and a 32-bit scope (11), and ":" and a port (6) */
+  static const size_t MAX_STRING_LENGTH = 39 + 11 + 6 + 1;
+
   /* constructors */
   Address();
   Address( const raw & addr, const size_t size );
@@ -38,15 +47,29 @@ public:
 
   /* accessors */
   std::pair<std::string, uint16_t> ip_port( void ) const;
-  std::string ip( void ) const { return ip_port().first; }
-  uint16_t port( void ) const { return ip_port().second; }
+  std::string ip( void ) const;
+  uint16_t port( void ) const;
   std::string to_string( void ) const;
 
-  socklen_t size( void ) const { return size_; }
-  const sockaddr & to_sockaddr( void ) const;
+  /* write "ip:port" into out (of MAX_STRING_LENGTH bytes) without allocating,
+     returning its length */
+  size_t format( char * out ) const;
 
-  /* equality */
+  socklen_t size( void ) const;
+  const sockaddr & to_sockaddr( void ) const { return addr_.as_sockaddr; }
+
+  /* equality (of family, IP address, port, and IPv6 scope) */
   bool operator==( const Address & other ) const;
+  bool operator!=( const Address & other ) const { return not operator==( other ); }
+
+  size_t hash( void ) const;
 };
 
+namespace std {
+  template <> struct hash<Address>
+  {
+    size_t operator()( const Address & address ) const { return address.hash(); }
+  };
+}
+
 #endif /* ADDRESS_HH */
@@ -0,0 +1,101 @@
+#include <cstdint>
+#include <stdexcept>
+
+#include "buffer_pool.hh"
+
+using namespace std;
+
+/* buffers are aligned (and sized) to whole cache lines */
+static const size_t CACHE_LINE = 64;
+
+BufferPool::BufferPool( const size_t buffer_size, const size_t buffers_per_chunk )
+  : buffer_size_( (buffer_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE ),
+    buffers_per_chunk_( buffers_per_chunk ),
+    chunks_(),
+    free_list_()
+{
+  if ( buffer_size == 0 or buffers_per_chunk == 0 ) {
+    throw runtime_error( "BufferPool: buffer size and chunk size must be positive" );
+  }
+}
+
+/* add another chunk of buffers to the free list */
+void BufferPool::grow( void )
+{
+  /* over-allocate by one cache line so every buffer starts on a boundary */
+  chunks_.emplace_back( new char[ buffer_size_ * buffers_per_chunk_ + CACHE_LINE ] );
+
+  const uintptr_t base = reinterpret_cast<uintptr_t>( chunks_.back().get() );
+  char * const aligned = chunks_.back().get() + (CACHE_LINE - base % CACHE_LINE) % CACHE_LINE;
+
+  free_list_.reserve( allocated() );
+  for ( size_t i = buffers_per_chunk_; i > 0; i-- ) {
+    free_list_.push_back( aligned + (i - 1) * buffer_size_ );
+  }
+}
+
+/* borrow a buffer (growing the pool if none is free) */
+BufferPool::Buffer BufferPool::acquire( void )
+{
+  if ( free_list_.empty() ) {
+    grow();
+  }
+
+  char * const data = free_list_.back();
+  free_list_.pop_back();
+
+  return Buffer( *this, data );
+}
+
+/* move constructor */
+BufferPool::Buffer::Buffer( Buffer && other )
+  : pool_( other.pool_ ),
+    data_( other.data_ ),
+    size_( other.size_ )
+{
+  other.pool_ = nullptr;
+  other.data_ = nullptr;
+  other.size_ = 0;
+}
+
+/* move assignment */
+BufferPool::Buffer & BufferPool::Buffer::operator=( Buffer && other )
+{
+  if ( this != &other ) {
+    if ( pool_ ) {
+      pool_->release( data_ );
+    }
+
+    pool_ = other.pool_;
+    data_ = other.data_;
+    size_ = other.size_;
+
+    other.pool_ = nullptr;
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+
+  return *this;
+}
+
+/* destructor (returns storage to the pool) */
+BufferPool::Buffer::~Buffer()
+{
+  if ( pool_ ) {
+    pool_->release( data_ );
+  }
+}
+
+size_t BufferPool::Buffer::capacity( void ) const
+{
+  return pool_ ? pool_->buffer_size() : 0;
+}
+
+void BufferPool::Buffer::resize( const size_t size )
+{
+  if ( size > capacity() ) {
+    throw runtime_error( "BufferPool::Buffer: size exceeds capacity" );
+  }
+
+  size_ = size;
+}
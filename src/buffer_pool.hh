@@ -0,0 +1,87 @@
+#ifndef BUFFER_POOL_HH
+#define BUFFER_POOL_HH
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Pool of fixed-size, reusable buffers carved out of large arena chunks.
+   Buffers are handed out and returned without touching the heap once the
+   pool has grown to its working-set size. A pool is not thread-safe and
+   must outlive every buffer acquired from it. */
+class BufferPool
+{
+public:
+  /* a buffer borrowed from the pool (given back when destroyed) */
+  class Buffer
+  {
+  private:
+    BufferPool * pool_;
+    char * data_;
+    size_t size_;
+
+  public:
+    /* empty buffer that does not belong to any pool */
+    Buffer() : pool_( nullptr ), data_( nullptr ), size_( 0 ) {}
+
+    /* take ownership of storage from a pool */
+    Buffer( BufferPool & pool, char * data ) : pool_( &pool ), data_( data ), size_( 0 ) {}
+
+    /* move constructor and assignment */
+    Buffer( Buffer && other );
+    Buffer & operator=( Buffer && other );
+
+    /* destructor (returns storage to the pool) */
+    ~Buffer();
+
+    /* accessors */
+    char * data( void ) { return data_; }
+    const char * data( void ) const { return data_; }
+    size_t capacity( void ) const;
+
+    /* number of bytes in use */
+    size_t size( void ) const { return size_; }
+    void resize( const size_t size );
+
+    /* copy the contents out */
+    std::string to_string( void ) const { return std::string( data_, size_ ); }
+
+    /* forbid copying buffers or assigning them */
+    Buffer( const Buffer & other ) = delete;
+    Buffer & operator=( const Buffer & other ) = delete;
+  };
+
+private:
+  size_t buffer_size_;
+  size_t buffers_per_chunk_;
+
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  std::vector<char *> free_list_;
+
+  /* add another chunk of buffers to the free list */
+  void grow( void );
+
+  /* give storage back to the free list */
+  void release( char * const data ) { free_list_.push_back( data ); }
+
+public:
+  /* buffer_size is rounded up to a whole number of cache lines */
+  BufferPool( const size_t buffer_size, const size_t buffers_per_chunk = 64 );
+
+  /* borrow a buffer (growing the pool if none is free) */
+  Buffer acquire( void );
+
+  /* accessors */
+  size_t buffer_size( void ) const { return buffer_size_; }
+  size_t available( void ) const { return free_list_.size(); }
+  size_t allocated( void ) const { return chunks_.size() * buffers_per_chunk_; }
+
+  /* move constructor (only valid while no buffers are borrowed) */
+  BufferPool( BufferPool && other ) = default;
+
+  /* forbid copying BufferPool objects or assigning them */
+  BufferPool( const BufferPool & other ) = delete;
+  BufferPool & operator=( const BufferPool & other ) = delete;
+};
+
+#endif /* BUFFER_POOL_HH */
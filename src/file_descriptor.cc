@@ -1,7 +1,10 @@
 #include "file_descriptor.hh"
 #include "util.hh"
 
+#include <vector>
+
 #include <unistd.h>
+#include <fcntl.h>
 
 using namespace std;
 
@@ -59,16 +62,111 @@ string::const_iterator FileDescriptor::write( const string::const_iterator & beg
 /* read method */
 string FileDescriptor::read( const size_t limit )
 {
-  char buffer[ BUFFER_SIZE ];
+  /* reuse one scratch buffer per thread instead of a fresh one on the stack */
+  thread_local BufferPool scratch_pool( BUFFER_SIZE, 1 );
+  BufferPool::Buffer buffer = scratch_pool.acquire();
 
-  ssize_t bytes_read = SystemCall( "read", ::read( fd_, buffer, min( BUFFER_SIZE, limit ) ) );
+  ssize_t bytes_read = SystemCall( "read", ::read( fd_, buffer.data(), min( BUFFER_SIZE, limit ) ) );
   if ( bytes_read == 0 ) {
     set_eof();
   }
 
   register_read();
 
-  return string( buffer, bytes_read );
+  return string( buffer.data(), bytes_read );
+}
+
+/* read into a pooled buffer (up to its capacity), returning bytes read */
+size_t FileDescriptor::read( BufferPool::Buffer & buffer )
+{
+  buffer.resize( read( buffer.data(), buffer.capacity() ) );
+  return buffer.size();
+}
+
+/* read into a caller's buffer, returning bytes read */
+size_t FileDescriptor::read( char * buffer, const size_t size )
+{
+  ssize_t bytes_read = SystemCall( "read", ::read( fd_, buffer, size ) );
+  if ( bytes_read == 0 ) {
+    set_eof();
+  }
+
+  register_read();
+
+  return bytes_read;
+}
+
+/* scatter a read across several buffers, returning bytes read */
+size_t FileDescriptor::readv( const iovec * iov, const size_t count )
+{
+  ssize_t bytes_read = SystemCall( "readv", ::readv( fd_, iov, count ) );
+  if ( bytes_read == 0 ) {
+    set_eof();
+  }
+
+  register_read();
+
+  return bytes_read;
+}
+
+/* gather a write from several buffers, returning bytes written */
+size_t FileDescriptor::writev( const iovec * iov, const size_t count, const bool write_all )
+{
+  size_t total = 0;
+  for ( size_t i = 0; i < count; i++ ) {
+    total += iov[ i ].iov_len;
+  }
+
+  if ( total == 0 ) {
+    throw runtime_error( "nothing to write" );
+  }
+
+  size_t bytes_written = SystemCall( "writev", ::writev( fd_, iov, count ) );
+  if ( bytes_written == 0 ) {
+    throw runtime_error( "writev returned 0" );
+  }
+
+  register_write();
+
+  if ( not write_all or bytes_written == total ) {
+    return bytes_written;
+  }
+
+  /* short write: copy the unwritten remainder of the iovecs and finish it */
+  vector<iovec> remaining;
+  for ( size_t i = 0; i < count; i++ ) {
+    if ( bytes_written >= iov[ i ].iov_len ) {
+      bytes_written -= iov[ i ].iov_len;
+    } else {
+      remaining.push_back( { static_cast<char *>( iov[ i ].iov_base ) + bytes_written,
+			     iov[ i ].iov_len - bytes_written } );
+      bytes_written = 0;
+    }
+  }
+
+  while ( not remaining.empty() ) {
+    bytes_written = SystemCall( "writev", ::writev( fd_, &remaining[ 0 ], remaining.size() ) );
+    if ( bytes_written == 0 ) {
+      throw runtime_error( "writev returned 0" );
+    }
+
+    register_write();
+
+    /* drop what was written */
+    auto it = remaining.begin();
+    while ( it != remaining.end() and bytes_written >= it->iov_len ) {
+      bytes_written -= it->iov_len;
+      ++it;
+    }
+    remaining.erase( remaining.begin(), it );
+
+    if ( not remaining.empty() ) {
+      remaining.front().iov_base = static_cast<char *>( remaining.front().iov_base ) + bytes_written;
+      remaining.front().iov_len -= bytes_written;
+    }
+  }
+
+  return total;
 }
 
 /* write method */
@@ -82,3 +180,48 @@ string::const_iterator FileDescriptor::write( const std::string & buffer, const
 
   return it;
 }
+
+/* put the file descriptor in blocking or non-blocking mode */
+void FileDescriptor::set_blocking( const bool blocking )
+{
+  int flags = SystemCall( "fcntl", fcntl( fd_, F_GETFL ) );
+  if ( blocking ) {
+    flags &= ~O_NONBLOCK;
+  } else {
+    flags |= O_NONBLOCK;
+  }
+
+  SystemCall( "fcntl", fcntl( fd_, F_SETFL, flags ) );
+}
+
+/* read once, returning WouldBlock if nothing is available */
+IOResult<size_t> FileDescriptor::try_read( char * buffer, const size_t size )
+{
+  const auto bytes_read = NonBlockingSystemCall( "read", ::read( fd_, buffer, size ) );
+
+  register_read();
+
+  if ( not bytes_read ) {
+    return WouldBlock();
+  }
+
+  if ( bytes_read.value() == 0 ) {
+    set_eof();
+  }
+
+  return size_t( bytes_read.value() );
+}
+
+/* write once, returning WouldBlock if there is no room */
+IOResult<size_t> FileDescriptor::try_write( const char * buffer, const size_t size )
+{
+  const auto bytes_written = NonBlockingSystemCall( "write", ::write( fd_, buffer, size ) );
+
+  register_write();
+
+  if ( not bytes_written ) {
+    return WouldBlock();
+  }
+
+  return size_t( bytes_written.value() );
+}
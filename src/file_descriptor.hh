@@ -3,6 +3,11 @@
 
 #include <string>
 
+#include <sys/uio.h>
+
+#include "buffer_pool.hh"
+#include "util.hh"
+
 /* Unix file descriptors (sockets, files, etc.) */
 class FileDescriptor
 {
@@ -42,8 +47,26 @@ public:
 
   /* read and write methods */
   std::string read( const size_t limit = BUFFER_SIZE );
+  size_t read( BufferPool::Buffer & buffer );
   std::string::const_iterator write( const std::string & buffer, const bool write_all = true );
 
+  /* read into a caller's buffer, returning bytes read */
+  size_t read( char * buffer, const size_t size );
+
+  /* scatter a read across several buffers, returning bytes read */
+  size_t readv( const iovec * iov, const size_t count );
+
+  /* gather a write from several buffers, returning bytes written */
+  size_t writev( const iovec * iov, const size_t count, const bool write_all = true );
+
+  /* put the file descriptor in blocking (the default) or non-blocking mode */
+  void set_blocking( const bool blocking );
+
+  /* read or write once on a non-blocking file descriptor, returning
+     WouldBlock instead of throwing when there is nothing to do */
+  IOResult<size_t> try_read( char * buffer, const size_t size );
+  IOResult<size_t> try_write( const char * buffer, const size_t size );
+
   /* forbid copying FileDescriptor objects or assigning them */
   FileDescriptor( const FileDescriptor & other ) = delete;
   const FileDescriptor & operator=( const FileDescriptor & other ) = delete;
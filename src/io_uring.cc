@@ -0,0 +1,359 @@
+#include "config.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "io_uring.hh"
+#include "util.hh"
+
+using namespace std;
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/* thin wrappers for the io_uring syscalls (glibc doesn't provide them) */
+static int io_uring_setup( const unsigned int entries, io_uring_params & params )
+{
+  return syscall( __NR_io_uring_setup, entries, &params );
+}
+
+static int io_uring_enter( const int fd, const unsigned int to_submit,
+			   const unsigned int min_complete, const unsigned int flags )
+{
+  return syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0 );
+}
+
+static int io_uring_register( const int fd, const unsigned int opcode,
+			      const void * const arg, const unsigned int nr_args )
+{
+  return syscall( __NR_io_uring_register, fd, opcode, arg, nr_args );
+}
+
+/* memory ordering for the indices shared with the kernel */
+static unsigned int load_acquire( const unsigned int * const p )
+{
+  return __atomic_load_n( p, __ATOMIC_ACQUIRE );
+}
+
+static void store_release( unsigned int * const p, const unsigned int value )
+{
+  __atomic_store_n( p, value, __ATOMIC_RELEASE );
+}
+
+/* an mmapped region shared with the kernel */
+IOUring::Mapping::Mapping( const int fd, const size_t length, const off_t offset )
+  : address_( mmap( nullptr, length, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, offset ) ),
+    length_( length )
+{
+  if ( address_ == MAP_FAILED ) {
+    throw unix_error( "mmap" );
+  }
+}
+
+IOUring::Mapping::~Mapping()
+{
+  if ( munmap( address_, length_ ) < 0 ) { /* don't throw from destructor */
+    print_exception( unix_error( "munmap" ) );
+  }
+}
+
+/* set up the ring and get its parameters */
+static int setup_ring( const unsigned int entries, io_uring_params & params )
+{
+  zero( params );
+  return SystemCall( "io_uring_setup", io_uring_setup( entries, params ) );
+}
+
+IOUring::IOUring( const unsigned int entries )
+  : params_( new io_uring_params ),
+    ring_fd_( setup_ring( entries, *params_ ) ),
+    sq_ring_( ring_fd_.fd_num(),
+	      params_->sq_off.array + params_->sq_entries * sizeof( unsigned int ),
+	      IORING_OFF_SQ_RING ),
+    cq_ring_( ring_fd_.fd_num(),
+	      params_->cq_off.cqes + params_->cq_entries * sizeof( io_uring_cqe ),
+	      IORING_OFF_CQ_RING ),
+    sqes_( ring_fd_.fd_num(),
+	   params_->sq_entries * sizeof( io_uring_sqe ),
+	   IORING_OFF_SQES ),
+    sq_head_( reinterpret_cast<unsigned int *>( sq_ring_.get() + params_->sq_off.head ) ),
+    sq_tail_( reinterpret_cast<unsigned int *>( sq_ring_.get() + params_->sq_off.tail ) ),
+    sq_mask_( reinterpret_cast<unsigned int *>( sq_ring_.get() + params_->sq_off.ring_mask ) ),
+    sq_array_( reinterpret_cast<unsigned int *>( sq_ring_.get() + params_->sq_off.array ) ),
+    cq_head_( reinterpret_cast<unsigned int *>( cq_ring_.get() + params_->cq_off.head ) ),
+    cq_tail_( reinterpret_cast<unsigned int *>( cq_ring_.get() + params_->cq_off.tail ) ),
+    cq_mask_( reinterpret_cast<unsigned int *>( cq_ring_.get() + params_->cq_off.ring_mask ) ),
+    sqe_array_( reinterpret_cast<io_uring_sqe *>( sqes_.get() ) ),
+    cqe_array_( reinterpret_cast<io_uring_cqe *>( cq_ring_.get() + params_->cq_off.cqes ) ),
+    unsubmitted_( 0 ),
+    completions_(),
+    free_completions_(),
+    outstanding_( 0 )
+{}
+
+IOUring::~IOUring()
+{}
+
+/* can this kernel run the engine? */
+bool IOUring::available( void )
+{
+  static const bool supported = [] () {
+    io_uring_params params;
+    zero( params );
+
+    const int fd = io_uring_setup( 1, params );
+    if ( fd < 0 ) {
+      return false;
+    }
+    FileDescriptor ring( fd );
+
+    /* ask which operations the kernel supports */
+    const unsigned int PROBE_OPS = 256;
+    vector<char> storage( sizeof( io_uring_probe ) + PROBE_OPS * sizeof( io_uring_probe_op ) );
+    io_uring_probe * const probe = reinterpret_cast<io_uring_probe *>( &storage[ 0 ] );
+
+    if ( io_uring_register( fd, IORING_REGISTER_PROBE, probe, PROBE_OPS ) < 0 ) {
+      return false;
+    }
+
+    for ( const unsigned char op : { IORING_OP_READ, IORING_OP_WRITE,
+				     IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+				     IORING_OP_RECVMSG, IORING_OP_SENDMSG, IORING_OP_ACCEPT,
+				     IORING_OP_TIMEOUT } ) {
+      if ( op > probe->last_op or not (probe->ops[ op ].flags & IO_URING_OP_SUPPORTED) ) {
+	return false;
+      }
+    }
+
+    return true;
+  } ();
+
+  return supported;
+}
+
+/* io_uring_enter wrapper */
+void IOUring::enter( const unsigned int to_submit, const unsigned int min_complete )
+{
+  const unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+  while ( true ) {
+    const int ret = io_uring_enter( ring_fd_.fd_num(), to_submit, min_complete, flags );
+    if ( ret >= 0 ) {
+      unsubmitted_ -= ret;
+      return;
+    } else if ( errno != EINTR ) {
+      throw unix_error( "io_uring_enter" );
+    }
+  }
+}
+
+/* get a zeroed submission entry for a new operation */
+io_uring_sqe & IOUring::prepare( const unsigned char opcode, const int fd_num,
+				 const CompletionType & completion )
+{
+  /* make room if the submission queue is full */
+  if ( *sq_tail_ - load_acquire( sq_head_ ) >= params_->sq_entries ) {
+    submit();
+  }
+
+  /* remember the callback */
+  uint64_t user_data;
+  if ( free_completions_.empty() ) {
+    user_data = completions_.size();
+    completions_.push_back( completion );
+  } else {
+    user_data = free_completions_.back();
+    free_completions_.pop_back();
+    completions_.at( user_data ) = completion;
+  }
+  outstanding_++;
+
+  const unsigned int tail = *sq_tail_;
+  const unsigned int index = tail & *sq_mask_;
+
+  io_uring_sqe & sqe = sqe_array_[ index ];
+  zero( sqe );
+  sqe.opcode = opcode;
+  sqe.fd = fd_num;
+  sqe.user_data = user_data;
+
+  sq_array_[ index ] = index;
+  store_release( sq_tail_, tail + 1 );
+  unsubmitted_++;
+
+  return sqe;
+}
+
+void IOUring::read( FileDescriptor & fd, char * const buffer, const size_t length,
+		    const CompletionType & completion )
+{
+  io_uring_sqe & sqe = prepare( IORING_OP_READ, fd.fd_num(), completion );
+  sqe.addr = reinterpret_cast<uint64_t>( buffer );
+  sqe.len = length;
+  sqe.off = -1; /* current file position (ignored for sockets and pipes) */
+}
+
+void IOUring::write( FileDescriptor & fd, const char * const buffer, const size_t length,
+		     const CompletionType & completion )
+{
+  io_uring_sqe & sqe = prepare( IORING_OP_WRITE, fd.fd_num(), completion );
+  sqe.addr = reinterpret_cast<uint64_t>( buffer );
+  sqe.len = length;
+  sqe.off = -1;
+}
+
+void IOUring::recvmsg( FileDescriptor & fd, msghdr & header, const CompletionType & completion )
+{
+  io_uring_sqe & sqe = prepare( IORING_OP_RECVMSG, fd.fd_num(), completion );
+  sqe.addr = reinterpret_cast<uint64_t>( &header );
+  sqe.len = 1;
+}
+
+void IOUring::sendmsg( FileDescriptor & fd, const msghdr & header, const CompletionType & completion )
+{
+  io_uring_sqe & sqe = prepare( IORING_OP_SENDMSG, fd.fd_num(), completion );
+  sqe.addr = reinterpret_cast<uint64_t>( &header );
+  sqe.len = 1;
+}
+
+void IOUring::accept( FileDescriptor & fd, const CompletionType & completion )
+{
+  io_uring_sqe & sqe = prepare( IORING_OP_ACCEPT, fd.fd_num(), completion );
+  sqe.accept_flags = SOCK_CLOEXEC;
+}
+
+void IOUring::timeout( const uint64_t nanoseconds, const CompletionType & completion )
+{
+  /* (the kernel reads the duration when the entry is submitted, so
+     submit it while the duration is still here) */
+  __kernel_timespec duration;
+  duration.tv_sec = nanoseconds / 1000000000;
+  duration.tv_nsec = nanoseconds % 1000000000;
+
+  io_uring_sqe & sqe = prepare( IORING_OP_TIMEOUT, -1, completion );
+  sqe.addr = reinterpret_cast<uint64_t>( &duration );
+  sqe.len = 1;
+  submit();
+}
+
+/* pin buffers in the kernel so fixed reads and writes skip the page mapping */
+void IOUring::register_buffers( const vector<iovec> & buffers )
+{
+  SystemCall( "io_uring_register",
+	      io_uring_register( ring_fd_.fd_num(), IORING_REGISTER_BUFFERS,
+				 buffers.data(), buffers.size() ) );
+}
+
+void IOUring::read_fixed( FileDescriptor & fd, char * const buffer, const size_t length,
+			  const unsigned int buffer_index, const CompletionType & completion )
+{
+  io_uring_sqe & sqe = prepare( IORING_OP_READ_FIXED, fd.fd_num(), completion );
+  sqe.addr = reinterpret_cast<uint64_t>( buffer );
+  sqe.len = length;
+  sqe.off = -1;
+  sqe.buf_index = buffer_index;
+}
+
+void IOUring::write_fixed( FileDescriptor & fd, const char * const buffer, const size_t length,
+			   const unsigned int buffer_index, const CompletionType & completion )
+{
+  io_uring_sqe & sqe = prepare( IORING_OP_WRITE_FIXED, fd.fd_num(), completion );
+  sqe.addr = reinterpret_cast<uint64_t>( buffer );
+  sqe.len = length;
+  sqe.off = -1;
+  sqe.buf_index = buffer_index;
+}
+
+/* hand queued operations to the kernel without waiting */
+void IOUring::submit( void )
+{
+  if ( unsubmitted_ ) {
+    enter( unsubmitted_, 0 );
+  }
+}
+
+/* submit, wait for completions, and run the ready callbacks */
+size_t IOUring::run( const unsigned int min_complete )
+{
+  if ( unsubmitted_ or min_complete ) {
+    enter( unsubmitted_, min_complete );
+  }
+
+  size_t completed = 0;
+  unsigned int head = *cq_head_;
+
+  while ( head != load_acquire( cq_tail_ ) ) {
+    const io_uring_cqe & cqe = cqe_array_[ head & *cq_mask_ ];
+    const uint64_t user_data = cqe.user_data;
+    const int result = cqe.res;
+
+    /* free the entry before running the callback, which may queue more work */
+    store_release( cq_head_, ++head );
+
+    CompletionType completion = move( completions_.at( user_data ) );
+    completions_.at( user_data ) = nullptr;
+    free_completions_.push_back( user_data );
+    outstanding_--;
+
+    completion( result );
+    completed++;
+  }
+
+  return completed;
+}
+
+#else /* no <linux/io_uring.h>: an engine that is never available */
+
+struct io_uring_params {};
+
+static int unavailable( void )
+{
+  throw runtime_error( "IOUring: built without <linux/io_uring.h>" );
+}
+
+IOUring::Mapping::Mapping( const int, const size_t, const off_t )
+  : address_( nullptr ), length_( 0 )
+{}
+
+IOUring::Mapping::~Mapping()
+{}
+
+IOUring::IOUring( const unsigned int )
+  : params_( new io_uring_params ),
+    ring_fd_( unavailable() ),
+    sq_ring_( -1, 0, 0 ), cq_ring_( -1, 0, 0 ), sqes_( -1, 0, 0 ),
+    sq_head_( nullptr ), sq_tail_( nullptr ), sq_mask_( nullptr ), sq_array_( nullptr ),
+    cq_head_( nullptr ), cq_tail_( nullptr ), cq_mask_( nullptr ),
+    sqe_array_( nullptr ),
+    cqe_array_( nullptr ),
+    unsubmitted_( 0 ),
+    completions_(),
+    free_completions_(),
+    outstanding_( 0 )
+{}
+
+IOUring::~IOUring()
+{}
+
+bool IOUring::available( void ) { return false; }
+
+/* (no IOUring can be made, so none of these can be called) */
+void IOUring::read( FileDescriptor &, char * const, const size_t, const CompletionType & ) { unavailable(); }
+void IOUring::write( FileDescriptor &, const char * const, const size_t, const CompletionType & ) { unavailable(); }
+void IOUring::recvmsg( FileDescriptor &, msghdr &, const CompletionType & ) { unavailable(); }
+void IOUring::sendmsg( FileDescriptor &, const msghdr &, const CompletionType & ) { unavailable(); }
+void IOUring::accept( FileDescriptor &, const CompletionType & ) { unavailable(); }
+void IOUring::timeout( const uint64_t, const CompletionType & ) { unavailable(); }
+void IOUring::register_buffers( const vector<iovec> & ) { unavailable(); }
+void IOUring::read_fixed( FileDescriptor &, char * const, const size_t,
+			  const unsigned int, const CompletionType & ) { unavailable(); }
+void IOUring::write_fixed( FileDescriptor &, const char * const, const size_t,
+			   const unsigned int, const CompletionType & ) { unavailable(); }
+void IOUring::submit( void ) { unavailable(); }
+size_t IOUring::run( const unsigned int ) { return unavailable(); }
+
+#endif /* HAVE_LINUX_IO_URING_H */
@@ -0,0 +1,115 @@
+#ifndef IO_URING_HH
+#define IO_URING_HH
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "file_descriptor.hh"
+
+struct io_uring_params;
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/* Completion-based I/O engine on Linux io_uring. Reads, writes, recvmsg,
+   sendmsg and accepts are queued, submitted to the kernel in batches,
+   and their completion callbacks run from run(). Buffers, msghdrs and
+   fds must stay alive until the operation's callback has run. When
+   available() is false (old kernel, io_uring disabled, or built without
+   <linux/io_uring.h>) callers should use the Poller path instead. */
+class IOUring
+{
+public:
+  /* receives the operation's result: bytes transferred, new fd, or -errno */
+  typedef std::function<void(const int result)> CompletionType;
+
+private:
+  /* an mmapped region shared with the kernel */
+  class Mapping
+  {
+  private:
+    void * address_;
+    size_t length_;
+
+  public:
+    Mapping( const int fd, const size_t length, const off_t offset );
+    ~Mapping();
+
+    char * get( void ) const { return static_cast<char *>( address_ ); }
+
+    Mapping( const Mapping & other ) = delete;
+    Mapping & operator=( const Mapping & other ) = delete;
+  };
+
+  std::unique_ptr<io_uring_params> params_;
+  FileDescriptor ring_fd_;
+
+  Mapping sq_ring_, cq_ring_, sqes_;
+
+  /* pointers into the shared rings */
+  unsigned int *sq_head_, *sq_tail_, *sq_mask_, *sq_array_;
+  unsigned int *cq_head_, *cq_tail_, *cq_mask_;
+  io_uring_sqe * sqe_array_;
+  io_uring_cqe * cqe_array_;
+
+  /* queued but not yet submitted */
+  unsigned int unsubmitted_;
+
+  /* callbacks of outstanding operations, indexed by user_data */
+  std::vector<CompletionType> completions_;
+  std::vector<uint64_t> free_completions_;
+  size_t outstanding_;
+
+  /* get a zeroed submission entry for a new operation */
+  io_uring_sqe & prepare( const unsigned char opcode, const int fd_num,
+			  const CompletionType & completion );
+
+  /* io_uring_enter wrapper */
+  void enter( const unsigned int to_submit, const unsigned int min_complete );
+
+public:
+  IOUring( const unsigned int entries = 256 );
+  ~IOUring();
+
+  /* can this kernel (and build) run the engine? */
+  static bool available( void );
+
+  /* queue operations (submitted on the next submit() or run()) */
+  void read( FileDescriptor & fd, char * const buffer, const size_t length,
+	     const CompletionType & completion );
+  void write( FileDescriptor & fd, const char * const buffer, const size_t length,
+	      const CompletionType & completion );
+  void recvmsg( FileDescriptor & fd, msghdr & header, const CompletionType & completion );
+  void sendmsg( FileDescriptor & fd, const msghdr & header, const CompletionType & completion );
+  void accept( FileDescriptor & fd, const CompletionType & completion );
+
+  /* complete (with -ETIME) after this long; submitted right away */
+  void timeout( const uint64_t nanoseconds, const CompletionType & completion );
+
+  /* pin buffers in the kernel so fixed reads and writes skip the page mapping */
+  void register_buffers( const std::vector<iovec> & buffers );
+  void read_fixed( FileDescriptor & fd, char * const buffer, const size_t length,
+		   const unsigned int buffer_index, const CompletionType & completion );
+  void write_fixed( FileDescriptor & fd, const char * const buffer, const size_t length,
+		    const unsigned int buffer_index, const CompletionType & completion );
+
+  /* hand queued operations to the kernel without waiting */
+  void submit( void );
+
+  /* submit, wait for at least min_complete completions,
+     and run the callbacks of every completion that is ready */
+  size_t run( const unsigned int min_complete = 1 );
+
+  /* number of operations whose callbacks haven't run yet */
+  size_t outstanding( void ) const { return outstanding_; }
+
+  /* forbid copying IOUring objects or assigning them */
+  IOUring( const IOUring & other ) = delete;
+  IOUring & operator=( const IOUring & other ) = delete;
+};
+
+#endif /* IO_URING_HH */
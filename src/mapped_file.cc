@@ -0,0 +1,45 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "mapped_file.hh"
+#include "file_descriptor.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* the size of an open file */
+static size_t file_size( const FileDescriptor & file )
+{
+  struct stat info;
+  SystemCall( "fstat", fstat( file.fd_num(), &info ) );
+  return info.st_size;
+}
+
+MappedFile::MappedFile( const string & filename )
+  : data_( nullptr ),
+    size_( 0 )
+{
+  FileDescriptor file( SystemCall( "open " + filename, open( filename.c_str(), O_RDONLY | O_CLOEXEC ) ) );
+  size_ = file_size( file );
+
+  if ( size_ == 0 ) {
+    return; /* (mmap refuses to map nothing) */
+  }
+
+  void * const address = mmap( nullptr, size_, PROT_READ, MAP_PRIVATE, file.fd_num(), 0 );
+  if ( address == MAP_FAILED ) {
+    throw unix_error( "mmap " + filename );
+  }
+  data_ = static_cast<char *>( address );
+
+  /* it will be read front to back, so read ahead */
+  madvise( data_, size_, MADV_SEQUENTIAL );
+}
+
+MappedFile::~MappedFile()
+{
+  if ( data_ and munmap( data_, size_ ) < 0 ) { /* don't throw from destructor */
+    print_exception( unix_error( "munmap" ) );
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef MAPPED_FILE_HH
+#define MAPPED_FILE_HH
+
+#include <string>
+
+/* A whole file mapped read-only into memory, so it can be parsed in
+   place without copying it through read() buffers. (An empty file maps
+   to nothing, with size 0.) */
+class MappedFile
+{
+private:
+  char * data_;
+  size_t size_;
+
+public:
+  MappedFile( const std::string & filename );
+  ~MappedFile();
+
+  const char * data( void ) const { return data_; }
+  size_t size( void ) const { return size_; }
+
+  const char * begin( void ) const { return data_; }
+  const char * end( void ) const { return data_ + size_; }
+
+  /* forbid copying MappedFile objects or assigning them */
+  MappedFile( const MappedFile & other ) = delete;
+  MappedFile & operator=( const MappedFile & other ) = delete;
+};
+
+#endif /* MAPPED_FILE_HH */
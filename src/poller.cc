@@ -1,17 +1,121 @@
 #include <algorithm>
 #include <cassert>
-#include <numeric>
 
+#include "config.h"
 #include "poller.hh"
+#include "timestamp.hh"
 #include "util.hh"
 
 using namespace std;
 using namespace PollerShortNames;
 
-void Poller::add_action( Poller::Action action )
+Poller::Poller( const Backend & backend )
+  : backend_( backend ),
+    actions_(),
+    free_ids_(),
+    removed_ids_(),
+    removed_actions_(),
+    conditional_ids_(),
+    pollfds_(),
+    epoll_fd_( backend == Backend::Epoll
+	       ? SystemCall( "epoll_create1", epoll_create1( EPOLL_CLOEXEC ) )
+	       : -1 ),
+    registrations_(),
+    events_(),
+    interested_fds_( 0 ),
+    timer_wheel_( timestamp_us() ),
+    timers_(),
+    fired_timers_()
+{}
+
+Poller::ActionID Poller::add_action( Poller::Action action )
 {
-  actions_.push_back( action );
-  pollfds_.push_back( { action.fd.fd_num(), 0, 0 } );
+  const int fd_num = action.fd.fd_num();
+
+  /* reuse an empty slot if there is one */
+  ActionID id;
+  if ( free_ids_.empty() ) {
+    id = actions_.size();
+    actions_.emplace_back();
+    pollfds_.push_back( { -1, 0, 0 } );
+  } else {
+    id = free_ids_.back();
+    free_ids_.pop_back();
+  }
+
+  actions_.at( id ).reset( new Action( action ) );
+  pollfds_.at( id ) = { fd_num, 0, 0 };
+
+  if ( action.conditional ) {
+    conditional_ids_.push_back( id );
+  }
+
+  if ( backend_ == Backend::Epoll ) {
+    if ( fd_num < 0 ) {
+      throw runtime_error( "Poller: invalid file descriptor" );
+    }
+
+    if ( size_t( fd_num ) >= registrations_.size() ) {
+      registrations_.resize( fd_num + 1 );
+    }
+
+    Registration & registration = registrations_.at( fd_num );
+    ActionID & slot = action.direction == Direction::In ? registration.in : registration.out;
+    if ( slot != Registration::NONE ) {
+      throw runtime_error( "Poller: fd already has an action in this direction" );
+    }
+    slot = id;
+
+    update_registration( fd_num );
+  }
+
+  return id;
+}
+
+void Poller::remove_action( const ActionID id )
+{
+  if ( id >= actions_.size() or not actions_.at( id ) ) {
+    throw runtime_error( "Poller: no such action" );
+  }
+
+  const Action & action = *actions_.at( id );
+  const int fd_num = action.fd.fd_num();
+
+  if ( action.conditional ) {
+    conditional_ids_.erase( find( conditional_ids_.begin(), conditional_ids_.end(), id ) );
+  }
+
+  pollfds_.at( id ) = { -1, 0, 0 };
+
+  /* the callback may still be running, so keep the action (and its slot)
+     alive until the next call to poll() */
+  removed_actions_.push_back( move( actions_.at( id ) ) );
+  removed_ids_.push_back( id );
+
+  if ( backend_ == Backend::Epoll ) {
+    Registration & registration = registrations_.at( fd_num );
+    if ( registration.in == id ) {
+      registration.in = Registration::NONE;
+    } else if ( registration.out == id ) {
+      registration.out = Registration::NONE;
+    }
+
+    update_registration( fd_num );
+  }
+}
+
+void Poller::set_active( const ActionID id, const bool active )
+{
+  if ( id >= actions_.size() or not actions_.at( id ) ) {
+    throw runtime_error( "Poller: no such action" );
+  }
+
+  Action & action = *actions_.at( id );
+  action.active = active;
+
+  if ( backend_ == Backend::Epoll ) {
+    update_registration( action.fd.fd_num() );
+  }
 }
 
 unsigned int Poller::Action::service_count( void ) const
@@ -19,55 +123,403 @@ unsigned int Poller::Action::service_count( void ) const
   return direction == Direction::In ? fd.read_count() : fd.write_count();
 }
 
+/* is this action currently interested in its fd? */
+bool Poller::interested( const Action & action ) const
+{
+  /* don't poll in on fds that have had EOF */
+  if ( action.direction == Direction::In and action.fd.eof() ) {
+    return false;
+  }
+
+  return action.active and ((not action.conditional) or action.when_interested());
+}
+
+/* tell the kernel about changed interest in an fd */
+void Poller::update_registration( const int fd_num )
+{
+  Registration & registration = registrations_.at( fd_num );
+
+  uint32_t events = 0;
+  bool edge_triggered = false;
+
+  if ( registration.in != Registration::NONE ) {
+    const Action & action = *actions_.at( registration.in );
+    if ( interested( action ) ) {
+      events |= EPOLLIN;
+    }
+    edge_triggered |= action.trigger == Action::Trigger::Edge;
+  }
+
+  if ( registration.out != Registration::NONE ) {
+    const Action & action = *actions_.at( registration.out );
+    if ( interested( action ) ) {
+      events |= EPOLLOUT;
+    }
+    edge_triggered |= action.trigger == Action::Trigger::Edge;
+  }
+
+  const bool was_interested = registration.events & (EPOLLIN | EPOLLOUT);
+  const bool now_interested = events & (EPOLLIN | EPOLLOUT);
+
+  if ( edge_triggered ) {
+    events |= EPOLLET;
+  }
+
+  if ( registration.in == Registration::NONE and registration.out == Registration::NONE ) {
+    /* no actions left: forget the fd (ignoring errors, since it may already be closed) */
+    if ( registration.registered ) {
+      epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_DEL, fd_num, nullptr );
+      registration.registered = false;
+    }
+    events = 0;
+  } else if ( (not registration.registered) or events != registration.events ) {
+    if ( not registration.registered ) {
+      registration.generation++;
+    }
+
+    epoll_event event;
+    zero( event );
+    event.events = events;
+    event.data.u64 = (uint64_t( registration.generation ) << 32) | uint32_t( fd_num );
+
+    SystemCall( "epoll_ctl", epoll_ctl( epoll_fd_.fd_num(),
+					registration.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+					fd_num, &event ) );
+    registration.registered = true;
+  }
+
+  registration.events = events;
+  if ( now_interested and not was_interested ) {
+    interested_fds_++;
+  } else if ( was_interested and not now_interested ) {
+    interested_fds_--;
+  }
+}
+
+/* run an action's callback, returning false if the poller should exit */
+bool Poller::dispatch( const ActionID id, Poller::Result & result )
+{
+  Action & action = *actions_.at( id );
+
+  const auto count_before = action.service_count();
+  auto action_result = action.callback();
+
+  if ( count_before == action.service_count() ) {
+    throw runtime_error( "Poller: busy wait detected: callback did not read/write fd" );
+  }
+
+  return handle_result( id, action_result, result );
+}
+
+/* run an action's error callback, or exit if it has none */
+bool Poller::dispatch_error( const ActionID id, Poller::Result & result )
+{
+  Action & action = *actions_.at( id );
+
+  if ( not action.error_callback ) {
+    result = Result::Type::Exit;
+    return false;
+  }
+
+  return handle_result( id, action.error_callback(), result );
+}
+
+/* act on what a callback returned */
+bool Poller::handle_result( const ActionID id, const Action::Result & action_result,
+			    Poller::Result & result )
+{
+  switch ( action_result.result ) {
+  case ResultType::Exit:
+    result = Result( Result::Type::Exit, action_result.exit_status );
+    return false;
+  case ResultType::Cancel:
+    if ( actions_.at( id ) ) {
+      remove_action( id );
+    }
+  case ResultType::Continue:
+    break;
+  }
+
+  return true;
+}
+
+/* run callback delay_us from now, then every period_us if nonzero */
+Poller::TimerID Poller::add_timer( const uint64_t delay_us,
+				   const Action::CallbackType & callback,
+				   const uint64_t period_us )
+{
+  const TimerID id = timer_wheel_.schedule( timestamp_us() + delay_us );
+
+  const size_t index = id & 0xffffffff;
+  if ( index >= timers_.size() ) {
+    timers_.resize( index + 1 );
+  }
+
+  timers_[ index ].callback = callback;
+  timers_[ index ].period_us = period_us;
+
+  return id;
+}
+
+/* move a pending (or currently running) timer to delay_us from now */
+void Poller::reschedule_timer( const TimerID id, const uint64_t delay_us )
+{
+  timer_wheel_.reschedule( id, timestamp_us() + delay_us );
+}
+
+/* stop a timer */
+void Poller::cancel_timer( const TimerID id )
+{
+  timer_wheel_.cancel( id );
+}
+
+/* run the callbacks of expired timers, returning false if the poller should exit */
+bool Poller::run_timers( Poller::Result & result, bool & any_fired )
+{
+  const uint64_t now = timestamp_us();
+
+  fired_timers_.clear();
+  timer_wheel_.advance( now, fired_timers_ );
+
+  for ( size_t i = 0; i < fired_timers_.size(); i++ ) {
+    const TimerID id = fired_timers_[ i ];
+
+    /* an earlier callback may have cancelled or rescheduled this one */
+    if ( not timer_wheel_.valid( id ) or timer_wheel_.pending( id ) ) {
+      continue;
+    }
+
+    /* hold the callback while it runs, since it may cancel its own
+       timer and add another one in the same slot */
+    Timer & timer = timers_[ id & 0xffffffff ];
+    Action::CallbackType callback = move( timer.callback );
+    const uint64_t period_us = timer.period_us;
+
+    const auto timer_result = callback();
+    any_fired = true;
+
+    /* unless the callback cancelled or rescheduled it, retire or re-arm the timer */
+    if ( timer_wheel_.valid( id ) ) {
+      timers_[ id & 0xffffffff ].callback = move( callback );
+
+      if ( not timer_wheel_.pending( id ) ) {
+	if ( period_us and timer_result.result != ResultType::Cancel ) {
+	  /* keep the period's phase unless we have fallen behind */
+	  const uint64_t next = timer_wheel_.expiry( id ) + period_us;
+	  timer_wheel_.reschedule( id, next > now ? next : now + period_us );
+	} else {
+	  timer_wheel_.cancel( id );
+	}
+      }
+    }
+
+    if ( timer_result.result == ResultType::Exit ) {
+      /* the rest fire on the next call */
+      for ( size_t j = i + 1; j < fired_timers_.size(); j++ ) {
+	if ( timer_wheel_.valid( fired_timers_[ j ] ) and not timer_wheel_.pending( fired_timers_[ j ] ) ) {
+	  timer_wheel_.reschedule( fired_timers_[ j ], now );
+	}
+      }
+
+      result = Result( Result::Type::Exit, timer_result.exit_status );
+      return false;
+    }
+  }
+
+  return true;
+}
+
 Poller::Result Poller::poll( const int & timeout_ms )
+{
+  /* now that no callback can be running, recycle removed actions' slots */
+  removed_actions_.clear();
+  free_ids_.insert( free_ids_.end(), removed_ids_.begin(), removed_ids_.end() );
+  removed_ids_.clear();
+
+  /* sleep until the caller's timeout or the next timer, whichever is first */
+  int64_t wait_us = timeout_ms < 0 ? -1 : int64_t( timeout_ms ) * 1000;
+  bool caller_timeout = true;
+
+  if ( timer_wheel_.size() ) {
+    const uint64_t now = timestamp_us(), next = timer_wheel_.next_expiry();
+    const int64_t timer_wait_us = next > now ? next - now : 0;
+
+    if ( wait_us < 0 or timer_wait_us < wait_us ) {
+      wait_us = timer_wait_us;
+      caller_timeout = false;
+    }
+  }
+
+  Result result = backend_ == Backend::Epoll ? poll_with_epoll( wait_us ) : poll_with_poll( wait_us );
+  if ( result.result == Result::Type::Exit ) {
+    return result;
+  }
+
+  bool any_fired = false;
+  if ( not run_timers( result, any_fired ) ) {
+    return result;
+  }
+
+  /* only report a timeout if the caller's time ran out with nothing to do */
+  if ( result.result == Result::Type::Timeout and (any_fired or not caller_timeout) ) {
+    return Result::Type::Success;
+  }
+
+  return result;
+}
+
+Poller::Result Poller::poll_with_poll( const int64_t wait_us )
 {
   assert( pollfds_.size() == actions_.size() );
 
   /* tell poll whether we care about each fd */
+  bool any_interest = false;
   for ( unsigned int i = 0; i < actions_.size(); i++ ) {
-    assert( pollfds_.at( i ).fd == actions_.at( i ).fd.fd_num() );
-    pollfds_.at( i ).events = (actions_.at( i ).active and actions_.at( i ).when_interested())
-      ? actions_.at( i ).direction : 0;
-
-    /* don't poll in on fds that have had EOF */
-    if ( actions_.at( i ).direction == Direction::In
-	 and actions_.at( i ).fd.eof() ) {
-      pollfds_.at( i ).events = 0;
+    if ( not actions_[ i ] ) {
+      continue;
     }
+
+    assert( pollfds_.at( i ).fd == actions_.at( i )->fd.fd_num() );
+    pollfds_.at( i ).events = interested( *actions_.at( i ) ) ? actions_.at( i )->direction : 0;
+    any_interest |= pollfds_.at( i ).events;
   }
 
-  /* Quit if no member in pollfds_ has a non-zero direction */
-  if ( not accumulate( pollfds_.begin(), pollfds_.end(), false,
-		       [] ( bool acc, pollfd x ) { return acc or x.events; } ) ) {
+  /* Quit if no member in pollfds_ has a non-zero direction (and no timers are left) */
+  if ( not any_interest and timer_wheel_.size() == 0 ) {
     return Result::Type::Exit;
   }
 
-  if ( 0 == SystemCall( "poll", ::poll( &pollfds_[ 0 ], pollfds_.size(), timeout_ms ) ) ) {
+  /* ppoll has microsecond (or better) resolution */
+  timespec wait_time;
+  wait_time.tv_sec = wait_us / 1000000;
+  wait_time.tv_nsec = (wait_us % 1000000) * 1000;
+
+  if ( 0 == SystemCall( "ppoll", ::ppoll( pollfds_.data(), pollfds_.size(),
+					  wait_us < 0 ? nullptr : &wait_time, nullptr ) ) ) {
     return Result::Type::Timeout;
   }
 
-  for ( unsigned int i = 0; i < pollfds_.size(); i++ ) {
+  /* callbacks may add actions; those wait for the next call */
+  const size_t action_count = pollfds_.size();
+
+  for ( unsigned int i = 0; i < action_count; i++ ) {
+    if ( not actions_[ i ] ) { /* removed by an earlier callback */
+      continue;
+    }
+
     if ( pollfds_[ i ].revents & (POLLERR | POLLHUP | POLLNVAL) ) {
-      return Result::Type::Exit;
+      Result result = Result::Type::Success;
+      if ( not dispatch_error( i, result ) ) {
+	return result;
+      }
+      continue;
     }
 
     if ( pollfds_[ i ].revents & pollfds_[ i ].events ) {
       /* we only want to call callback if revents includes
 	 the event we asked for */
-      const auto count_before = actions_.at( i ).service_count();
-      auto result = actions_.at( i ).callback();
+      Result result = Result::Type::Success;
+      if ( not dispatch( i, result ) ) {
+	return result;
+      }
+    }
+  }
+
+  return Result::Type::Success;
+}
+
+/* epoll_wait with microsecond resolution where the kernel supports it */
+static int epoll_wait_us( const int epoll_fd, epoll_event * const events,
+			  const int max_events, const int64_t wait_us )
+{
+#ifdef HAVE_EPOLL_PWAIT2
+  timespec wait_time;
+  wait_time.tv_sec = wait_us / 1000000;
+  wait_time.tv_nsec = (wait_us % 1000000) * 1000;
+
+  const int ret = epoll_pwait2( epoll_fd, events, max_events,
+				wait_us < 0 ? nullptr : &wait_time, nullptr );
+  if ( ret >= 0 or errno != ENOSYS ) {
+    return ret;
+  }
+#endif
+
+  /* otherwise round up to whole milliseconds */
+  return epoll_wait( epoll_fd, events, max_events,
+		     wait_us < 0 ? -1 : (wait_us + 999) / 1000 );
+}
+
+Poller::Result Poller::poll_with_epoll( const int64_t wait_us )
+{
+  /* only actions with a predicate need to be re-evaluated */
+  for ( const auto & id : conditional_ids_ ) {
+    update_registration( actions_.at( id )->fd.fd_num() );
+  }
+
+  /* Quit if no fd has any interest (and no timers are left) */
+  if ( interested_fds_ == 0 and timer_wheel_.size() == 0 ) {
+    return Result::Type::Exit;
+  }
+
+  static const size_t MAX_EVENTS = 1024;
+  events_.resize( min( MAX_EVENTS, max( size_t( 1 ), interested_fds_ ) ) );
 
-      if ( count_before == actions_.at( i ).service_count() ) {
-	throw runtime_error( "Poller: busy wait detected: callback did not read/write fd" );
+  const int event_count = SystemCall( "epoll_wait",
+				      epoll_wait_us( epoll_fd_.fd_num(), &events_[ 0 ],
+						     events_.size(), wait_us ) );
+  if ( event_count == 0 ) {
+    return Result::Type::Timeout;
+  }
+
+  for ( int i = 0; i < event_count; i++ ) {
+    const epoll_event event = events_[ i ];
+    const int fd_num = event.data.u64 & 0xffffffff;
+    const uint32_t generation = event.data.u64 >> 32;
+
+    /* is this still the same registration? (a callback may have removed it) */
+    auto current = [&] () {
+      return registrations_.at( fd_num ).registered
+	and registrations_.at( fd_num ).generation == generation;
+    };
+
+    if ( not current() ) {
+      continue;
+    }
+
+    Result result = Result::Type::Success;
+
+    if ( event.events & (EPOLLERR | EPOLLHUP) ) {
+      /* the in action's error callback takes precedence */
+      const Registration & registration = registrations_.at( fd_num );
+      ActionID id = registration.out;
+      if ( registration.in != Registration::NONE
+	   and ( actions_.at( registration.in )->error_callback or id == Registration::NONE ) ) {
+	id = registration.in;
+      }
+
+      if ( not dispatch_error( id, result ) ) {
+	return result;
+      }
+      continue;
+    }
+
+    if ( (event.events & EPOLLIN)
+	 and registrations_.at( fd_num ).in != Registration::NONE ) {
+      if ( not dispatch( registrations_.at( fd_num ).in, result ) ) {
+	return result;
       }
 
-      switch ( result.result ) {
-      case ResultType::Exit:
-	return Result( Result::Type::Exit, result.exit_status );
-      case ResultType::Cancel:
-	actions_.at( i ).active = false;
-      case ResultType::Continue:
-	break;
+      /* stop polling in after EOF */
+      if ( current() ) {
+	update_registration( fd_num );
+      }
+    }
+
+    if ( (event.events & EPOLLOUT)
+	 and current()
+	 and registrations_.at( fd_num ).out != Registration::NONE ) {
+      if ( not dispatch( registrations_.at( fd_num ).out, result ) ) {
+	return result;
       }
     }
   }
@@ -1,12 +1,16 @@
 #ifndef POLLER_HH
 #define POLLER_HH
 
+#include <deque>
 #include <functional>
+#include <memory>
 #include <vector>
 
 #include <poll.h>
+#include <sys/epoll.h>
 
 #include "file_descriptor.hh"
+#include "timer_wheel.hh"
 
 class Poller
 {
@@ -27,23 +31,48 @@ public:
     enum PollDirection : short { In = POLLIN, Out = POLLOUT } direction;
     CallbackType callback;
     std::function<bool(void)> when_interested;
+    bool conditional; /* has a when_interested predicate */
     bool active;
 
+    /* level-triggered (the default) or edge-triggered; only the epoll backend
+       honors Edge, and the callback must then read/write until EAGAIN */
+    enum class Trigger { Level, Edge } trigger;
+
+    /* if set, runs when the fd reports an error or hangup (instead of the
+       poller exiting); it must remove the action or clear the condition */
+    CallbackType error_callback;
+
+    Action( FileDescriptor & s_fd,
+	    const PollDirection & s_direction,
+	    const CallbackType & s_callback,
+	    const Trigger & s_trigger = Trigger::Level )
+      : fd( s_fd ), direction( s_direction ), callback( s_callback ),
+	when_interested( [] () { return true; } ), conditional( false ),
+	active( true ), trigger( s_trigger ), error_callback() {}
+
     Action( FileDescriptor & s_fd,
 	    const PollDirection & s_direction,
 	    const CallbackType & s_callback,
-	    const std::function<bool(void)> & s_when_interested = [] () { return true; } )
+	    const std::function<bool(void)> & s_when_interested,
+	    const Trigger & s_trigger = Trigger::Level )
       : fd( s_fd ), direction( s_direction ), callback( s_callback ),
-	when_interested( s_when_interested ), active( true ) {}
+	when_interested( s_when_interested ), conditional( true ),
+	active( true ), trigger( s_trigger ), error_callback() {}
 
     unsigned int service_count( void ) const;
   };
 
-private:
-  std::vector< Action > actions_;
-  std::vector< pollfd > pollfds_;
+  /* handle for removing an action or changing its interest */
+  typedef size_t ActionID;
+
+  /* handle for cancelling or rescheduling a timer */
+  typedef TimerWheel::TimerID TimerID;
+
+  /* poll(2) rescans every action on each call;
+     epoll(7) keeps interest in the kernel and only visits ready fds
+     (regular files can't be used with it) */
+  enum class Backend { Poll, Epoll };
 
-public:
   struct Result
   {
     enum class Type { Success, Timeout, Exit } result;
@@ -52,9 +81,108 @@ public:
       : result( s_result ), exit_status( s_status ) {}
   };
 
-  Poller() : actions_(), pollfds_() {}
-  void add_action( Action action );
+private:
+  Backend backend_;
+
+  /* indexed by ActionID (empty slots are reused) */
+  std::vector< std::unique_ptr< Action > > actions_;
+  std::vector< ActionID > free_ids_, removed_ids_;
+  std::vector< std::unique_ptr< Action > > removed_actions_;
+
+  /* actions with a when_interested predicate */
+  std::vector< ActionID > conditional_ids_;
+
+  /* poll backend: one pollfd per action slot */
+  std::vector< pollfd > pollfds_;
+
+  /* epoll backend: one registration per fd number */
+  struct Registration
+  {
+    static const ActionID NONE = ActionID( -1 );
+    ActionID in, out;
+    uint32_t events;     /* events currently registered with the kernel */
+    uint32_t generation; /* distinguishes successive registrations of an fd */
+    bool registered;
+    Registration() : in( NONE ), out( NONE ), events( 0 ), generation( 0 ), registered( false ) {}
+  };
+
+  FileDescriptor epoll_fd_;
+  std::vector< Registration > registrations_;
+  std::vector< epoll_event > events_;
+  size_t interested_fds_;
+
+  /* timers, indexed like the wheel's timer IDs */
+  struct Timer
+  {
+    Action::CallbackType callback;
+    uint64_t period_us;
+    Timer() : callback(), period_us( 0 ) {}
+  };
+
+  TimerWheel timer_wheel_;
+  std::deque< Timer > timers_;
+  std::vector< TimerID > fired_timers_;
+
+  /* run the callbacks of expired timers, returning false if the poller should exit */
+  bool run_timers( Result & result, bool & any_fired );
+
+  /* is this action currently interested in its fd? */
+  bool interested( const Action & action ) const;
+
+  /* tell the kernel about changed interest in an fd */
+  void update_registration( const int fd_num );
+
+  /* run an action's callback */
+  bool dispatch( const ActionID id, Result & result );
+
+  /* run an action's error callback, or exit if it has none */
+  bool dispatch_error( const ActionID id, Result & result );
+
+  /* act on what a callback returned, returning false if the poller should exit */
+  bool handle_result( const ActionID id, const Action::Result & action_result, Result & result );
+
+  /* wait up to wait_us microseconds (-1 for no limit) and dispatch ready fds */
+  Result poll_with_poll( const int64_t wait_us );
+  Result poll_with_epoll( const int64_t wait_us );
+
+public:
+  Poller( const Backend & backend = Backend::Poll );
+
+  /* returns a handle that stays valid until the action is removed or cancelled */
+  ActionID add_action( Action action );
+
+  /* stop polling an action (it must be removed before its fd is closed) */
+  void remove_action( const ActionID id );
+
+  /* turn an action on or off without re-evaluating predicates every loop */
+  void set_active( const ActionID id, const bool active );
+
+  /* run callback delay_us from now, then every period_us if nonzero;
+     its result is handled like an action's (Cancel stops a periodic timer) */
+  TimerID add_timer( const uint64_t delay_us,
+		     const Action::CallbackType & callback,
+		     const uint64_t period_us = 0 );
+
+  /* move a pending (or currently running) timer to delay_us from now */
+  void reschedule_timer( const TimerID id, const uint64_t delay_us );
+
+  /* stop a timer; its ID becomes invalid */
+  void cancel_timer( const TimerID id );
+
+  /* will this timer still fire? */
+  bool timer_pending( const TimerID id ) const { return timer_wheel_.pending( id ); }
+
+  /* can this timer still be cancelled or rescheduled (e.g. from its own callback)? */
+  bool timer_valid( const TimerID id ) const { return timer_wheel_.valid( id ); }
+
+  /* wait for ready fds or expiring timers, or until timeout_ms passes (-1 to wait forever) */
   Result poll( const int & timeout_ms );
+
+  Backend backend( void ) const { return backend_; }
+
+  /* forbid copying Poller objects or assigning them */
+  Poller( const Poller & other ) = delete;
+  const Poller & operator=( const Poller & other ) = delete;
 };
 
 namespace PollerShortNames {
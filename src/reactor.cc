@@ -0,0 +1,142 @@
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "reactor.hh"
+#include "util.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+unsigned int ReactorPool::cpu_count( void )
+{
+  return SystemCall( "sysconf", sysconf( _SC_NPROCESSORS_ONLN ) );
+}
+
+ReactorPool::ReactorPool( const unsigned int worker_count, const bool pin_to_cpus )
+  : worker_count_( worker_count ),
+    pin_to_cpus_( pin_to_cpus ),
+    stop_fds_(),
+    stop_mutex_(),
+    error_(),
+    exit_status_( EXIT_SUCCESS ),
+    finished_( false )
+{
+  if ( worker_count == 0 ) {
+    throw runtime_error( "ReactorPool: need at least one worker" );
+  }
+}
+
+/* ask every worker to stop */
+void ReactorPool::stop( void )
+{
+  lock_guard<mutex> lock( stop_mutex_ );
+
+  const uint64_t one = 1;
+  for ( const auto & fd : stop_fds_ ) {
+    SystemCall( "write", ::write( fd->fd_num(), &one, sizeof( one ) ) );
+  }
+}
+
+/* record how a worker ended and stop the others */
+void ReactorPool::finish( const unsigned int exit_status, const exception_ptr & error )
+{
+  {
+    lock_guard<mutex> lock( stop_mutex_ );
+    if ( not finished_ ) {
+      finished_ = true;
+      exit_status_ = exit_status;
+      error_ = error;
+    }
+  }
+
+  stop();
+}
+
+/* body of each worker thread */
+void ReactorPool::work( const unsigned int index, const SetupType & setup,
+			promise<void> & setup_done )
+{
+  bool set_up = false;
+
+  try {
+    /* worker i runs on CPU i (wrapping around) */
+    if ( pin_to_cpus_ ) {
+      cpu_set_t cpus;
+      CPU_ZERO( &cpus );
+      CPU_SET( index % cpu_count(), &cpus );
+      const int ret = pthread_setaffinity_np( pthread_self(), sizeof( cpus ), &cpus );
+      if ( ret ) {
+	throw unix_error( "pthread_setaffinity_np", ret );
+      }
+    }
+
+    Worker worker( index );
+
+    /* wake up and quit when asked to stop */
+    FileDescriptor & stop_fd = *stop_fds_.at( index );
+    worker.poller().add_action( Action( stop_fd, Direction::In, [&] () {
+	  stop_fd.read();
+	  return ResultType::Exit;
+	} ) );
+
+    setup( worker );
+    set_up = true;
+    setup_done.set_value();
+
+    while ( true ) {
+      const auto ret = worker.poller().poll( -1 );
+      if ( ret.result == PollResult::Exit ) {
+	finish( ret.exit_status, nullptr );
+	return;
+      }
+    }
+  } catch ( ... ) {
+    if ( not set_up ) {
+      setup_done.set_value();
+    }
+    finish( EXIT_FAILURE, current_exception() );
+  }
+}
+
+/* run the workers until one exits (or stop() is called) */
+unsigned int ReactorPool::run( const SetupType & setup )
+{
+  {
+    lock_guard<mutex> lock( stop_mutex_ );
+    if ( not stop_fds_.empty() ) {
+      throw runtime_error( "ReactorPool: already running" );
+    }
+
+    finished_ = false;
+    error_ = nullptr;
+    for ( unsigned int i = 0; i < worker_count_; i++ ) {
+      stop_fds_.emplace_back( new FileDescriptor( SystemCall( "eventfd", eventfd( 0, EFD_CLOEXEC ) ) ) );
+    }
+  }
+
+  vector<promise<void>> setup_done( worker_count_ );
+  vector<thread> workers;
+
+  for ( unsigned int i = 0; i < worker_count_; i++ ) {
+    /* start the next worker only once this one is set up */
+    workers.emplace_back( &ReactorPool::work, this, i, cref( setup ), ref( setup_done.at( i ) ) );
+    setup_done.at( i ).get_future().wait();
+  }
+
+  for ( auto & worker : workers ) {
+    worker.join();
+  }
+
+  {
+    lock_guard<mutex> lock( stop_mutex_ );
+    stop_fds_.clear();
+  }
+
+  if ( error_ ) {
+    rethrow_exception( error_ );
+  }
+
+  return exit_status_;
+}
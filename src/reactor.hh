@@ -0,0 +1,91 @@
+#ifndef REACTOR_HH
+#define REACTOR_HH
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "poller.hh"
+
+/* Multi-reactor runtime: N worker threads, each with its own epoll
+   Poller and optionally pinned to its own CPU. Load is usually sharded
+   by having every worker open its own SO_REUSEPORT socket on the same
+   port, so the kernel spreads flows across them. */
+class ReactorPool
+{
+public:
+  /* one worker's reactor: its Poller and the objects it owns */
+  class Worker
+  {
+  private:
+    unsigned int index_;
+
+    /* destroyed after the poller (declared first) */
+    std::vector< std::shared_ptr<void> > owned_;
+
+    Poller poller_;
+
+  public:
+    Worker( const unsigned int index )
+      : index_( index ), owned_(), poller_( Poller::Backend::Epoll ) {}
+
+    unsigned int index( void ) const { return index_; }
+    Poller & poller( void ) { return poller_; }
+
+    /* construct an object (e.g. a socket) that lives as long as the worker */
+    template <typename T, typename... Args>
+    T & make( Args &&... args )
+    {
+      std::shared_ptr<T> object = std::make_shared<T>( std::forward<Args>( args )... );
+      owned_.push_back( object );
+      return *object;
+    }
+  };
+
+  /* sets up a worker's sockets, actions and timers (on the worker's thread) */
+  typedef std::function<void(Worker & worker)> SetupType;
+
+private:
+  unsigned int worker_count_;
+  bool pin_to_cpus_;
+
+  /* one eventfd per worker, written to ask it to stop */
+  std::vector< std::unique_ptr<FileDescriptor> > stop_fds_;
+  std::mutex stop_mutex_;
+
+  /* how the first worker to finish ended */
+  std::exception_ptr error_;
+  unsigned int exit_status_;
+  bool finished_;
+
+  /* body of each worker thread */
+  void work( const unsigned int index, const SetupType & setup,
+	     std::promise<void> & setup_done );
+
+  /* record how a worker ended and stop the others */
+  void finish( const unsigned int exit_status, const std::exception_ptr & error );
+
+public:
+  /* by default, one worker per online CPU */
+  ReactorPool( const unsigned int worker_count = cpu_count(), const bool pin_to_cpus = true );
+
+  /* run the workers until one exits (or stop() is called), then stop the rest;
+     setup runs on each worker in turn, so workers open their sockets in index order */
+  unsigned int run( const SetupType & setup );
+
+  /* ask every worker to stop (safe to call from any thread) */
+  void stop( void );
+
+  unsigned int worker_count( void ) const { return worker_count_; }
+
+  static unsigned int cpu_count( void );
+
+  /* forbid copying ReactorPool objects or assigning them */
+  ReactorPool( const ReactorPool & other ) = delete;
+  ReactorPool & operator=( const ReactorPool & other ) = delete;
+};
+
+#endif /* REACTOR_HH */
@@ -0,0 +1,708 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "resolver.hh"
+#include "timestamp.hh"
+#include "util.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+/* DNS wire format (RFC 1035) */
+
+static const uint16_t TYPE_A = 1, TYPE_CNAME = 5, TYPE_SOA = 6, TYPE_AAAA = 28, TYPE_OPT = 41;
+static const uint16_t CLASS_IN = 1;
+static const uint16_t FLAG_RESPONSE = 0x8000, FLAG_RECURSION_DESIRED = 0x0100;
+static const uint16_t RCODE_NO_ERROR = 0, RCODE_NAME_ERROR = 3;
+
+/* the record types we ask for, by index */
+static const uint16_t QUERY_TYPES[ 2 ] = { TYPE_A, TYPE_AAAA };
+
+/* largest reply we advertise (with EDNS) that avoids fragmentation */
+static const uint16_t EDNS_PAYLOAD_SIZE = 1232;
+
+static string lowercase( string s )
+{
+  transform( s.begin(), s.end(), s.begin(), [] ( const unsigned char c ) { return tolower( c ); } );
+  return s;
+}
+
+static void put16( string & out, const uint16_t value )
+{
+  out.push_back( value >> 8 );
+  out.push_back( value & 0xff );
+}
+
+/* append a name, as length-prefixed labels; false if it can't be one */
+static bool put_name( string & out, const string & name )
+{
+  string labels;
+
+  size_t start = 0;
+  while ( start < name.size() ) {
+    size_t end = name.find( '.', start );
+    if ( end == string::npos ) {
+      end = name.size();
+    }
+
+    const size_t length = end - start;
+    if ( length == 0 or length > 63 ) {
+      return false;
+    }
+
+    labels.push_back( length );
+    labels.append( name, start, length );
+    start = end + 1;
+  }
+  labels.push_back( 0 );
+
+  if ( labels.size() > 255 ) {
+    return false;
+  }
+
+  out.append( labels );
+  return true;
+}
+
+/* can we ask about this name? */
+static bool valid_name( const string & name )
+{
+  string scratch;
+  return put_name( scratch, name );
+}
+
+/* a query for one name and type, with an EDNS record to allow larger replies */
+static string make_query( const uint16_t id, const string & name, const uint16_t type )
+{
+  string query;
+  put16( query, id );
+  put16( query, FLAG_RECURSION_DESIRED );
+  put16( query, 1 ); /* questions */
+  put16( query, 0 ); /* answers */
+  put16( query, 0 ); /* authority records */
+  put16( query, 1 ); /* additional records */
+
+  if ( not put_name( query, name ) ) {
+    throw runtime_error( "Resolver: invalid name " + name );
+  }
+
+  put16( query, type );
+  put16( query, CLASS_IN );
+
+  /* OPT pseudo-record: root name, payload size in place of the class */
+  query.push_back( 0 );
+  put16( query, TYPE_OPT );
+  put16( query, EDNS_PAYLOAD_SIZE );
+  put16( query, 0 ); /* extended rcode and version */
+  put16( query, 0 ); /* flags */
+  put16( query, 0 ); /* no options */
+
+  return query;
+}
+
+/* bounds-checked reader for a DNS message */
+class DNSReader
+{
+private:
+  const string & message_;
+  size_t offset_;
+
+  void need( const size_t n ) const
+  {
+    if ( offset_ + n > message_.size() ) {
+      throw runtime_error( "Resolver: truncated DNS message" );
+    }
+  }
+
+public:
+  DNSReader( const string & message ) : message_( message ), offset_( 0 ) {}
+
+  uint8_t u8( void ) { need( 1 ); return message_[ offset_++ ]; }
+  uint16_t u16( void ) { const uint16_t high = u8(); return ( high << 8 ) | u8(); }
+  uint32_t u32( void ) { const uint32_t high = u16(); return ( high << 16 ) | u16(); }
+
+  void skip( const size_t n ) { need( n ); offset_ += n; }
+
+  const char * bytes( const size_t n ) { need( n ); offset_ += n; return &message_[ offset_ - n ]; }
+
+  /* read a (possibly compressed) name as dotted text */
+  string name( void )
+  {
+    string ret;
+    size_t position = offset_;
+    bool jumped = false;
+
+    /* each jump must go backwards, so this terminates */
+    size_t limit = position;
+
+    while ( true ) {
+      if ( position >= message_.size() ) {
+	throw runtime_error( "Resolver: truncated DNS name" );
+      }
+
+      const uint8_t length = message_[ position ];
+
+      if ( ( length & 0xc0 ) == 0xc0 ) {
+	if ( position + 1 >= message_.size() ) {
+	  throw runtime_error( "Resolver: truncated DNS name" );
+	}
+
+	const size_t target = ( ( length & 0x3f ) << 8 ) | uint8_t( message_[ position + 1 ] );
+	if ( target >= limit ) {
+	  throw runtime_error( "Resolver: bad DNS name compression" );
+	}
+
+	if ( not jumped ) {
+	  offset_ = position + 2;
+	  jumped = true;
+	}
+	position = limit = target;
+	continue;
+      }
+
+      if ( length & 0xc0 ) {
+	throw runtime_error( "Resolver: bad DNS label" );
+      }
+
+      if ( length == 0 ) {
+	if ( not jumped ) {
+	  offset_ = position + 1;
+	}
+	return ret;
+      }
+
+      if ( position + 1 + length > message_.size() ) {
+	throw runtime_error( "Resolver: truncated DNS name" );
+      }
+
+      if ( not ret.empty() ) {
+	ret.push_back( '.' );
+      }
+      ret.append( message_, position + 1, length );
+      position += 1 + length;
+    }
+  }
+};
+
+/* an IP address (as held by the sockets) with port 0 */
+static Address ip_address( const string & ip )
+{
+  return Address( ip, 0 );
+}
+
+/* an address with its port replaced */
+static Address with_port( const Address & address, const uint16_t port )
+{
+  sockaddr_in6 addr;
+  zero( addr );
+  memcpy( &addr, &address.to_sockaddr(), min( size_t( address.size() ), sizeof( addr ) ) );
+  addr.sin6_port = htons( port );
+  return Address( reinterpret_cast<const sockaddr &>( addr ), sizeof( addr ) );
+}
+
+static vector<Address> with_port( const vector<Address> & addresses, const uint16_t port )
+{
+  vector<Address> ret;
+  ret.reserve( addresses.size() );
+  for ( const auto & address : addresses ) {
+    ret.push_back( with_port( address, port ) );
+  }
+  return ret;
+}
+
+/* is this a numeric IPv4 or IPv6 address? */
+static bool is_numeric( const string & hostname )
+{
+  char buffer[ sizeof( in6_addr ) ];
+  return inet_pton( AF_INET, hostname.c_str(), buffer ) == 1
+    or inet_pton( AF_INET6, hostname.c_str(), buffer ) == 1;
+}
+
+/* port number from a numeric or named service */
+static uint16_t service_port( const string & service )
+{
+  if ( not service.empty() and all_of( service.begin(), service.end(), ::isdigit ) ) {
+    const unsigned long port = stoul( service );
+    if ( port > 65535 ) {
+      throw runtime_error( "Resolver: invalid port " + service );
+    }
+    return port;
+  }
+
+  /* named services come from /etc/services, which is local */
+  servent entry, *result;
+  char buffer[ 1024 ];
+  getservbyname_r( service.c_str(), nullptr, &entry, buffer, sizeof( buffer ), &result );
+  if ( not result ) {
+    throw runtime_error( "Resolver: unknown service " + service );
+  }
+
+  return ntohs( result->s_port );
+}
+
+Resolver::Lookup::Lookup( const string & s_name )
+  : name( s_name ), candidates(), candidate( 0 ),
+    query_ids(), answered(), found(),
+    ttl( -1 ), negative_ttl( DEFAULT_NEGATIVE_TTL ),
+    server( 0 ), tries( 0 ), timer( 0 ), waiters()
+{}
+
+Resolver::Resolver( Poller & poller, const string & hosts_path, const string & resolv_conf_path )
+  : poller_( poller ),
+    socket_(),
+    action_(),
+    nameservers_(),
+    search_(),
+    ndots_( 1 ),
+    timeout_ms_( 5000 ),
+    attempts_( 2 ),
+    hosts_(),
+    cache_(),
+    lookups_(),
+    queries_(),
+    random_( random_device()() ),
+    pool_( 65536, 8 ),
+    replies_()
+{
+  load_hosts( hosts_path );
+  load_resolv_conf( resolv_conf_path );
+
+  socket_.set_blocking( false );
+
+  /* only poll while queries are outstanding, so an idle resolver
+     doesn't keep the poller from exiting */
+  action_ = poller_.add_action( Action( socket_, Direction::In, [this] () {
+	while ( socket_.try_recv_batch( pool_, replies_, 8 ) ) {
+	  for ( const auto & reply : replies_ ) {
+	    try {
+	      handle_reply( reply.source_address, reply.payload.to_string() );
+	    } catch ( const runtime_error & ) {
+	      /* ignore malformed replies */
+	    }
+	  }
+	}
+	return ResultType::Continue;
+      },
+      [this] () { return not queries_.empty(); } ) );
+}
+
+Resolver::~Resolver()
+{
+  for ( const auto & lookup : lookups_ ) {
+    if ( poller_.timer_valid( lookup.second->timer ) ) {
+      poller_.cancel_timer( lookup.second->timer );
+    }
+  }
+
+  poller_.remove_action( action_ );
+}
+
+/* use these nameservers instead of those in resolv.conf */
+void Resolver::set_nameservers( const vector<Address> & nameservers )
+{
+  if ( nameservers.empty() ) {
+    throw runtime_error( "Resolver: need at least one nameserver" );
+  }
+
+  nameservers_ = nameservers;
+}
+
+/* "address name aliases..." lines, with # comments */
+void Resolver::load_hosts( const string & path )
+{
+  ifstream hosts( path );
+  string line;
+
+  while ( getline( hosts, line ) ) {
+    line = line.substr( 0, line.find( '#' ) );
+    istringstream fields( line );
+
+    string ip, name;
+    if ( not ( fields >> ip ) ) {
+      continue;
+    }
+
+    Address address;
+    try {
+      address = ip_address( ip );
+    } catch ( const exception & ) {
+      continue; /* not an address we can use */
+    }
+
+    while ( fields >> name ) {
+      auto & addresses = hosts_[ lowercase( name ) ];
+      if ( find( addresses.begin(), addresses.end(), address ) == addresses.end() ) {
+	addresses.push_back( address );
+      }
+    }
+  }
+}
+
+/* nameserver, search, domain and options lines */
+void Resolver::load_resolv_conf( const string & path )
+{
+  ifstream conf( path );
+  string line;
+
+  while ( getline( conf, line ) ) {
+    line = line.substr( 0, line.find_first_of( "#;" ) );
+    istringstream fields( line );
+
+    string keyword, value;
+    if ( not ( fields >> keyword ) ) {
+      continue;
+    }
+
+    if ( keyword == "nameserver" and fields >> value ) {
+      try {
+	nameservers_.push_back( Address( value, 53 ) );
+      } catch ( const exception & ) {
+	/* skip unusable entries */
+      }
+    } else if ( keyword == "search" or keyword == "domain" ) {
+      search_.clear();
+      while ( fields >> value ) {
+	search_.push_back( lowercase( value ) );
+      }
+    } else if ( keyword == "options" ) {
+      while ( fields >> value ) {
+	const size_t colon = value.find( ':' );
+	if ( colon == string::npos ) {
+	  continue;
+	}
+
+	const string option = value.substr( 0, colon );
+	const unsigned int number = strtoul( value.c_str() + colon + 1, nullptr, 10 );
+	if ( option == "ndots" ) {
+	  ndots_ = number;
+	} else if ( option == "timeout" and number > 0 ) {
+	  timeout_ms_ = number * 1000;
+	} else if ( option == "attempts" and number > 0 ) {
+	  attempts_ = number;
+	}
+      }
+    }
+  }
+
+  /* the same default as the C library */
+  if ( nameservers_.empty() ) {
+    nameservers_.push_back( Address( "127.0.0.1", 53 ) );
+  }
+}
+
+/* call back later (from the poller), as if from a lookup */
+void Resolver::answer_later( const vector<Address> & addresses, const uint16_t port,
+			     const CallbackType & callback )
+{
+  const vector<Address> answer = with_port( addresses, port );
+  poller_.add_timer( 0, [answer, callback] () {
+      callback( answer );
+      return ResultType::Continue;
+    } );
+}
+
+/* look up hostname and service */
+void Resolver::resolve( const string & hostname, const string & service,
+			const CallbackType & callback )
+{
+  const uint16_t port = service_port( service );
+
+  if ( is_numeric( hostname ) ) {
+    answer_later( { ip_address( hostname ) }, port, callback );
+    return;
+  }
+
+  string name = lowercase( hostname );
+
+  /* the hosts file */
+  const auto host = hosts_.find( name );
+  if ( host != hosts_.end() ) {
+    answer_later( host->second, port, callback );
+    return;
+  }
+
+  /* the cache (of answers and failures) */
+  const auto cached = cache_.find( name );
+  if ( cached != cache_.end() ) {
+    if ( cached->second.expiry_us > timestamp_us() ) {
+      answer_later( cached->second.addresses, port, callback );
+      return;
+    }
+    cache_.erase( cached );
+  }
+
+  /* join a lookup already under way */
+  const auto under_way = lookups_.find( name );
+  if ( under_way != lookups_.end() ) {
+    under_way->second->waiters.emplace_back( port, callback );
+    return;
+  }
+
+  unique_ptr<Lookup> lookup( new Lookup( name ) );
+
+  /* names with a trailing dot are absolute; otherwise try the search
+     list first if the name has fewer than ndots dots, and last if not */
+  if ( not name.empty() and name.back() == '.' ) {
+    lookup->candidates.push_back( name.substr( 0, name.size() - 1 ) );
+  } else {
+    vector<string> searched;
+    for ( const auto & domain : search_ ) {
+      searched.push_back( name + "." + domain );
+    }
+
+    if ( size_t( count( name.begin(), name.end(), '.' ) ) >= ndots_ ) {
+      lookup->candidates.push_back( name );
+      lookup->candidates.insert( lookup->candidates.end(), searched.begin(), searched.end() );
+    } else {
+      lookup->candidates = searched;
+      lookup->candidates.push_back( name );
+    }
+  }
+
+  /* (a search domain can make a name too long to ask about) */
+  lookup->candidates.erase( remove_if( lookup->candidates.begin(), lookup->candidates.end(),
+				       [] ( const string & candidate ) { return not valid_name( candidate ); } ),
+			    lookup->candidates.end() );
+  if ( lookup->candidates.empty() ) {
+    throw runtime_error( "Resolver: invalid name " + hostname );
+  }
+
+  lookup->waiters.emplace_back( port, callback );
+  Lookup * const pending = lookup.get();
+  lookups_[ name ] = move( lookup );
+
+  pending->timer = poller_.add_timer( timeout_ms_ * 1000, [this, pending] () {
+      retry( *pending );
+      return ResultType::Continue;
+    } );
+
+  send_queries( *pending );
+}
+
+/* ask the current nameserver about the current candidate */
+void Resolver::send_queries( Lookup & lookup )
+{
+  forget_queries( lookup );
+
+  const string & name = lookup.candidates.at( lookup.candidate );
+  const Address & server = nameservers_.at( lookup.server );
+
+  for ( unsigned int i = 0; i < 2; i++ ) {
+    if ( lookup.answered[ i ] ) {
+      continue;
+    }
+
+    /* a fresh random ID for every query */
+    uint16_t id;
+    do {
+      id = random_();
+    } while ( id == 0 or queries_.count( id ) );
+
+    lookup.query_ids[ i ] = id;
+    queries_[ id ] = &lookup;
+
+    /* (a query the send buffer has no room for, or the network won't
+       take now, is as good as lost; the timer will try again, and fail
+       the lookup from the poller once it runs out of tries) */
+    try {
+      socket_.try_sendto( server, make_query( id, name, QUERY_TYPES[ i ] ) );
+    } catch ( const unix_error & ) {
+      /* (lost, as above) */
+    }
+  }
+
+  poller_.reschedule_timer( lookup.timer, timeout_ms_ * 1000 );
+}
+
+/* forget a lookup's outstanding query IDs */
+void Resolver::forget_queries( Lookup & lookup )
+{
+  for ( auto & id : lookup.query_ids ) {
+    if ( id ) {
+      queries_.erase( id );
+      id = 0;
+    }
+  }
+}
+
+/* give up on the current nameserver and ask the next one (or fail) */
+void Resolver::retry( Lookup & lookup )
+{
+  lookup.tries++;
+  if ( lookup.tries >= attempts_ * nameservers_.size() ) {
+    /* an unreachable nameserver isn't an answer, so don't cache it */
+    finish( lookup, {} );
+    return;
+  }
+
+  lookup.server = ( lookup.server + 1 ) % nameservers_.size();
+  send_queries( lookup );
+}
+
+/* handle one reply from a nameserver */
+void Resolver::handle_reply( const Address & source, const string & reply )
+{
+  DNSReader reader( reply );
+
+  const uint16_t id = reader.u16();
+  const auto query = queries_.find( id );
+  if ( query == queries_.end() ) {
+    return;
+  }
+
+  Lookup & lookup = *query->second;
+  const unsigned int type_index = lookup.query_ids[ 0 ] == id ? 0 : 1;
+  const uint16_t type = QUERY_TYPES[ type_index ];
+
+  /* only accept the reply from the server we asked, to the question we asked */
+  if ( source != nameservers_.at( lookup.server ) ) {
+    return;
+  }
+
+  const uint16_t flags = reader.u16();
+  const uint16_t question_count = reader.u16();
+  const uint16_t answer_count = reader.u16();
+  const uint16_t authority_count = reader.u16();
+  reader.u16(); /* additional records */
+
+  if ( not ( flags & FLAG_RESPONSE ) or question_count != 1 ) {
+    return;
+  }
+
+  if ( lowercase( reader.name() ) != lookup.candidates.at( lookup.candidate )
+       or reader.u16() != type
+       or reader.u16() != CLASS_IN ) {
+    return;
+  }
+
+  const uint16_t rcode = flags & 0xf;
+  if ( rcode != RCODE_NO_ERROR and rcode != RCODE_NAME_ERROR ) {
+    /* e.g. SERVFAIL or REFUSED: another server may do better */
+    retry( lookup );
+    return;
+  }
+
+  /* the records of the type we asked for (following any CNAMEs) */
+  vector<Address> found;
+  uint32_t ttl = -1;
+
+  for ( unsigned int i = 0; i < answer_count; i++ ) {
+    reader.name();
+    const uint16_t record_type = reader.u16();
+    const uint16_t record_class = reader.u16();
+    const uint32_t record_ttl = reader.u32();
+    const uint16_t length = reader.u16();
+    const char * const data = reader.bytes( length );
+
+    if ( record_class != CLASS_IN ) {
+      continue;
+    }
+
+    if ( record_type == TYPE_A and type == TYPE_A and length == 4 ) {
+      char text[ INET_ADDRSTRLEN ];
+      inet_ntop( AF_INET, data, text, sizeof( text ) );
+      found.push_back( ip_address( text ) );
+    } else if ( record_type == TYPE_AAAA and type == TYPE_AAAA and length == 16 ) {
+      sockaddr_in6 addr;
+      zero( addr );
+      addr.sin6_family = AF_INET6;
+      memcpy( &addr.sin6_addr, data, 16 );
+      found.push_back( Address( reinterpret_cast<const sockaddr &>( addr ), sizeof( addr ) ) );
+    } else if ( record_type != TYPE_CNAME ) {
+      continue;
+    }
+
+    ttl = min( ttl, record_ttl );
+  }
+
+  /* a negative answer lasts as long as the zone's SOA says (RFC 2308) */
+  if ( found.empty() ) {
+    for ( unsigned int i = 0; i < authority_count; i++ ) {
+      reader.name();
+      const uint16_t record_type = reader.u16();
+      reader.u16();
+      const uint32_t record_ttl = reader.u32();
+      const uint16_t length = reader.u16();
+
+      if ( record_type != TYPE_SOA ) {
+	reader.skip( length );
+	continue;
+      }
+
+      reader.name(); /* primary nameserver */
+      reader.name(); /* responsible mailbox */
+      reader.skip( 16 ); /* serial, refresh, retry, expire */
+      const uint32_t minimum = reader.u32();
+      lookup.negative_ttl = min( record_ttl, minimum );
+      break;
+    }
+  }
+
+  lookup.found[ type_index ] = found;
+  lookup.ttl = min( lookup.ttl, ttl );
+  lookup.answered[ type_index ] = true;
+  queries_.erase( id );
+  lookup.query_ids[ type_index ] = 0;
+
+  /* a nonexistent name has no records of any type */
+  if ( rcode == RCODE_NAME_ERROR ) {
+    lookup.answered[ 0 ] = lookup.answered[ 1 ] = true;
+    forget_queries( lookup );
+  }
+
+  if ( lookup.answered[ 0 ] and lookup.answered[ 1 ] ) {
+    candidate_done( lookup );
+  }
+}
+
+/* both types answered for the current candidate: succeed, or move on */
+void Resolver::candidate_done( Lookup & lookup )
+{
+  /* IPv4 first, as the sockets reach it (v4-mapped) everywhere */
+  vector<Address> addresses = lookup.found[ 0 ];
+  addresses.insert( addresses.end(), lookup.found[ 1 ].begin(), lookup.found[ 1 ].end() );
+
+  if ( not addresses.empty() ) {
+    cache_[ lookup.name ] = CacheEntry( addresses, timestamp_us() + uint64_t( lookup.ttl ) * 1000000 );
+    finish( lookup, addresses );
+    return;
+  }
+
+  if ( lookup.candidate + 1 < lookup.candidates.size() ) {
+    lookup.candidate++;
+    lookup.answered[ 0 ] = lookup.answered[ 1 ] = false;
+    lookup.found[ 0 ].clear();
+    lookup.found[ 1 ].clear();
+    lookup.tries = 0;
+    send_queries( lookup );
+    return;
+  }
+
+  cache_[ lookup.name ] = CacheEntry( {}, timestamp_us() + uint64_t( lookup.negative_ttl ) * 1000000 );
+  finish( lookup, {} );
+}
+
+/* stop the lookup and hand the addresses to its waiters */
+void Resolver::finish( Lookup & lookup, const vector<Address> & addresses )
+{
+  forget_queries( lookup );
+
+  if ( poller_.timer_pending( lookup.timer ) ) {
+    poller_.cancel_timer( lookup.timer );
+  }
+
+  /* take the lookup out first, since a callback may start another */
+  const auto it = lookups_.find( lookup.name );
+  const unique_ptr<Lookup> done = move( it->second );
+  lookups_.erase( it );
+
+  for ( const auto & waiter : done->waiters ) {
+    waiter.second( with_port( addresses, waiter.first ) );
+  }
+}
@@ -0,0 +1,136 @@
+#ifndef RESOLVER_HH
+#define RESOLVER_HH
+
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "address.hh"
+#include "buffer_pool.hh"
+#include "poller.hh"
+#include "socket.hh"
+
+/* Non-blocking DNS resolver driven by a Poller. Names are answered from
+   the hosts file, then from a cache that honors record TTLs (and caches
+   failures, per RFC 2308), then by querying the nameservers from
+   resolv.conf over UDP for A and AAAA records at once. Concurrent
+   lookups of the same name share one set of queries. */
+class Resolver
+{
+public:
+  /* receives the addresses found (with the requested port),
+     or none if the name does not resolve */
+  typedef std::function<void(const std::vector<Address> & addresses)> CallbackType;
+
+private:
+  /* how long to cache a failure when the nameserver gives no SOA record */
+  static const uint32_t DEFAULT_NEGATIVE_TTL = 30;
+
+  /* addresses (with port 0), and when they expire (in timestamp_us() time) */
+  struct CacheEntry
+  {
+    std::vector<Address> addresses;
+    uint64_t expiry_us;
+
+    CacheEntry( const std::vector<Address> & s_addresses = {}, const uint64_t s_expiry_us = 0 )
+      : addresses( s_addresses ), expiry_us( s_expiry_us ) {}
+  };
+
+  /* one name being looked up, and everyone waiting for it */
+  struct Lookup
+  {
+    std::string name;
+
+    /* fully-qualified names to try in turn (per the search list) */
+    std::vector<std::string> candidates;
+    size_t candidate;
+
+    /* outstanding query IDs (0 once answered), for A and AAAA */
+    uint16_t query_ids[ 2 ];
+    bool answered[ 2 ];
+
+    /* what the current candidate's answers have found */
+    std::vector<Address> found[ 2 ];
+    uint32_t ttl, negative_ttl;
+
+    /* which nameserver was asked, and how many times we have asked */
+    size_t server;
+    unsigned int tries;
+    Poller::TimerID timer;
+
+    std::vector< std::pair<uint16_t, CallbackType> > waiters;
+
+    Lookup( const std::string & s_name );
+  };
+
+  Poller & poller_;
+  UDPSocket socket_;
+  Poller::ActionID action_;
+
+  std::vector<Address> nameservers_;
+  std::vector<std::string> search_;
+  unsigned int ndots_, timeout_ms_, attempts_;
+
+  std::unordered_map< std::string, std::vector<Address> > hosts_;
+  std::unordered_map< std::string, CacheEntry > cache_;
+
+  std::unordered_map< std::string, std::unique_ptr<Lookup> > lookups_;
+  std::unordered_map< uint16_t, Lookup * > queries_;
+
+  std::mt19937 random_;
+
+  BufferPool pool_;
+  std::vector<UDPSocket::received_datagram_view> replies_;
+
+  void load_hosts( const std::string & path );
+  void load_resolv_conf( const std::string & path );
+
+  /* ask the current nameserver about the current candidate (unanswered types only) */
+  void send_queries( Lookup & lookup );
+
+  /* give up on the current nameserver and ask the next one (or fail) */
+  void retry( Lookup & lookup );
+
+  /* handle one reply from a nameserver */
+  void handle_reply( const Address & source, const std::string & reply );
+
+  /* both types answered for the current candidate: succeed, or move on */
+  void candidate_done( Lookup & lookup );
+
+  /* stop the lookup and hand the addresses to its waiters */
+  void finish( Lookup & lookup, const std::vector<Address> & addresses );
+
+  /* forget a lookup's outstanding query IDs */
+  void forget_queries( Lookup & lookup );
+
+  /* call back later (from the poller), as if from a lookup */
+  void answer_later( const std::vector<Address> & addresses, const uint16_t port,
+		     const CallbackType & callback );
+
+public:
+  Resolver( Poller & poller,
+	    const std::string & hosts_path = "/etc/hosts",
+	    const std::string & resolv_conf_path = "/etc/resolv.conf" );
+
+  /* look up hostname (or a numeric IP address) and service (or port number);
+     the callback always runs later, from the poller (and never, if this
+     throws because hostname isn't a name that can be looked up) */
+  void resolve( const std::string & hostname, const std::string & service,
+		const CallbackType & callback );
+
+  /* stops polling and abandons lookups under way (without calling back) */
+  ~Resolver();
+
+  /* use these nameservers instead of those in resolv.conf (e.g. a local stub) */
+  void set_nameservers( const std::vector<Address> & nameservers );
+
+  /* forget cached answers (but not the hosts file) */
+  void clear_cache( void ) { cache_.clear(); }
+
+  size_t cache_size( void ) const { return cache_.size(); }
+};
+
+#endif /* RESOLVER_HH */
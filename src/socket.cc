@@ -1,4 +1,9 @@
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
 
 #include "socket.hh"
 #include "util.hh"
@@ -75,101 +80,659 @@ void Socket::connect( const Address & address )
 				    address.size() ) );
 }
 
-/* receive datagram and where it came from */
-UDPSocket::received_datagram UDPSocket::recv( void )
+/* make sure a received message holds the whole datagram */
+static void check_received_flags( const msghdr & header )
 {
-  static const ssize_t RECEIVE_MTU = 65536;
+  if ( header.msg_flags & MSG_TRUNC ) {
+    throw runtime_error( "recvfrom (oversized datagram)" );
+  } else if ( header.msg_flags ) {
+    throw runtime_error( "recvfrom (unhandled flag)" );
+  }
+}
 
-  /* receive source address, timestamp and payload */
-  Address::raw datagram_source_address;
-  msghdr header; zero( header );
-  iovec msg_iovec; zero( msg_iovec );
+/* find the timestamp and GRO segment size of a received message (if present) */
+static void read_control_messages( msghdr & header, uint64_t & timestamp,
+				   size_t & segment_size )
+{
+  timestamp = -1;
+  segment_size = 0;
+
+  cmsghdr *hdr = CMSG_FIRSTHDR( &header );
+  while ( hdr ) {
+    if ( hdr->cmsg_level == SOL_SOCKET
+	 and hdr->cmsg_type == SO_TIMESTAMPNS ) {
+      const timespec * const kernel_time = reinterpret_cast<timespec *>( CMSG_DATA( hdr ) );
+      timestamp = timestamp_us( *kernel_time );
+    } else if ( hdr->cmsg_level == SOL_UDP
+		and hdr->cmsg_type == UDP_GRO ) {
+      segment_size = *reinterpret_cast<const int *>( CMSG_DATA( hdr ) );
+    }
+    hdr = CMSG_NXTHDR( &header, hdr );
+  }
+}
 
-  char msg_payload[ RECEIVE_MTU ];
-  char msg_control[ RECEIVE_MTU ];
+/* point header at this slot (for the source address and control messages)
+   and at the payload buffer */
+void UDPSocket::receive_slot::prepare( msghdr & header, BufferPool::Buffer & payload )
+{
+  zero( header );
 
   /* prepare to get the source address */
-  header.msg_name = &datagram_source_address;
-  header.msg_namelen = sizeof( datagram_source_address );
+  header.msg_name = &source_address;
+  header.msg_namelen = sizeof( source_address );
 
   /* prepare to get the payload */
-  msg_iovec.iov_base = msg_payload;
-  msg_iovec.iov_len = sizeof( msg_payload );
-  header.msg_iov = &msg_iovec;
+  payload_iovec.iov_base = payload.data();
+  payload_iovec.iov_len = payload.capacity();
+  header.msg_iov = &payload_iovec;
   header.msg_iovlen = 1;
 
   /* prepare to get the timestamp */
-  header.msg_control = msg_control;
-  header.msg_controllen = sizeof( msg_control );
+  header.msg_control = control;
+  header.msg_controllen = sizeof( control );
+}
+
+/* fill in a received datagram from a completed receive */
+void UDPSocket::finish_receive( msghdr & header, const size_t length,
+				received_datagram_view & datagram )
+{
+  check_received_flags( header );
+
+  datagram.source_address = Address( *static_cast<const Address::raw *>( header.msg_name ),
+				     header.msg_namelen );
+  read_control_messages( header, datagram.timestamp, datagram.segment_size );
+  datagram.payload.resize( length );
+
+  /* a lone datagram is not coalesced, whatever the kernel reports */
+  if ( datagram.segment_size >= length ) {
+    datagram.segment_size = 0;
+  }
+}
+
+/* number of datagrams coalesced into the payload */
+size_t UDPSocket::received_datagram_view::segment_count( void ) const
+{
+  if ( segment_size == 0 ) {
+    return 1;
+  }
+
+  return ( payload.size() + segment_size - 1 ) / segment_size;
+}
+
+/* payload of one of the coalesced datagrams */
+string UDPSocket::received_datagram_view::segment( const size_t index ) const
+{
+  if ( index >= segment_count() ) {
+    throw out_of_range( "received_datagram_view::segment" );
+  }
+
+  if ( segment_size == 0 ) {
+    return payload.to_string();
+  }
+
+  const size_t offset = index * segment_size;
+  return string( payload.data() + offset, min( segment_size, payload.size() - offset ) );
+}
+
+/* payload of one of the coalesced datagrams, in place */
+iovec UDPSocket::received_datagram_view::segment_iovec( const size_t index )
+{
+  if ( index >= segment_count() ) {
+    throw out_of_range( "received_datagram_view::segment_iovec" );
+  }
+
+  if ( segment_size == 0 ) {
+    return { payload.data(), payload.size() };
+  }
+
+  const size_t offset = index * segment_size;
+  return { payload.data() + offset, min( segment_size, payload.size() - offset ) };
+}
+
+/* receive datagram and where it came from, into a buffer from the pool */
+UDPSocket::received_datagram_view UDPSocket::recv( BufferPool & pool )
+{
+  /* receive source address, timestamp and payload */
+  received_datagram_view ret;
+  ret.payload = pool.acquire();
+
+  receive_slot slot;
+  msghdr header;
+  slot.prepare( header, ret.payload );
 
   /* call recvmsg */
   ssize_t recv_len = SystemCall( "recvmsg",
-				 recvmsg( fd_num(), &header, 0 ) );
+				 ::recvmsg( fd_num(), &header, 0 ) );
 
   register_read();
 
-  /* make sure we got the whole datagram */
-  if ( header.msg_flags & MSG_TRUNC ) {
-    throw runtime_error( "recvfrom (oversized datagram)" );
-  } else if ( header.msg_flags ) {
-    throw runtime_error( "recvfrom (unhandled flag)" );
+  finish_receive( header, recv_len, ret );
+
+  return ret;
+}
+
+/* receive datagram and where it came from */
+UDPSocket::received_datagram UDPSocket::recv( void )
+{
+  const received_datagram_view datagram = recv( receive_pool_ );
+
+  received_datagram ret = { datagram.source_address,
+			    datagram.timestamp,
+			    datagram.payload.to_string(),
+			    datagram.segment_size };
+
+  return ret;
+}
+
+/* receive up to max_datagrams in one syscall, into buffers from the pool */
+IOResult<size_t> UDPSocket::receive_batch( BufferPool & pool,
+					   vector<received_datagram_view> & datagrams,
+					   const unsigned int max_datagrams,
+					   const int flags )
+{
+  if ( max_datagrams == 0 ) {
+    throw runtime_error( "recv_batch: max_datagrams must be positive" );
   }
 
-  uint64_t timestamp = -1;
+  /* grow the reusable storage if necessary */
+  if ( batch_slots_.size() < max_datagrams ) {
+    batch_slots_.resize( max_datagrams );
+    batch_headers_.resize( max_datagrams );
+  }
+  datagrams.resize( max_datagrams );
 
-  /* find the timestamp header (if there is one) */
-  cmsghdr *ts_hdr = CMSG_FIRSTHDR( &header );
-  while ( ts_hdr ) {
-    if ( ts_hdr->cmsg_level == SOL_SOCKET
-	 and ts_hdr->cmsg_type == SO_TIMESTAMPNS ) {
-      const timespec * const kernel_time = reinterpret_cast<timespec *>( CMSG_DATA( ts_hdr ) );
-      timestamp = timestamp_ms( *kernel_time );
+  /* prepare each header to get the source address, payload and timestamp */
+  for ( unsigned int i = 0; i < max_datagrams; i++ ) {
+    if ( datagrams[ i ].payload.capacity() == 0 ) {
+      datagrams[ i ].payload = pool.acquire();
     }
-    ts_hdr = CMSG_NXTHDR( &header, ts_hdr );
+
+    zero( batch_headers_[ i ] );
+    batch_slots_[ i ].prepare( batch_headers_[ i ].msg_hdr, datagrams[ i ].payload );
+  }
+
+  /* call recvmmsg */
+  const auto count = NonBlockingSystemCall( "recvmmsg",
+					    recvmmsg( fd_num(), &batch_headers_[ 0 ], max_datagrams,
+						      flags, nullptr ) );
+
+  register_read();
+
+  if ( not count ) {
+    datagrams.clear();
+    return WouldBlock();
   }
 
-  received_datagram ret = { Address( datagram_source_address,
-				     header.msg_namelen ),
-			    timestamp,
-			    string( msg_payload, recv_len ) };
+  /* give the unused buffers back */
+  datagrams.resize( count.value() );
+
+  for ( int i = 0; i < count.value(); i++ ) {
+    finish_receive( batch_headers_[ i ].msg_hdr, batch_headers_[ i ].msg_len, datagrams[ i ] );
+  }
+
+  return size_t( count.value() );
+}
+
+/* receive up to max_datagrams in one syscall, blocking (on a blocking socket)
+   only until the first datagram arrives */
+void UDPSocket::recv_batch( BufferPool & pool,
+			    vector<received_datagram_view> & datagrams,
+			    const unsigned int max_datagrams )
+{
+  receive_batch( pool, datagrams, max_datagrams, MSG_WAITFORONE );
+}
+
+/* receive whatever is pending, up to max_datagrams, without blocking */
+IOResult<size_t> UDPSocket::try_recv_batch( BufferPool & pool,
+					    vector<received_datagram_view> & datagrams,
+					    const unsigned int max_datagrams )
+{
+  return receive_batch( pool, datagrams, max_datagrams, MSG_DONTWAIT );
+}
+
+/* receive up to max_datagrams in one syscall */
+vector<UDPSocket::received_datagram> UDPSocket::recv_batch( const unsigned int max_datagrams )
+{
+  vector<received_datagram_view> datagrams;
+  recv_batch( receive_pool_, datagrams, max_datagrams );
+
+  vector<received_datagram> ret;
+  ret.reserve( datagrams.size() );
+
+  for ( const auto & datagram : datagrams ) {
+    ret.push_back( { datagram.source_address,
+		     datagram.timestamp,
+		     datagram.payload.to_string(),
+		     datagram.segment_size } );
+  }
+
+  return ret;
+}
+
+/* receive one datagram scattered across the caller's buffers */
+UDPSocket::received_header UDPSocket::recvmsg( const iovec * iov, const size_t count )
+{
+  Address::raw source_address;
+  char control[ CONTROL_SIZE ];
+
+  msghdr header;
+  zero( header );
+  header.msg_name = &source_address;
+  header.msg_namelen = sizeof( source_address );
+  header.msg_iov = const_cast<iovec *>( iov );
+  header.msg_iovlen = count;
+  header.msg_control = control;
+  header.msg_controllen = sizeof( control );
+
+  const ssize_t recv_len = SystemCall( "recvmsg",
+				       ::recvmsg( fd_num(), &header, 0 ) );
+
+  register_read();
+
+  check_received_flags( header );
+
+  received_header ret = { Address( source_address, header.msg_namelen ), 0, size_t( recv_len ), 0 };
+  read_control_messages( header, ret.timestamp, ret.segment_size );
+
+  if ( ret.segment_size >= ret.length ) {
+    ret.segment_size = 0;
+  }
 
   return ret;
 }
 
+/* a header for one datagram gathered from iov, to destination (or to the
+   connected address, if destination is null) */
+static msghdr datagram_header( const Address * destination, const iovec * iov, const size_t count )
+{
+  msghdr header;
+  zero( header );
+  if ( destination ) {
+    header.msg_name = const_cast<sockaddr *>( &destination->to_sockaddr() );
+    header.msg_namelen = destination->size();
+  }
+  header.msg_iov = const_cast<iovec *>( iov );
+  header.msg_iovlen = count;
+  return header;
+}
+
 /* send datagram to specified address */
 void UDPSocket::sendto( const Address & destination, const string & payload )
 {
-  const ssize_t bytes_sent =
-    SystemCall( "sendto", ::sendto( fd_num(),
-				    payload.data(),
-				    payload.size(),
-				    0,
-				    &destination.to_sockaddr(),
-				    destination.size() ) );
+  iovec payload_iovec = { const_cast<char *>( payload.data() ), payload.size() };
+  send_one( datagram_header( &destination, &payload_iovec, 1 ), "sendto" );
+}
+
+IOResult<size_t> UDPSocket::try_sendto( const Address & destination, const string & payload )
+{
+  iovec payload_iovec = { const_cast<char *>( payload.data() ), payload.size() };
+  return try_send_one( datagram_header( &destination, &payload_iovec, 1 ), "sendto" );
+}
+
+/* send datagram to connected address */
+void UDPSocket::send( const string & payload )
+{
+  iovec payload_iovec = { const_cast<char *>( payload.data() ), payload.size() };
+  send_one( datagram_header( nullptr, &payload_iovec, 1 ), "send" );
+}
+
+/* how many datagrams the kernel makes of a sent message (of length bytes) */
+static size_t datagrams_in( const msghdr & header, const size_t length )
+{
+  for ( const cmsghdr * control = CMSG_FIRSTHDR( &header );
+	control;
+	control = CMSG_NXTHDR( const_cast<msghdr *>( &header ), const_cast<cmsghdr *>( control ) ) ) {
+    if ( control->cmsg_level == SOL_UDP and control->cmsg_type == UDP_SEGMENT ) {
+      const size_t segment_size = *reinterpret_cast<const uint16_t *>( CMSG_DATA( control ) );
+      return length ? ( length + segment_size - 1 ) / segment_size : 1;
+    }
+  }
+
+  return 1;
+}
+
+/* remember a sent message (of datagram_count datagrams) for its transmit timestamp */
+void UDPSocket::note_sent( const size_t datagram_count )
+{
+  if ( not transmit_timestamps_ ) {
+    return;
+  }
+
+  /* forget the oldest if timestamps are not being read */
+  if ( unstamped_messages_.size() == MAX_UNSTAMPED_MESSAGES ) {
+    unstamped_messages_.pop_front();
+    first_unstamped_message_++;
+  }
+
+  unstamped_messages_.push_back( datagrams_sent_ );
+  datagrams_sent_ += datagram_count;
+}
+
+/* send a prepared header with sendmsg, returning how many datagrams
+   that made (WouldBlock if the send buffer is full) */
+IOResult<size_t> UDPSocket::try_send_one( const msghdr & header, const string & name_of_function )
+{
+  size_t length = 0;
+  for ( size_t i = 0; i < header.msg_iovlen; i++ ) {
+    length += header.msg_iov[ i ].iov_len;
+  }
+
+  const IOResult<int> bytes_sent = NonBlockingSystemCall( name_of_function, ::sendmsg( fd_num(), &header, 0 ) );
+  if ( not bytes_sent ) {
+    return WouldBlock();
+  }
 
   register_write();
 
-  if ( size_t( bytes_sent ) != payload.size() ) {
-    throw runtime_error( "datagram payload too big for sendto()" );
+  if ( size_t( bytes_sent.value() ) != length ) {
+    throw runtime_error( "datagram payload too big for " + name_of_function + "()" );
   }
+
+  const size_t datagram_count = datagrams_in( header, length );
+  note_sent( datagram_count );
+  return datagram_count;
 }
 
-/* send datagram to connected address */
-void UDPSocket::send( const string & payload )
+/* same, where a full send buffer (on a non-blocking socket) is an error */
+void UDPSocket::send_one( const msghdr & header, const string & name_of_function )
+{
+  if ( not try_send_one( header, name_of_function ) ) {
+    throw unix_error( name_of_function, EAGAIN );
+  }
+}
+
+/* send one datagram to specified address, gathered from several buffers */
+void UDPSocket::sendmsg( const Address & destination, const iovec * iov, const size_t count )
+{
+  send_one( datagram_header( &destination, iov, count ), "sendmsg" );
+}
+
+/* send one datagram to connected address, gathered from several buffers */
+void UDPSocket::sendmsg( const iovec * iov, const size_t count )
 {
-  const ssize_t bytes_sent =
-    SystemCall( "send", ::send( fd_num(),
-				payload.data(),
-				payload.size(),
-				0 ) );
+  send_one( datagram_header( nullptr, iov, count ), "sendmsg" );
+}
+
+IOResult<size_t> UDPSocket::try_sendmsg( const iovec * iov, const size_t count )
+{
+  return try_send_one( datagram_header( nullptr, iov, count ), "sendmsg" );
+}
+
+/* send prepared headers with sendmmsg, from first on, as many as the send
+   buffer takes; returns how many messages were sent (0 if it was full),
+   adding how many datagrams they made to datagram_count */
+/* split the sends from first on into one header per datagram, each
+   gathered from an equal share of its send's iovecs */
+static void split_segments( vector<mmsghdr> & headers, const size_t first )
+{
+  vector<mmsghdr> split;
+
+  for ( size_t i = first; i < headers.size(); i++ ) {
+    const msghdr & run = headers[ i ].msg_hdr;
+
+    size_t length = 0;
+    for ( size_t j = 0; j < run.msg_iovlen; j++ ) {
+      length += run.msg_iov[ j ].iov_len;
+    }
+
+    const size_t count = datagrams_in( run, length );
+    const size_t iovecs_per_datagram = run.msg_iovlen / count;
+    for ( size_t j = 0; j < count; j++ ) {
+      split.emplace_back();
+      zero( split.back() );
+      split.back().msg_hdr.msg_name = run.msg_name;
+      split.back().msg_hdr.msg_namelen = run.msg_namelen;
+      split.back().msg_hdr.msg_iov = run.msg_iov + j * iovecs_per_datagram;
+      split.back().msg_hdr.msg_iovlen = iovecs_per_datagram;
+    }
+  }
+
+  headers.resize( first );
+  headers.insert( headers.end(), split.begin(), split.end() );
+}
+
+size_t UDPSocket::send_headers( vector<mmsghdr> & headers, const size_t first,
+				const string & name_of_function, size_t & datagram_count )
+{
+  IOResult<int> result = WouldBlock();
+  try {
+    result = NonBlockingSystemCall( name_of_function,
+				    sendmmsg( fd_num(), &headers[ first ], headers.size() - first, 0 ) );
+  } catch ( const unix_error & e ) {
+    /* without UDP GSO (EINVAL or EIO), or with segments too big for the
+       path's MTU (EINVAL or EMSGSIZE, though plain datagrams that size
+       would be fragmented), the kernel refuses a segmented send outright;
+       from then on, send every datagram on its own */
+    const int error = e.code().value();
+    if ( not gso_ or headers[ first ].msg_hdr.msg_controllen == 0 /* (not segmented) */
+	 or ( error != EINVAL and error != EIO and error != EMSGSIZE ) ) {
+      throw;
+    }
+
+    gso_ = false;
+    split_segments( headers, first );
+    return send_headers( headers, first, name_of_function, datagram_count );
+  }
+
+  if ( not result ) {
+    return 0;
+  }
 
   register_write();
 
-  if ( size_t( bytes_sent ) != payload.size() ) {
-    throw runtime_error( "datagram payload too big for send()" );
+  const int count = result.value();
+
+  for ( int i = 0; i < count; i++ ) {
+    const mmsghdr & entry = headers[ first + i ];
+
+    size_t length = 0;
+    for ( size_t j = 0; j < entry.msg_hdr.msg_iovlen; j++ ) {
+      length += entry.msg_hdr.msg_iov[ j ].iov_len;
+    }
+
+    if ( entry.msg_len != length ) {
+      throw runtime_error( "datagram payload too big for " + name_of_function + "()" );
+    }
+
+    const size_t datagrams = datagrams_in( entry.msg_hdr, length );
+    note_sent( datagrams );
+    datagram_count += datagrams;
+  }
+
+  return count;
+}
+
+/* send prepared headers with sendmmsg until all are sent (a full send
+   buffer on a non-blocking socket is an error) */
+void UDPSocket::send_all( vector<mmsghdr> & headers, const string & name_of_function )
+{
+  size_t sent = 0, datagram_count = 0;
+
+  while ( sent < headers.size() ) {
+    const size_t count = send_headers( headers, sent, name_of_function, datagram_count );
+    if ( count == 0 ) {
+      throw unix_error( name_of_function, EAGAIN );
+    }
+    sent += count;
   }
 }
 
+/* same, but stop when the send buffer is full, returning how many
+   datagrams were sent (WouldBlock if none) */
+IOResult<size_t> UDPSocket::try_send_all( vector<mmsghdr> & headers, const string & name_of_function )
+{
+  size_t sent = 0, datagram_count = 0;
+
+  while ( sent < headers.size() ) {
+    const size_t count = send_headers( headers, sent, name_of_function, datagram_count );
+    if ( count == 0 ) {
+      break;
+    }
+    sent += count;
+  }
+
+  if ( sent == 0 and not headers.empty() ) {
+    return WouldBlock();
+  }
+
+  return datagram_count;
+}
+
+/* send several datagrams to their addresses in one syscall */
+void UDPSocket::sendto_batch( const vector<pair<Address, string>> & datagrams )
+{
+  vector<iovec> iovecs( datagrams.size() );
+  vector<mmsghdr> headers( datagrams.size() );
+
+  for ( size_t i = 0; i < datagrams.size(); i++ ) {
+    const string & payload = datagrams[ i ].second;
+    iovecs[ i ] = { const_cast<char *>( payload.data() ), payload.size() };
+
+    zero( headers[ i ] );
+    headers[ i ].msg_hdr = datagram_header( &datagrams[ i ].first, &iovecs[ i ], 1 );
+  }
+
+  send_all( headers, "sendmmsg" );
+}
+
+/* fill send_headers_ for datagrams in the caller's buffers */
+void UDPSocket::prepare_batch( const vector<pair<Address, iovec>> & datagrams )
+{
+  send_headers_.resize( datagrams.size() );
+
+  for ( size_t i = 0; i < datagrams.size(); i++ ) {
+    zero( send_headers_[ i ] );
+    send_headers_[ i ].msg_hdr = datagram_header( &datagrams[ i ].first, &datagrams[ i ].second, 1 );
+  }
+}
+
+/* same, with each payload in the caller's buffer */
+void UDPSocket::sendto_batch( const vector<pair<Address, iovec>> & datagrams )
+{
+  prepare_batch( datagrams );
+  send_all( send_headers_, "sendmmsg" );
+}
+
+IOResult<size_t> UDPSocket::try_sendto_batch( const vector<pair<Address, iovec>> & datagrams )
+{
+  prepare_batch( datagrams );
+  return try_send_all( send_headers_, "sendmmsg" );
+}
+
+/* send several datagrams to connected address in one syscall */
+void UDPSocket::send_batch( const vector<string> & payloads )
+{
+  vector<iovec> iovecs( payloads.size() );
+  vector<mmsghdr> headers( payloads.size() );
+
+  for ( size_t i = 0; i < payloads.size(); i++ ) {
+    iovecs[ i ] = { const_cast<char *>( payloads[ i ].data() ), payloads[ i ].size() };
+
+    zero( headers[ i ] );
+    headers[ i ].msg_hdr = datagram_header( nullptr, &iovecs[ i ], 1 );
+  }
+
+  send_all( headers, "sendmmsg" );
+}
+
+/* send several datagrams to connected address, letting the kernel
+   split each run of equal-sized datagrams out of one gathered buffer */
+void UDPSocket::send_segmented( const vector<string> & payloads )
+{
+  vector<iovec> iovecs( payloads.size() );
+
+  for ( size_t i = 0; i < payloads.size(); i++ ) {
+    iovecs[ i ].iov_base = const_cast<char *>( payloads[ i ].data() );
+    iovecs[ i ].iov_len = payloads[ i ].size();
+  }
+
+  send_segmented( iovecs, 1 );
+}
+
+/* fill send_headers_ (and send_controls_) with runs of datagrams, each
+   gathered from iovecs_per_datagram consecutive iovecs */
+void UDPSocket::prepare_segmented( const vector<iovec> & iovecs, const size_t iovecs_per_datagram )
+{
+  if ( iovecs_per_datagram == 0 or iovecs.size() % iovecs_per_datagram ) {
+    throw runtime_error( "send_segmented: iovecs do not divide into datagrams" );
+  }
+
+  const size_t datagram_count = iovecs.size() / iovecs_per_datagram;
+
+  /* size of each datagram */
+  vector<size_t> & sizes = send_sizes_;
+  sizes.assign( datagram_count, 0 );
+  for ( size_t i = 0; i < datagram_count; i++ ) {
+    for ( size_t j = 0; j < iovecs_per_datagram; j++ ) {
+      sizes[ i ] += iovecs[ i * iovecs_per_datagram + j ].iov_len;
+    }
+  }
+
+  /* (headers point into controls, so it must not grow below) */
+  vector<segment_control> & controls = send_controls_;
+  vector<mmsghdr> & headers = send_headers_;
+  controls.clear();
+  headers.clear();
+  controls.reserve( datagram_count );
+  headers.reserve( datagram_count );
+
+  size_t i = 0;
+  while ( i < datagram_count ) {
+    /* a run is datagrams of the same size, optionally ending in one shorter datagram */
+    const size_t segment_size = sizes[ i ];
+    const size_t first = i;
+    size_t total = 0;
+
+    while ( i < datagram_count
+	    and i - first < MAX_SEGMENTS
+	    and total + sizes[ i ] <= MAX_SEGMENTED_SIZE
+	    and sizes[ i ] <= segment_size
+	    and ( segment_size > 0 or i == first )
+	    and ( gso_ or i == first ) ) {
+      total += sizes[ i ];
+
+      /* only the last datagram of a run can be short */
+      if ( sizes[ i++ ] < segment_size ) {
+	break;
+      }
+    }
+
+    headers.emplace_back();
+    mmsghdr & header = headers.back();
+    zero( header );
+    header.msg_hdr.msg_iov = const_cast<iovec *>( &iovecs[ first * iovecs_per_datagram ] );
+    header.msg_hdr.msg_iovlen = ( i - first ) * iovecs_per_datagram;
+
+    /* a run of one is just a datagram */
+    if ( i - first > 1 ) {
+      controls.emplace_back();
+      zero( controls.back() );
+      header.msg_hdr.msg_control = controls.back().buffer;
+      header.msg_hdr.msg_controllen = sizeof( controls.back().buffer );
+
+      cmsghdr * const control = CMSG_FIRSTHDR( &header.msg_hdr );
+      control->cmsg_level = SOL_UDP;
+      control->cmsg_type = UDP_SEGMENT;
+      control->cmsg_len = CMSG_LEN( sizeof( uint16_t ) );
+      *reinterpret_cast<uint16_t *>( CMSG_DATA( control ) ) = segment_size;
+    }
+  }
+}
+
+/* same, with each datagram gathered from iovecs_per_datagram consecutive iovecs */
+void UDPSocket::send_segmented( const vector<iovec> & iovecs, const size_t iovecs_per_datagram )
+{
+  prepare_segmented( iovecs, iovecs_per_datagram );
+  send_all( send_headers_, "sendmmsg" );
+}
+
+IOResult<size_t> UDPSocket::try_send_segmented( const vector<iovec> & iovecs,
+						const size_t iovecs_per_datagram )
+{
+  prepare_segmented( iovecs, iovecs_per_datagram );
+  return try_send_all( send_headers_, "sendmmsg" );
+}
+
 /* mark the socket as listening for incoming connections */
 void TCPSocket::listen( const int backlog )
 {
@@ -183,6 +746,20 @@ TCPSocket TCPSocket::accept( void )
   return TCPSocket( FileDescriptor( SystemCall( "accept", ::accept( fd_num(), nullptr, nullptr ) ) ) );
 }
 
+/* accept a pending connection (as a non-blocking socket) if there is one */
+IOResult<TCPSocket> TCPSocket::try_accept( void )
+{
+  register_read();
+
+  const auto fd = NonBlockingSystemCall( "accept4", ::accept4( fd_num(), nullptr, nullptr,
+							       SOCK_NONBLOCK | SOCK_CLOEXEC ) );
+  if ( not fd ) {
+    return WouldBlock();
+  }
+
+  return TCPSocket( FileDescriptor( fd.value() ) );
+}
+
 /* set socket option */
 template <typename option_type>
 void Socket::setsockopt( const int level, const int option, const option_type & option_value )
@@ -197,8 +774,144 @@ void Socket::set_reuseaddr( void )
   setsockopt( SOL_SOCKET, SO_REUSEADDR, int( true ) );
 }
 
+/* let several sockets bind the same address */
+void Socket::set_reuseport( void )
+{
+  setsockopt( SOL_SOCKET, SO_REUSEPORT, int( true ) );
+}
+
+/* steer each packet to the socket whose index matches the receiving CPU */
+void Socket::set_reuseport_cpu_affinity( void )
+{
+  /* classic BPF program: return the current CPU number */
+  sock_filter code[] = { { BPF_LD | BPF_W | BPF_ABS, 0, 0, uint32_t( SKF_AD_OFF + SKF_AD_CPU ) },
+			 { BPF_RET | BPF_A, 0, 0, 0 } };
+  sock_fprog program = { sizeof( code ) / sizeof( code[ 0 ] ), code };
+
+  setsockopt( SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, program );
+}
+
+/* have the kernel pace this socket's packets */
+void Socket::set_max_pacing_rate( const uint64_t bytes_per_second )
+{
+  setsockopt( SOL_SOCKET, SO_MAX_PACING_RATE, bytes_per_second );
+}
+
+/* let the kernel coalesce datagrams from the same source into one receive */
+void UDPSocket::set_gro( void )
+{
+  setsockopt( SOL_UDP, UDP_GRO, int( true ) );
+}
+
 /* turn on timestamps on receipt */
 void UDPSocket::set_timestamps( void )
 {
   setsockopt( SOL_SOCKET, SO_TIMESTAMPNS, int( true ) );
 }
+
+/* the socket polled as an error, but not for a timestamp: report the real error
+   (e.g. ECONNREFUSED after the peer's host said nobody was listening) */
+void UDPSocket::throw_pending_error( void )
+{
+  int error = 0;
+  socklen_t len = sizeof( error );
+  SystemCall( "getsockopt", getsockopt( fd_num(), SOL_SOCKET, SO_ERROR, &error, &len ) );
+
+  if ( error ) {
+    throw unix_error( "UDPSocket", error );
+  }
+}
+
+/* turn on software timestamps on transmit, numbered by message */
+void UDPSocket::set_transmit_timestamps( void )
+{
+  setsockopt( SOL_SOCKET, SO_TIMESTAMPING,
+	      int( SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+		   | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY ) );
+
+  /* the kernel numbers messages from 0 again */
+  transmit_timestamps_ = true;
+  first_unstamped_message_ = 0;
+  unstamped_messages_.clear();
+}
+
+/* read the transmit timestamps reported so far from the error queue */
+void UDPSocket::recv_transmit_timestamps( vector<transmit_timestamp> & timestamps )
+{
+  timestamps.clear();
+
+  const size_t batch_size = 64;
+  if ( batch_slots_.size() < batch_size ) {
+    batch_slots_.resize( batch_size );
+  }
+  batch_headers_.resize( batch_size );
+
+  bool first_batch = true;
+
+  while ( true ) {
+    for ( size_t i = 0; i < batch_size; i++ ) {
+      /* timestamps come without the datagram (SOF_TIMESTAMPING_OPT_TSONLY) */
+      zero( batch_headers_[ i ] );
+      batch_headers_[ i ].msg_hdr.msg_control = batch_slots_[ i ].control;
+      batch_headers_[ i ].msg_hdr.msg_controllen = sizeof( batch_slots_[ i ].control );
+    }
+
+    const auto result = NonBlockingSystemCall( "recvmmsg",
+					       recvmmsg( fd_num(), &batch_headers_[ 0 ], batch_size,
+							 MSG_ERRQUEUE | MSG_DONTWAIT, nullptr ) );
+    register_read();
+
+    if ( not result ) {
+      if ( first_batch ) {
+	throw_pending_error();
+      }
+      return;
+    }
+
+    first_batch = false;
+
+    for ( int i = 0; i < result.value(); i++ ) {
+      msghdr & header = batch_headers_[ i ].msg_hdr;
+
+      const scm_timestamping * stamp = nullptr;
+      const sock_extended_err * error = nullptr;
+
+      for ( cmsghdr * control = CMSG_FIRSTHDR( &header ); control; control = CMSG_NXTHDR( &header, control ) ) {
+	if ( control->cmsg_level == SOL_SOCKET and control->cmsg_type == SCM_TIMESTAMPING ) {
+	  stamp = reinterpret_cast<const scm_timestamping *>( CMSG_DATA( control ) );
+	} else if ( ( control->cmsg_level == SOL_IP and control->cmsg_type == IP_RECVERR )
+		    or ( control->cmsg_level == SOL_IPV6 and control->cmsg_type == IPV6_RECVERR ) ) {
+	  error = reinterpret_cast<const sock_extended_err *>( CMSG_DATA( control ) );
+	}
+      }
+
+      if ( not stamp or not error
+	   or error->ee_errno != ENOMSG
+	   or error->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ) {
+	continue;
+      }
+
+      /* which message this is, among those not yet reported */
+      const uint32_t index = error->ee_data - first_unstamped_message_;
+      if ( index >= unstamped_messages_.size() ) {
+	continue; /* forgotten, or already reported */
+      }
+
+      const uint64_t first_datagram = unstamped_messages_[ index ];
+      const uint64_t end_datagram = index + 1 < unstamped_messages_.size()
+	? unstamped_messages_[ index + 1 ] : datagrams_sent_;
+
+      timestamps.push_back( { first_datagram, size_t( end_datagram - first_datagram ),
+			      timestamp_us( stamp->ts[ 0 ] ) } );
+
+      /* any earlier message's timestamp was lost */
+      unstamped_messages_.erase( unstamped_messages_.begin(),
+				 unstamped_messages_.begin() + index + 1 );
+      first_unstamped_message_ = error->ee_data + 1;
+    }
+
+    if ( size_t( result.value() ) < batch_size ) {
+      return;
+    }
+  }
+}
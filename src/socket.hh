@@ -1,9 +1,14 @@
 #ifndef SOCKET_HH
 #define SOCKET_HH
 
+#include <deque>
 #include <functional>
+#include <vector>
+
+#include <sys/socket.h>
 
 #include "address.hh"
+#include "buffer_pool.hh"
 #include "file_descriptor.hh"
 
 /* class for network sockets (UDP, TCP, etc.) */
@@ -38,48 +43,273 @@ public:
 
   /* allow local address to be reused sooner, at the cost of some robustness */
   void set_reuseaddr( void );
+
+  /* let several sockets bind the same address, with the kernel spreading flows across them */
+  void set_reuseport( void );
+
+  /* steer each packet to the socket in this SO_REUSEPORT group whose index
+     (in bind order) matches the CPU that received it */
+  void set_reuseport_cpu_affinity( void );
+
+  /* have the kernel pace this socket's packets to at most this many bytes
+     per second (for UDP, only effective under the fq qdisc) */
+  void set_max_pacing_rate( const uint64_t bytes_per_second );
 };
 
 /* UDP socket */
 class UDPSocket : public Socket
 {
+private:
+  /* largest datagram that recv() can return */
+  static const size_t RECEIVE_MTU = 65536;
+
+  /* room for the control messages (e.g. timestamps) of one datagram */
+  static const size_t CONTROL_SIZE = 512;
+
+  /* most datagrams the kernel will split one segmented send into */
+  static const size_t MAX_SEGMENTS = 64;
+
+  /* most payload bytes in one segmented send (the largest UDP/IPv4 datagram) */
+  static const size_t MAX_SEGMENTED_SIZE = 65507;
+
 public:
-  UDPSocket() : Socket( AF_INET6, SOCK_DGRAM ) {}
+  /* storage for one datagram's source address and control messages while
+     a receive is pending (also usable with a completion engine like IOUring) */
+  struct receive_slot {
+    Address::raw source_address;
+    iovec payload_iovec;
+    char control[ CONTROL_SIZE ];
+
+    /* point header at this slot and at the payload buffer */
+    void prepare( msghdr & header, BufferPool::Buffer & payload );
+  };
+
+private:
+  /* per-datagram storage reused across calls to recv_batch() */
+  std::vector<mmsghdr> batch_headers_;
+  std::vector<receive_slot> batch_slots_;
+
+  /* room for a UDP_SEGMENT control message */
+  union segment_control {
+    char buffer[ CMSG_SPACE( sizeof( uint16_t ) ) ];
+    cmsghdr align;
+  };
+
+  /* storage reused across calls to sendto_batch() and send_segmented() */
+  std::vector<mmsghdr> send_headers_;
+  std::vector<size_t> send_sizes_;
+  std::vector<segment_control> send_controls_;
+
+  /* does the kernel take segmented sends? (cleared the first time it
+     refuses one, after which every datagram goes on its own) */
+  bool gso_;
 
+  /* buffers backing the std::string versions of recv() and recv_batch() */
+  BufferPool receive_pool_;
+
+  /* most sent messages to remember while their transmit timestamps are pending */
+  static const size_t MAX_UNSTAMPED_MESSAGES = 65536;
+
+  /* with transmit timestamps on: datagrams sent so far, and the first
+     datagram of each message sent since the last one the kernel reported
+     (the kernel numbers messages; the first here is first_unstamped_message_) */
+  bool transmit_timestamps_;
+  uint64_t datagrams_sent_;
+  uint32_t first_unstamped_message_;
+  std::deque<uint64_t> unstamped_messages_;
+
+  /* remember a sent message (of datagram_count datagrams) for its transmit timestamp */
+  void note_sent( const size_t datagram_count );
+
+  /* throw the socket's pending error (SO_ERROR), if any */
+  void throw_pending_error( void );
+
+  /* send a prepared header with sendmsg, returning how many datagrams
+     that made (or WouldBlock); send_one() throws instead of blocking */
+  IOResult<size_t> try_send_one( const msghdr & header, const std::string & name_of_function );
+  void send_one( const msghdr & header, const std::string & name_of_function );
+
+  /* send prepared headers with sendmmsg, from first on, as many as the
+     send buffer takes (returning how many, and counting their datagrams);
+     if the kernel refuses a segmented send, the rest are split into plain
+     datagrams and sent that way */
+  size_t send_headers( std::vector<mmsghdr> & headers, const size_t first,
+		       const std::string & name_of_function, size_t & datagram_count );
+
+  /* send all the prepared headers (throwing if the send buffer fills),
+     or as many as it takes (returning how many datagrams, or WouldBlock) */
+  void send_all( std::vector<mmsghdr> & headers, const std::string & name_of_function );
+  IOResult<size_t> try_send_all( std::vector<mmsghdr> & headers, const std::string & name_of_function );
+
+  /* fill send_headers_ for sendto_batch() or send_segmented() */
+  void prepare_batch( const std::vector<std::pair<Address, iovec>> & datagrams );
+  void prepare_segmented( const std::vector<iovec> & iovecs, const size_t iovecs_per_datagram );
+
+public:
+  UDPSocket()
+    : Socket( AF_INET6, SOCK_DGRAM ),
+      batch_headers_(), batch_slots_(), send_headers_(), send_sizes_(), send_controls_(),
+      gso_( true ),
+      receive_pool_( RECEIVE_MTU, 16 ),
+      transmit_timestamps_( false ), datagrams_sent_( 0 ),
+      first_unstamped_message_( 0 ), unstamped_messages_()
+  {}
+
+  /* segment_size is nonzero when GRO coalesced several datagrams from the
+     same source into the payload: each is segment_size bytes, except
+     possibly the last */
   struct received_datagram {
     Address source_address;
-    uint64_t timestamp;
+    uint64_t timestamp; /* in microseconds (see timestamp.hh) */
     std::string payload;
+    size_t segment_size;
   };
 
+  /* a received datagram whose payload refers into a pooled buffer */
+  struct received_datagram_view {
+    Address source_address;
+    uint64_t timestamp; /* in microseconds (see timestamp.hh) */
+    BufferPool::Buffer payload;
+    size_t segment_size;
+
+    received_datagram_view() : source_address(), timestamp( -1 ), payload(), segment_size( 0 ) {}
+
+    /* number of datagrams coalesced into the payload */
+    size_t segment_count( void ) const;
+
+    /* payload of one of those datagrams */
+    std::string segment( const size_t index ) const;
+
+    /* same, in place in the payload buffer (without copying) */
+    iovec segment_iovec( const size_t index );
+  };
+
+  /* where a datagram received into the caller's buffers came from */
+  struct received_header {
+    Address source_address;
+    uint64_t timestamp; /* in microseconds (see timestamp.hh) */
+    size_t length;
+    size_t segment_size;
+  };
+
+private:
+  /* receive a batch with recvmmsg, passing flags */
+  IOResult<size_t> receive_batch( BufferPool & pool,
+				  std::vector<received_datagram_view> & datagrams,
+				  const unsigned int max_datagrams,
+				  const int flags );
+
+public:
+  /* fill in a received datagram from a completed receive on a prepared slot */
+  static void finish_receive( msghdr & header, const size_t length,
+			      received_datagram_view & datagram );
+
   /* receive datagram, timestamp, and where it came from */
   received_datagram recv( void );
 
+  /* same, but into a buffer from the pool (no heap allocation) */
+  received_datagram_view recv( BufferPool & pool );
+
+  /* receive up to max_datagrams in one syscall
+     (blocks until at least one is available) */
+  std::vector<received_datagram> recv_batch( const unsigned int max_datagrams );
+
+  /* same, but into buffers from the pool, replacing the contents of datagrams
+     (no heap allocation once the vector and pool have grown to size) */
+  void recv_batch( BufferPool & pool,
+		   std::vector<received_datagram_view> & datagrams,
+		   const unsigned int max_datagrams );
+
+  /* same, but never block: returns how many were received, or WouldBlock
+     (leaving datagrams empty) if none were pending */
+  IOResult<size_t> try_recv_batch( BufferPool & pool,
+				   std::vector<received_datagram_view> & datagrams,
+				   const unsigned int max_datagrams );
+
+  /* receive one datagram scattered across the caller's buffers */
+  received_header recvmsg( const iovec * iov, const size_t count );
+
+  /* The send methods send everything they are given, waiting if the
+     socket is blocking; on a non-blocking socket, a full send buffer
+     throws. Their try_ versions never wait: each returns how many
+     datagrams the send buffer took (perhaps only the first few), or
+     WouldBlock if it took none, so an event loop can send the rest once
+     the socket polls as writable. */
+
   /* send datagram to specified address */
   void sendto( const Address & peer, const std::string & payload );
+  IOResult<size_t> try_sendto( const Address & peer, const std::string & payload );
+
+  /* send one datagram gathered from several buffers (e.g. header and payload) */
+  void sendmsg( const Address & peer, const iovec * iov, const size_t count );
+  void sendmsg( const iovec * iov, const size_t count );
+  IOResult<size_t> try_sendmsg( const iovec * iov, const size_t count );
 
   /* send datagram to connected address */
   void send( const std::string & payload );
 
+  /* send several datagrams to their addresses in one syscall */
+  void sendto_batch( const std::vector<std::pair<Address, std::string>> & datagrams );
+
+  /* same, with each payload in the caller's buffer (no heap allocation
+     once the vector has grown to size) */
+  void sendto_batch( const std::vector<std::pair<Address, iovec>> & datagrams );
+  IOResult<size_t> try_sendto_batch( const std::vector<std::pair<Address, iovec>> & datagrams );
+
+  /* send several datagrams to connected address in one syscall */
+  void send_batch( const std::vector<std::string> & payloads );
+
+  /* same, but let the kernel split each run of equal-sized datagrams
+     out of one buffer (UDP GSO), so the stack is traversed once per run */
+  void send_segmented( const std::vector<std::string> & payloads );
+
+  /* same, with each datagram gathered from iovecs_per_datagram consecutive iovecs */
+  void send_segmented( const std::vector<iovec> & iovecs, const size_t iovecs_per_datagram );
+  IOResult<size_t> try_send_segmented( const std::vector<iovec> & iovecs,
+				       const size_t iovecs_per_datagram );
+
+  /* let the kernel coalesce datagrams from the same source into one
+     receive (UDP GRO); see received_datagram::segment_size */
+  void set_gro( void );
+
   /* turn on timestamps on receipt */
   void set_timestamps( void );
+
+  /* when sent datagrams left the host, as reported by the kernel */
+  struct transmit_timestamp {
+    uint64_t first_datagram; /* numbered from 0 in the order sent, once turned on */
+    size_t datagram_count;   /* sent in the same message (e.g. by send_segmented) */
+    uint64_t timestamp;      /* in microseconds (see timestamp.hh) */
+  };
+
+  /* turn on (software) timestamps on transmit, taken as each message
+     is handed to the network device; while on, the socket polls as an
+     error until they are read */
+  void set_transmit_timestamps( void );
+
+  /* read the transmit timestamps reported so far, replacing the contents
+     of timestamps (never blocks); throws the socket's error if it polled
+     as an error for some other reason */
+  void recv_transmit_timestamps( std::vector<transmit_timestamp> & timestamps );
 };
 
 /* TCP socket */
 class TCPSocket : public Socket
 {
-private:
-  /* private constructor used by accept() */
-  TCPSocket( FileDescriptor && fd ) : Socket( std::move( fd ), AF_INET6, SOCK_STREAM ) {}
-
 public:
   TCPSocket() : Socket( AF_INET6, SOCK_STREAM ) {}
 
+  /* construct from an accepted connection (e.g. by accept() or IOUring) */
+  TCPSocket( FileDescriptor && fd ) : Socket( std::move( fd ), AF_INET6, SOCK_STREAM ) {}
+
   /* mark the socket as listening for incoming connections */
   void listen( const int backlog = 16 );
 
   /* accept a new incoming connection */
   TCPSocket accept( void );
+
+  /* accept a pending connection (as a non-blocking socket) if there is one */
+  IOResult<TCPSocket> try_accept( void );
 };
 
 #endif /* SOCKET_HH */
@@ -0,0 +1,300 @@
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <signal.h>
+
+#include "tcp_server.hh"
+#include "util.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+/* one worker's listening socket and connections */
+class TCPServer::Shard
+{
+private:
+  friend class TCPServer::Connection;
+
+  /* how long to stop accepting after running out of file descriptors */
+  static const uint64_t ACCEPT_BACKOFF_US = 100000;
+
+  Poller & poller_;
+  const Handlers & handlers_;
+
+  TCPSocket listener_;
+  Poller::ActionID accept_action_;
+
+  unordered_map< int, unique_ptr<Connection> > connections_;
+
+  /* closed connections, destroyed once their callbacks have returned */
+  vector< unique_ptr<Connection> > closed_;
+  bool reaping_;
+
+  BufferPool read_pool_;
+  BufferPool::Buffer read_buffer_;
+
+  /* accept every pending connection */
+  void accept_all( void );
+
+  /* read what a connection has sent and hand it to the data handler */
+  void read( Connection & connection );
+
+public:
+  Shard( Poller & poller, const Address & address, const Handlers & handlers );
+
+  /* close a connection now, discarding any queued output */
+  void close( Connection & connection );
+};
+
+TCPServer::Shard::Shard( Poller & poller, const Address & address, const Handlers & handlers )
+  : poller_( poller ),
+    handlers_( handlers ),
+    listener_(),
+    accept_action_(),
+    connections_(),
+    closed_(),
+    reaping_( false ),
+    read_pool_( 65536, 1 ),
+    read_buffer_( read_pool_.acquire() )
+{
+  /* every worker listens on the same port, and the kernel spreads connections across them */
+  listener_.set_reuseaddr();
+  listener_.set_reuseport();
+  listener_.bind( address );
+  listener_.listen( 4096 );
+  listener_.set_blocking( false );
+
+  accept_action_ = poller_.add_action( Action( listener_, Direction::In, [this] () {
+	accept_all();
+	return ResultType::Continue;
+      } ) );
+}
+
+/* accept every pending connection */
+void TCPServer::Shard::accept_all( void )
+{
+  while ( true ) {
+    IOResult<TCPSocket> accepted = WouldBlock();
+
+    try {
+      accepted = listener_.try_accept();
+    } catch ( const unix_error & e ) {
+      const int error = e.code().value();
+
+      if ( error == ECONNABORTED ) {
+	continue;
+      }
+
+      if ( error == EMFILE or error == ENFILE or error == ENOBUFS or error == ENOMEM ) {
+	/* pending connections stay queued until some close */
+	print_exception( e );
+	poller_.set_active( accept_action_, false );
+	poller_.add_timer( ACCEPT_BACKOFF_US, [this] () {
+	    poller_.set_active( accept_action_, true );
+	    return ResultType::Continue;
+	  } );
+	return;
+      }
+
+      throw;
+    }
+
+    if ( not accepted ) {
+      return;
+    }
+
+    Connection * connection;
+    try {
+      connection = new Connection( *this, move( accepted.value() ) );
+    } catch ( const unix_error & ) {
+      /* e.g. reset before we could look up the peer */
+      continue;
+    }
+
+    const int fd_num = connection->socket_.fd_num();
+    connections_[ fd_num ].reset( connection );
+
+    if ( handlers_.on_connect ) {
+      handlers_.on_connect( *connection );
+    }
+  }
+}
+
+/* read what a connection has sent and hand it to the data handler */
+void TCPServer::Shard::read( Connection & connection )
+{
+  IOResult<size_t> bytes_read = WouldBlock();
+
+  try {
+    bytes_read = connection.socket_.try_read( read_buffer_.data(), read_buffer_.capacity() );
+  } catch ( const unix_error & ) {
+    /* e.g. reset by peer */
+    close( connection );
+    return;
+  }
+
+  if ( not bytes_read ) {
+    return;
+  }
+
+  if ( connection.socket_.eof() ) {
+    /* the peer is done sending; finish sending to it, then close */
+    connection.close();
+    return;
+  }
+
+  connection.input_.append( read_buffer_.data(), bytes_read.value() );
+
+  if ( handlers_.on_data ) {
+    handlers_.on_data( connection );
+  }
+}
+
+/* close a connection now, discarding any queued output */
+void TCPServer::Shard::close( Connection & connection )
+{
+  auto it = connections_.find( connection.socket_.fd_num() );
+  if ( it == connections_.end() or it->second.get() != &connection ) {
+    return; /* already closed */
+  }
+
+  if ( handlers_.on_close ) {
+    handlers_.on_close( connection );
+  }
+
+  poller_.remove_action( connection.in_action_ );
+  poller_.remove_action( connection.out_action_ );
+
+  /* the poller may still be running one of this connection's callbacks */
+  closed_.push_back( move( it->second ) );
+  connections_.erase( it );
+
+  if ( not reaping_ ) {
+    reaping_ = true;
+    poller_.add_timer( 0, [this] () {
+	closed_.clear();
+	reaping_ = false;
+	return ResultType::Continue;
+      } );
+  }
+}
+
+TCPServer::Connection::Connection( Shard & shard, TCPSocket && socket )
+  : shard_( shard ),
+    socket_( move( socket ) ),
+    peer_( socket_.peer_address() ),
+    input_(),
+    output_(),
+    output_offset_( 0 ),
+    closing_( false ),
+    in_action_(),
+    out_action_(),
+    out_active_( false )
+{
+  Action in( socket_, Direction::In, [this] () {
+      shard_.read( *this );
+      return ResultType::Continue;
+    } );
+
+  /* a reset connection reports an error instead of being readable */
+  in.error_callback = [this] () {
+    shard_.close( *this );
+    return ResultType::Continue;
+  };
+
+  in_action_ = shard_.poller_.add_action( in );
+
+  out_action_ = shard_.poller_.add_action( Action( socket_, Direction::Out, [this] () {
+	flush();
+	return ResultType::Continue;
+      } ) );
+
+  /* only wait to write when the socket has been full */
+  shard_.poller_.set_active( out_action_, false );
+}
+
+/* write as much queued output as the socket will take */
+void TCPServer::Connection::flush( void )
+{
+  try {
+    while ( pending_output() ) {
+      const auto bytes_written = socket_.try_write( output_.data() + output_offset_,
+						    pending_output() );
+      if ( not bytes_written ) {
+	break;
+      }
+
+      output_offset_ += bytes_written.value();
+    }
+  } catch ( const unix_error & ) {
+    /* e.g. broken pipe */
+    shard_.close( *this );
+    return;
+  }
+
+  if ( pending_output() == 0 ) {
+    output_.clear();
+    output_offset_ = 0;
+  }
+
+  /* poll for room only while there is output left over */
+  if ( out_active_ != ( pending_output() > 0 ) ) {
+    out_active_ = not out_active_;
+    shard_.poller_.set_active( out_action_, out_active_ );
+  }
+
+  if ( closing_ and pending_output() == 0 ) {
+    shard_.close( *this );
+  }
+}
+
+/* queue data to send, writing immediately if the socket has room */
+void TCPServer::Connection::send( const string & data )
+{
+  if ( closing_ ) {
+    return;
+  }
+
+  output_.append( data );
+
+  /* if already waiting for room, the out action will write it */
+  if ( not out_active_ ) {
+    flush();
+  }
+}
+
+/* close once queued output has been written */
+void TCPServer::Connection::close( void )
+{
+  if ( closing_ ) {
+    return;
+  }
+
+  closing_ = true;
+
+  if ( pending_output() == 0 ) {
+    shard_.close( *this );
+  } else {
+    /* ignore anything more the peer sends */
+    shard_.poller_.set_active( in_action_, false );
+  }
+}
+
+TCPServer::TCPServer( const Address & address, const Handlers & handlers,
+		      const unsigned int worker_count )
+  : address_( address ),
+    handlers_( handlers ),
+    reactors_( worker_count )
+{}
+
+/* serve until stopped (or a worker fails) */
+unsigned int TCPServer::run( void )
+{
+  /* a peer that goes away mid-write should close its connection, not the server */
+  signal( SIGPIPE, SIG_IGN );
+
+  return reactors_.run( [this] ( ReactorPool::Worker & worker ) {
+      worker.make<Shard>( worker.poller(), address_, handlers_ );
+    } );
+}
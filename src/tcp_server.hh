@@ -0,0 +1,87 @@
+#ifndef TCP_SERVER_HH
+#define TCP_SERVER_HH
+
+#include <functional>
+#include <string>
+
+#include "address.hh"
+#include "poller.hh"
+#include "reactor.hh"
+#include "socket.hh"
+
+/* Event-driven TCP server. Each ReactorPool worker listens on its own
+   SO_REUSEPORT socket and serves the connections it accepts from its
+   Poller, with non-blocking sockets and per-connection buffers, so an
+   idle connection costs a small object rather than a thread. */
+class TCPServer
+{
+private:
+  class Shard; /* one worker's listening socket and connections */
+
+public:
+  /* one client connection (only valid until its close handler returns) */
+  class Connection
+  {
+  private:
+    friend class TCPServer::Shard;
+
+    Shard & shard_;
+    TCPSocket socket_;
+    Address peer_;
+
+    std::string input_;  /* received, not yet consumed by the data handler */
+    std::string output_; /* queued, not yet written (from output_offset_) */
+    size_t output_offset_;
+    bool closing_;
+
+    Poller::ActionID in_action_, out_action_;
+    bool out_active_; /* waiting for room to write */
+
+    /* write as much queued output as the socket will take */
+    void flush( void );
+
+  public:
+    Connection( Shard & shard, TCPSocket && socket );
+
+    const Address & peer( void ) const { return peer_; }
+
+    /* bytes received so far; the data handler erases what it consumes */
+    std::string & input( void ) { return input_; }
+
+    /* queue data to send, writing immediately if the socket has room */
+    void send( const std::string & data );
+
+    /* close once queued output has been written */
+    void close( void );
+
+    size_t pending_output( void ) const { return output_.size() - output_offset_; }
+  };
+
+  /* what to do as connections open, send data, and close;
+     empty handlers are skipped */
+  struct Handlers
+  {
+    std::function<void(Connection &)> on_connect;
+    std::function<void(Connection &)> on_data;
+    std::function<void(Connection &)> on_close;
+
+    Handlers() : on_connect(), on_data(), on_close() {}
+  };
+
+private:
+  Address address_;
+  Handlers handlers_;
+  ReactorPool reactors_;
+
+public:
+  TCPServer( const Address & address, const Handlers & handlers,
+	     const unsigned int worker_count = ReactorPool::cpu_count() );
+
+  /* serve until stopped (or a worker fails) */
+  unsigned int run( void );
+
+  /* ask every worker to stop (safe to call from any thread) */
+  void stop( void ) { reactors_.stop(); }
+};
+
+#endif /* TCP_SERVER_HH */
@@ -0,0 +1,285 @@
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#include "timer_wheel.hh"
+
+using namespace std;
+
+/* start the wheel at the given time (in microseconds) */
+TimerWheel::TimerWheel( const uint64_t now )
+  : timers_(),
+    free_(),
+    heads_( LEVELS * SLOTS, NONE ),
+    occupied_(),
+    level_counts_(),
+    now_( now ),
+    pending_( 0 )
+{}
+
+/* look up a live timer (throws if the ID is stale) */
+uint32_t TimerWheel::index( const TimerID id ) const
+{
+  if ( not valid( id ) ) {
+    throw runtime_error( "TimerWheel: no such timer" );
+  }
+
+  return id & 0xffffffff;
+}
+
+bool TimerWheel::valid( const TimerID id ) const
+{
+  const uint32_t index = id & 0xffffffff;
+  return index < timers_.size()
+    and timers_[ index ].generation == (id >> 32)
+    and timers_[ index ].state != Timer::State::Free;
+}
+
+bool TimerWheel::pending( const TimerID id ) const
+{
+  return valid( id ) and timers_[ id & 0xffffffff ].state == Timer::State::Pending;
+}
+
+uint64_t TimerWheel::expiry( const TimerID id ) const
+{
+  return timers_[ index( id ) ].expiry;
+}
+
+/* put a pending timer into the slot for its expiry */
+void TimerWheel::file( const uint32_t index )
+{
+  Timer & timer = timers_[ index ];
+
+  /* timers in the past fire on the current tick */
+  uint64_t when = max( timer.expiry, now_ );
+  const uint64_t delta = when - now_;
+
+  /* the lowest level whose span covers the delay */
+  unsigned int level = 0;
+  while ( level < LEVELS - 1 and delta >> (SLOT_BITS * (level + 1)) ) {
+    level++;
+  }
+
+  /* beyond the wheel's span: park at the far end of the top level */
+  if ( delta >> (SLOT_BITS * LEVELS) ) {
+    when = now_ + (uint64_t( 1 ) << (SLOT_BITS * LEVELS)) - 1;
+  }
+
+  const unsigned int slot = (when >> (SLOT_BITS * level)) & (SLOTS - 1);
+  uint32_t & head = heads_[ level * SLOTS + slot ];
+
+  timer.level = level;
+  timer.slot = slot;
+  timer.prev = NONE;
+  timer.next = head;
+  if ( head != NONE ) {
+    timers_[ head ].prev = index;
+  }
+  head = index;
+
+  occupied_[ level ][ slot / 64 ] |= uint64_t( 1 ) << (slot % 64);
+  level_counts_[ level ]++;
+}
+
+/* take a pending timer out of its slot */
+void TimerWheel::unfile( const uint32_t index )
+{
+  Timer & timer = timers_[ index ];
+  uint32_t & head = heads_[ timer.level * SLOTS + timer.slot ];
+
+  if ( timer.prev == NONE ) {
+    head = timer.next;
+  } else {
+    timers_[ timer.prev ].next = timer.next;
+  }
+
+  if ( timer.next != NONE ) {
+    timers_[ timer.next ].prev = timer.prev;
+  }
+
+  if ( head == NONE ) {
+    occupied_[ timer.level ][ timer.slot / 64 ] &= ~(uint64_t( 1 ) << (timer.slot % 64));
+  }
+  level_counts_[ timer.level ]--;
+
+  timer.prev = timer.next = NONE;
+}
+
+/* add a timer for an absolute expiry */
+TimerWheel::TimerID TimerWheel::schedule( const uint64_t expiry )
+{
+  uint32_t index;
+  if ( free_.empty() ) {
+    if ( timers_.size() >= NONE ) {
+      throw runtime_error( "TimerWheel: too many timers" );
+    }
+    index = timers_.size();
+    timers_.emplace_back();
+  } else {
+    index = free_.back();
+    free_.pop_back();
+  }
+
+  Timer & timer = timers_[ index ];
+  timer.state = Timer::State::Pending;
+  timer.expiry = expiry;
+  file( index );
+  pending_++;
+
+  return (uint64_t( timer.generation ) << 32) | index;
+}
+
+/* move a pending or fired timer to a new expiry */
+void TimerWheel::reschedule( const TimerID id, const uint64_t expiry )
+{
+  const uint32_t i = index( id );
+  Timer & timer = timers_[ i ];
+
+  if ( timer.state == Timer::State::Pending ) {
+    unfile( i );
+  } else {
+    timer.state = Timer::State::Pending;
+    pending_++;
+  }
+
+  timer.expiry = expiry;
+  file( i );
+}
+
+/* forget a timer (pending or fired) */
+void TimerWheel::cancel( const TimerID id )
+{
+  const uint32_t i = index( id );
+  Timer & timer = timers_[ i ];
+
+  if ( timer.state == Timer::State::Pending ) {
+    unfile( i );
+    pending_--;
+  }
+
+  timer.state = Timer::State::Free;
+  timer.generation++;
+  free_.push_back( i );
+}
+
+/* move the timers in a level's current slot down to lower levels */
+void TimerWheel::cascade( const unsigned int level )
+{
+  if ( level >= LEVELS ) {
+    return;
+  }
+
+  const unsigned int slot = (now_ >> (SLOT_BITS * level)) & (SLOTS - 1);
+
+  /* when this level wraps around, the level above moves down first */
+  if ( slot == 0 ) {
+    cascade( level + 1 );
+  }
+
+  uint32_t index = heads_[ level * SLOTS + slot ];
+  while ( index != NONE ) {
+    const uint32_t next = timers_[ index ].next;
+    unfile( index );
+    file( index );
+    index = next;
+  }
+}
+
+/* process every tick up to and including now */
+void TimerWheel::advance( const uint64_t now, vector<TimerID> & fired )
+{
+  while ( now_ <= now ) {
+    /* at each block boundary, bring the next block's timers down */
+    if ( (now_ & (SLOTS - 1)) == 0 ) {
+      cascade( 1 );
+    }
+
+    /* fire everything in the current slot */
+    uint32_t & head = heads_[ now_ & (SLOTS - 1) ];
+    while ( head != NONE ) {
+      const uint32_t index = head;
+      Timer & timer = timers_[ index ];
+      unfile( index );
+      timer.state = Timer::State::Fired;
+      pending_--;
+      fired.push_back( (uint64_t( timer.generation ) << 32) | index );
+    }
+
+    if ( pending_ == 0 ) {
+      now_ = now + 1;
+      break;
+    }
+
+    /* skip ahead to the next boundary of the lowest occupied level */
+    unsigned int level = 0;
+    while ( level_counts_[ level ] == 0 ) {
+      level++;
+    }
+
+    if ( level == 0 ) {
+      /* the next occupied slot in this block, or the block's end */
+      const unsigned int current = now_ & (SLOTS - 1);
+      const unsigned int slot = next_occupied( 0, current );
+      now_ = min( slot > current ? now_ + (slot - current)
+		  : ((now_ >> SLOT_BITS) + 1) << SLOT_BITS,
+		  now + 1 );
+    } else {
+      const unsigned int shift = SLOT_BITS * level;
+      now_ = min( ((now_ >> shift) + 1) << shift, now + 1 );
+    }
+  }
+}
+
+/* first occupied slot at or after start (wrapping around), or SLOTS */
+unsigned int TimerWheel::next_occupied( const unsigned int level, const unsigned int start ) const
+{
+  for ( unsigned int i = 0; i <= SLOTS / 64; i++ ) {
+    const unsigned int word = (start / 64 + i) % (SLOTS / 64);
+    uint64_t bits = occupied_[ level ][ word ];
+
+    /* ignore slots before start on the first pass */
+    if ( i == 0 ) {
+      bits &= ~uint64_t( 0 ) << (start % 64);
+    }
+
+    if ( bits ) {
+      return word * 64 + __builtin_ctzll( bits );
+    }
+  }
+
+  return SLOTS;
+}
+
+/* earliest time advance() may have work to do */
+uint64_t TimerWheel::next_expiry( void ) const
+{
+  uint64_t earliest = numeric_limits<uint64_t>::max();
+
+  for ( unsigned int level = 0; level < LEVELS; level++ ) {
+    if ( level_counts_[ level ] == 0 ) {
+      continue;
+    }
+
+    const unsigned int shift = SLOT_BITS * level;
+    const unsigned int current = (now_ >> shift) & (SLOTS - 1);
+
+    /* the current slot of a higher level was already cascaded,
+       unless we are sitting exactly on its boundary */
+    const bool aligned = level == 0 or (now_ & ((uint64_t( 1 ) << shift) - 1)) == 0;
+    const unsigned int start = aligned ? current : (current + 1) % SLOTS;
+
+    unsigned int slot = next_occupied( level, start );
+    if ( slot == SLOTS ) {
+      continue;
+    }
+
+    const uint64_t distance = (slot + SLOTS - current) % SLOTS;
+    const uint64_t when = distance == 0 and not aligned
+      ? (((now_ >> shift) + SLOTS) << shift)
+      : (((now_ >> shift) + distance) << shift);
+
+    earliest = min( earliest, max( when, now_ ) );
+  }
+
+  return earliest;
+}
@@ -0,0 +1,95 @@
+#ifndef TIMER_WHEEL_HH
+#define TIMER_WHEEL_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* Hierarchical timing wheel with one-microsecond ticks. Four levels of
+   256 slots cover 2^32 us (about 71 minutes) exactly; later timers wait
+   in the top level and are re-filed as the wheel turns. Scheduling,
+   rescheduling and cancelling are O(1); advancing skips empty stretches. */
+class TimerWheel
+{
+public:
+  /* index in the low 32 bits, generation in the high 32 bits */
+  typedef uint64_t TimerID;
+
+private:
+  static const unsigned int LEVELS = 4;
+  static const unsigned int SLOT_BITS = 8;
+  static const unsigned int SLOTS = 1 << SLOT_BITS;
+  static const uint32_t NONE = uint32_t( -1 );
+
+  struct Timer
+  {
+    enum class State { Free, Pending, Fired } state;
+    uint32_t generation;
+    uint64_t expiry;
+
+    /* position in a slot's doubly-linked list */
+    unsigned int level, slot;
+    uint32_t prev, next;
+
+    Timer() : state( State::Free ), generation( 0 ), expiry( 0 ),
+	      level( 0 ), slot( 0 ), prev( NONE ), next( NONE ) {}
+  };
+
+  std::vector<Timer> timers_;
+  std::vector<uint32_t> free_;
+
+  /* list heads, one per slot per level */
+  std::vector<uint32_t> heads_;
+
+  /* which slots are occupied, as one 256-bit map per level */
+  uint64_t occupied_[ LEVELS ][ SLOTS / 64 ];
+  unsigned int level_counts_[ LEVELS ];
+
+  /* next tick to process */
+  uint64_t now_;
+  size_t pending_;
+
+  /* look up a live timer (throws if the ID is stale) */
+  uint32_t index( const TimerID id ) const;
+
+  /* put a pending timer into the slot for its expiry, or take it out */
+  void file( const uint32_t index );
+  void unfile( const uint32_t index );
+
+  /* move the timers in a level's current slot down to lower levels */
+  void cascade( const unsigned int level );
+
+  /* first occupied slot at or after start (wrapping around), or SLOTS */
+  unsigned int next_occupied( const unsigned int level, const unsigned int start ) const;
+
+public:
+  /* start the wheel at the given time (in microseconds) */
+  TimerWheel( const uint64_t now );
+
+  /* add a timer for an absolute expiry (timers in the past fire on the next advance) */
+  TimerID schedule( const uint64_t expiry );
+
+  /* move a pending or fired timer to a new expiry */
+  void reschedule( const TimerID id, const uint64_t expiry );
+
+  /* forget a timer (pending or fired); its ID becomes stale */
+  void cancel( const TimerID id );
+
+  /* is this ID still pending or fired (not cancelled or released)? */
+  bool valid( const TimerID id ) const;
+  bool pending( const TimerID id ) const;
+  uint64_t expiry( const TimerID id ) const;
+
+  /* process every tick up to and including now, appending fired timers
+     (which stay valid until released, rescheduled or cancelled) */
+  void advance( const uint64_t now, std::vector<TimerID> & fired );
+
+  /* earliest time advance() may have work to do (exact for timers in
+     the lowest level, a cascade point otherwise), or UINT64_MAX */
+  uint64_t next_expiry( void ) const;
+
+  /* number of pending timers */
+  size_t size( void ) const { return pending_; }
+};
+
+#endif /* TIMER_WHEEL_HH */
@@ -1,36 +1,166 @@
+#include <algorithm>
 #include <ctime>
 
+#include "config.h"
 #include "timestamp.hh"
 #include "util.hh"
 
+#if defined( USE_TSC_CLOCK ) && defined( __x86_64__ )
+#include <cpuid.h>
+#include <x86intrin.h>
+#define TSC_CLOCK_AVAILABLE
+#endif
+
+/* nanoseconds per microsecond */
+static const uint64_t THOUSAND = 1000;
+
 /* nanoseconds per millisecond */
-static const uint64_t MILLION = 1000000;
+static const uint64_t MILLION = 1000 * THOUSAND;
 
 /* nanoseconds per second */
 static const uint64_t BILLION = 1000 * MILLION;
 
 /* helper functions */
-static timespec current_time( void )
+static uint64_t nanoseconds( const timespec & ts )
+{
+  return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+static uint64_t current_time_ns( const clockid_t clock )
 {
   timespec ret;
-  SystemCall( "clock_gettime", clock_gettime( CLOCK_REALTIME, &ret ) );
-  return ret;
+  SystemCall( "clock_gettime", clock_gettime( clock, &ret ) );
+  return nanoseconds( ret );
 }
 
-static uint64_t timestamp_ms_raw( const timespec & ts )
+#ifdef TSC_CLOCK_AVAILABLE
+/* the TSC's rate, measured against CLOCK_MONOTONIC */
+class TSCClock
 {
-  const uint64_t nanos = ts.tv_sec * BILLION + ts.tv_nsec;
-  return nanos / MILLION;
+private:
+  /* how long to spend measuring the TSC's rate */
+  static const uint64_t CALIBRATION_NS = 20 * MILLION;
+
+  /* how often each thread re-anchors its reading to CLOCK_MONOTONIC, so
+     that the error in the measured rate (a few ppm) can't add up to more
+     than a few microseconds, here or between processes */
+  static const uint64_t ANCHOR_LIFETIME_NS = BILLION;
+
+  bool invariant_;
+  double ns_per_tick_;
+
+  /* does the TSC tick at a constant rate, even across sleep states? */
+  static bool tsc_is_invariant( void )
+  {
+    unsigned int eax, ebx, ecx, edx;
+    if ( not __get_cpuid( 0x80000007, &eax, &ebx, &ecx, &edx ) ) {
+      return false;
+    }
+    return edx & ( 1 << 8 );
+  }
+
+public:
+  TSCClock()
+    : invariant_( tsc_is_invariant() ), ns_per_tick_( 0 )
+  {
+    if ( not invariant_ ) {
+      return;
+    }
+
+    const uint64_t start_ns = current_time_ns( CLOCK_MONOTONIC );
+    const uint64_t start_tsc = __rdtsc();
+
+    uint64_t now_ns;
+    do {
+      now_ns = current_time_ns( CLOCK_MONOTONIC );
+    } while ( now_ns - start_ns < CALIBRATION_NS );
+
+    ns_per_tick_ = double( now_ns - start_ns ) / double( __rdtsc() - start_tsc );
+  }
+
+  bool invariant( void ) const { return invariant_; }
+
+  uint64_t now_ns( void ) const
+  {
+    /* this thread's anchor, and its last reading (so that re-anchoring
+       never takes its time backward) */
+    static thread_local uint64_t anchor_tsc = 0, anchor_ns = 0, last_ns = 0;
+
+    uint64_t ns = anchor_ns + uint64_t( double( __rdtsc() - anchor_tsc ) * ns_per_tick_ );
+
+    if ( anchor_ns == 0 or ns - anchor_ns > ANCHOR_LIFETIME_NS ) {
+      anchor_ns = current_time_ns( CLOCK_MONOTONIC );
+      anchor_tsc = __rdtsc();
+      ns = anchor_ns;
+    }
+
+    ns = std::max( ns, last_ns );
+    last_ns = ns;
+    return ns;
+  }
+};
+
+static const TSCClock & tsc_clock( void )
+{
+  static const TSCClock clock;
+  return clock;
+}
+#endif
+
+bool timestamp_uses_tsc( void )
+{
+#ifdef TSC_CLOCK_AVAILABLE
+  return tsc_clock().invariant();
+#else
+  return false;
+#endif
+}
+
+/* Current time in nanoseconds */
+uint64_t timestamp_ns( void )
+{
+#ifdef TSC_CLOCK_AVAILABLE
+  const TSCClock & clock = tsc_clock();
+  if ( clock.invariant() ) {
+    return clock.now_ns();
+  }
+#endif
+
+  return current_time_ns( CLOCK_MONOTONIC );
+}
+
+/* Current time in microseconds */
+uint64_t timestamp_us( void )
+{
+  return timestamp_ns() / THOUSAND;
 }
 
-/* Current time in milliseconds since the start of the program */
+/* Current time in milliseconds */
 uint64_t timestamp_ms( void )
 {
-  return timestamp_ms( current_time() );
+  return timestamp_ns() / MILLION;
 }
 
-uint64_t timestamp_ms( const timespec & ts )
+/* A kernel timestamp on CLOCK_REALTIME, converted to microseconds on the monotonic clock */
+uint64_t timestamp_us( const timespec & realtime )
 {
-  const static uint64_t EPOCH = timestamp_ms_raw( current_time() );
-  return timestamp_ms_raw( ts ) - EPOCH;
+  /* how often to remeasure the offset between the clocks (which moves
+     when the realtime clock is stepped or slewed) */
+  static const uint64_t OFFSET_LIFETIME_NS = BILLION;
+
+  static thread_local int64_t offset_ns = 0;
+  static thread_local uint64_t offset_measured_ns = 0;
+
+  const uint64_t now_ns = timestamp_ns();
+  if ( offset_measured_ns == 0 or now_ns - offset_measured_ns > OFFSET_LIFETIME_NS ) {
+    /* bracket the realtime reading between two monotonic readings */
+    const uint64_t before = timestamp_ns();
+    const uint64_t real = current_time_ns( CLOCK_REALTIME );
+    const uint64_t after = timestamp_ns();
+
+    offset_ns = int64_t( real - ( before + ( after - before ) / 2 ) );
+    offset_measured_ns = after;
+  }
+
+  return ( nanoseconds( realtime ) - offset_ns ) / THOUSAND;
 }
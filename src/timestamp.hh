@@ -4,8 +4,27 @@
 #include <ctime>
 #include <cstdint>
 
-/* Current time in milliseconds since the start of the program */
+/* All timestamps are on the monotonic clock, so they never jump and
+   are comparable between processes on the same host. When configured
+   with --enable-tsc-clock, the clock is read from an invariant TSC
+   instead, calibrated against CLOCK_MONOTONIC at startup and re-anchored
+   to it every second, so it stays within a few microseconds of it (and
+   so of other processes). */
+
+/* Current time in nanoseconds */
+uint64_t timestamp_ns( void );
+
+/* Current time in microseconds */
+uint64_t timestamp_us( void );
+
+/* Current time in milliseconds */
 uint64_t timestamp_ms( void );
-uint64_t timestamp_ms( const timespec & ts );
+
+/* A kernel timestamp on CLOCK_REALTIME (e.g. from SO_TIMESTAMPNS),
+   converted to microseconds on the monotonic clock */
+uint64_t timestamp_us( const timespec & realtime );
+
+/* Is the clock being read from the TSC? */
+bool timestamp_uses_tsc( void );
 
 #endif /* TIMESTAMP_HH */
@@ -5,6 +5,11 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <cerrno>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
 
 /* tagged_error: system_error + name of what was being attempted */
 class tagged_error : public std::system_error
@@ -58,6 +63,102 @@ inline int SystemCall( const std::string & s_attempt, const int return_value )
   return SystemCall( s_attempt.c_str(), return_value );
 }
 
+/* marker for an operation that would have blocked */
+struct WouldBlock {};
+
+/* outcome of an operation that may find nothing to do on a non-blocking
+   file descriptor: a value, or WouldBlock (which is not an error) */
+template <typename T>
+class IOResult
+{
+private:
+  bool completed_;
+
+  /* holds a T only if completed_ (so T needn't be default-constructible) */
+  typename std::aligned_storage<sizeof( T ), alignof( T )>::type storage_;
+
+  T & stored( void ) { return *reinterpret_cast<T *>( &storage_ ); }
+  const T & stored( void ) const { return *reinterpret_cast<const T *>( &storage_ ); }
+
+  void check( void ) const
+  {
+    if ( not completed_ ) {
+      throw std::runtime_error( "IOResult: operation would have blocked" );
+    }
+  }
+
+public:
+  IOResult( const T & value ) : completed_( true ), storage_() { new ( &storage_ ) T( value ); }
+  IOResult( T && value ) : completed_( true ), storage_() { new ( &storage_ ) T( std::move( value ) ); }
+  IOResult( const WouldBlock & ) : completed_( false ), storage_() {}
+
+  IOResult( const IOResult & other )
+    : completed_( other.completed_ ), storage_()
+  {
+    if ( completed_ ) {
+      new ( &storage_ ) T( other.stored() );
+    }
+  }
+
+  IOResult( IOResult && other )
+    : completed_( other.completed_ ), storage_()
+  {
+    if ( completed_ ) {
+      new ( &storage_ ) T( std::move( other.stored() ) );
+    }
+  }
+
+  IOResult & operator=( IOResult other )
+  {
+    if ( completed_ ) {
+      stored().~T();
+    }
+
+    completed_ = other.completed_;
+    if ( completed_ ) {
+      new ( &storage_ ) T( std::move( other.stored() ) );
+    }
+
+    return *this;
+  }
+
+  ~IOResult()
+  {
+    if ( completed_ ) {
+      stored().~T();
+    }
+  }
+
+  /* did the operation complete (rather than would have blocked)? */
+  bool completed( void ) const { return completed_; }
+  explicit operator bool( void ) const { return completed_; }
+
+  /* the result of a completed operation */
+  const T & value( void ) const { check(); return stored(); }
+  T & value( void ) { check(); return stored(); }
+};
+
+/* version of SystemCall for non-blocking file descriptors,
+   where EAGAIN is an ordinary result rather than an exception */
+inline IOResult<int> NonBlockingSystemCall( const char * s_attempt, const int return_value )
+{
+  if ( return_value >= 0 ) {
+    return return_value;
+  }
+
+  if ( errno == EAGAIN or errno == EWOULDBLOCK ) {
+    return WouldBlock();
+  }
+
+  throw unix_error( s_attempt );
+}
+
+/* version of NonBlockingSystemCall that takes a C++ std::string */
+inline IOResult<int> NonBlockingSystemCall( const std::string & s_attempt, const int return_value )
+{
+  return NonBlockingSystemCall( s_attempt.c_str(), return_value );
+}
+
 /* zero out an arbitrary structure */
 template <typename T> void zero( T & x ) { memset( &x, 0, sizeof( x ) ); }
 